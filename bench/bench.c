@@ -0,0 +1,558 @@
+/* Standalone microbenchmarks - see `make bench` */
+#include <inc/crypt.h>
+#include <inc/general.h>
+#include <inc/io_engine.h>
+#include <inc/lane_queue.h>
+#include <inc/message.h>
+#include <inc/seal_pool.h>
+#include <inc/socket_utilities.h>
+#include <inc/window_manager.h>
+
+#define INIT  //Initialize settings
+#include <inc/setting.h>
+
+#define BENCH_RUNS 5
+#define BENCH_MIN_NS 100000000 // Calibrated batch must run at least 0.1 s
+#define BENCH_MAX_RESULTS 64
+#define BENCH_NAME_LEN 48
+#define BENCH_DEFAULT_THRESHOLD 5.0
+#define MAX_PRODUCERS 8
+#define PREENCRYPTED_PACKETS 1000
+#define ENGINE_SOCKETS 64
+#define ENGINE_WRITE_BYTES 64
+#define SEAL_RECIPIENTS 256
+#define SEAL_PACKET_BYTES 128
+
+typedef struct _bench_result{
+    char name[BENCH_NAME_LEN];
+    int param;
+    long iterations;
+    double ns_per_op;
+}Bench_result;
+
+typedef void (*Bench_fn)(long iterations, int param);
+
+Bench_result results[BENCH_MAX_RESULTS];
+int result_count = 0;
+
+Lane_queue bench_lanes; // the broadcaster's kind of queue, under r_lock like it
+
+gcry_cipher_hd_t bench_handle;
+char bench_packet[PACKET_MAX_BYTES];
+int prepared_size = -1; // of bench_decrypt's packets, -1 after the suite changes
+
+/**************************   HARNESS   **************************/
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(double *)a, y = *(double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Doubles the iteration count until a batch is long enough, reports the median run */
+void run_bench(char *name, Bench_fn fn, int param) {
+  long iterations = 1;
+  uint64_t start, elapsed;
+  double runs[BENCH_RUNS];
+
+  while (true) {
+    start = get_monotonic_nanosecs();
+    fn(iterations, param);
+    elapsed = get_monotonic_nanosecs() - start;
+
+    if (elapsed >= BENCH_MIN_NS || iterations > LONG_MAX / 2)
+      break;
+
+    iterations *= 2;
+  }
+
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    start = get_monotonic_nanosecs();
+    fn(iterations, param);
+    runs[run] = (double)(get_monotonic_nanosecs() - start) / iterations;
+  }
+
+  qsort(runs, BENCH_RUNS, sizeof(double), compare_doubles);
+
+  Bench_result *result = &results[result_count++];
+  snprintf(result->name, BENCH_NAME_LEN, "%s", name);
+  result->param = param;
+  result->iterations = iterations;
+  result->ns_per_op = runs[BENCH_RUNS / 2];
+
+  fprintf(stderr, "%-28s %6d %12.1f ns/op\n", name, param, result->ns_per_op);
+
+  return;
+}
+
+void write_results(FILE *out, bool json) {
+  if (json) {
+    fprintf(out, "[\n");
+    for (int i = 0; i < result_count; i++) {
+      fprintf(
+          out,
+          "  {\"name\": \"%s\", \"param\": %d, \"iterations\": %ld, \"ns_per_op\": %.1f}%s\n",
+          results[i].name, results[i].param, results[i].iterations,
+          results[i].ns_per_op, (i < result_count - 1) ? "," : "");
+    }
+    fprintf(out, "]\n");
+
+    return;
+  }
+
+  fprintf(out, "name,param,iterations,ns_per_op\n");
+  for (int i = 0; i < result_count; i++) {
+    fprintf(
+        out, "%s,%d,%ld,%.1f\n",
+        results[i].name, results[i].param,
+        results[i].iterations, results[i].ns_per_op);
+  }
+
+  return;
+}
+
+/* Returns the number of regressions over the threshold (%) */
+int compare_to_baseline(char *path, double threshold) {
+  FILE *in;
+  char line[MAX_BUFFER], name[BENCH_NAME_LEN];
+  int param, regressions = 0;
+  long iterations;
+  double ns_per_op, change;
+
+  if ((in = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "Failed to open baseline %s - %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  printf("%-28s %6s %12s %12s %8s\n", "benchmark", "param", "base ns", "now ns", "change");
+
+  while (fgets(line, MAX_BUFFER, in) != NULL) {
+    if (sscanf(line, "%47[^,],%d,%ld,%lf", name, &param, &iterations, &ns_per_op) != 4)
+      continue;  // header or junk
+
+    for (int i = 0; i < result_count; i++) {
+      if (strcmp(results[i].name, name) || results[i].param != param)
+        continue;
+
+      change = (results[i].ns_per_op - ns_per_op) / ns_per_op * 100.0;
+
+      printf(
+          "%-28s %6d %12.1f %12.1f %+7.1f%%%s\n",
+          name, param, ns_per_op, results[i].ns_per_op, change,
+          (change > threshold) ? " REGRESSION" : "");
+
+      if (change > threshold)
+        regressions++;
+    }
+  }
+
+  fclose(in);
+
+  return regressions;
+}
+
+/************************   BENCHMARKS   ************************/
+
+void fill_message(Msg *msg, int len) {
+  *msg = compose_message(NULL, "42", "bench_user");
+
+  for (int i = 0; i < len && i < MAX_MSG_LEN - 1; i++)
+    msg->msg[i] = 'a' + i % 26;
+  msg->msg[(len < MAX_MSG_LEN - 1) ? len : MAX_MSG_LEN - 1] = '\0';
+
+  return;
+}
+
+void bench_encrypt(long iterations, int size) {
+  int new_size;
+  char *enc_packet;
+
+  for (long i = 0; i < iterations; i++) {
+    enc_packet = encrypt_packet(bench_packet, size, &new_size, &bench_handle, 0, i);
+    free(enc_packet);
+  }
+
+  return;
+}
+
+void bench_decrypt(long iterations, int size) {
+  static char *packets[PREENCRYPTED_PACKETS];
+  static bool allocated = false;
+  int new_size;
+  char *packet;
+
+  /* Counters must be in sequence - encrypt a batch once and cycle through it */
+  if (prepared_size != size) {
+    for (int i = 0; i < PREENCRYPTED_PACKETS; i++) {
+      if (allocated)
+        free(packets[i]);
+      packets[i] = encrypt_packet(bench_packet, size, &new_size, &bench_handle, 0, i + 1);
+    }
+    prepared_size = size;
+    allocated = true;
+  }
+
+  for (long i = 0; i < iterations; i++) {
+    packet = decrypt_packet(
+        packets[i % PREENCRYPTED_PACKETS], &bench_handle, 0, i % PREENCRYPTED_PACKETS);
+
+    if (packet == NULL) {
+      HANDLE_ERROR("Benchmark packet failed to decrypt", 0);
+    }
+    free(packet);
+  }
+
+  return;
+}
+
+void bench_encode(long iterations, int len) {
+  Msg msg;
+  int size;
+
+  fill_message(&msg, len);
+
+  for (long i = 0; i < iterations; i++)
+    free(message_to_ascii_packet(&msg, &size));
+
+  return;
+}
+
+void bench_decode(long iterations, int len) {
+  Msg msg, out;
+  int size;
+
+  fill_message(&msg, len);
+  char *packet = message_to_ascii_packet(&msg, &size);
+
+  for (long i = 0; i < iterations; i++) {
+    out = ascii_packet_to_message(packet, size);
+    __asm__ volatile("" : : "r"(&out) : "memory");  // keep the result alive
+  }
+
+  free(packet);
+
+  return;
+}
+
+void *queue_producer(void *p_count) {
+  long count = *(long *)p_count;
+  Msg msg = compose_message("queue benchmark message", "1", "producer");
+
+  for (long i = 0; i < count; i++) {
+    pthread_mutex_lock(&r_lock);
+    add_message_to_queue(msg, &read_head, &read_tail, NULL);
+    pthread_cond_signal(&message_ready);
+    pthread_mutex_unlock(&r_lock);
+  }
+
+  return NULL;
+}
+
+/* Producers push, one consumer pops like the broadcaster - iterations are per producer */
+void bench_queue(long iterations, int producers) {
+  pthread_t threads[MAX_PRODUCERS];
+  long total = iterations * producers, popped = 0;
+  Msg *msg;
+
+  init_list(&read_head, &read_tail);
+
+  for (int i = 0; i < producers; i++)
+    pthread_create(&threads[i], NULL, queue_producer, &iterations);
+
+  while (popped < total) {
+    pthread_mutex_lock(&r_lock);
+
+    while ((msg = pop_msg_from_queue(&read_head, NULL)) == NULL)
+      pthread_cond_wait(&message_ready, &r_lock);
+
+    pthread_mutex_unlock(&r_lock);
+
+    free(msg);
+    popped++;
+  }
+
+  for (int i = 0; i < producers; i++)
+    pthread_join(threads[i], NULL);
+
+  return;
+}
+
+void *lane_producer(void *p_count) {
+  long count = *(long *)p_count;
+  Msg msg = compose_message("queue benchmark message", "1", "producer");
+
+  /* Every lane in turn, so pops go through the weighted rounds */
+  for (long i = 0; i < count; i++) {
+    pthread_mutex_lock(&r_lock);
+    lane_push(&bench_lanes, msg, i % LANE_COUNT);
+    pthread_cond_signal(&message_ready);
+    pthread_mutex_unlock(&r_lock);
+  }
+
+  return NULL;
+}
+
+/* bench_queue with the broadcaster's lanes - iterations are per producer */
+void bench_lane_queue(long iterations, int producers) {
+  pthread_t threads[MAX_PRODUCERS];
+  long total = iterations * producers, popped = 0;
+  Msg *msg;
+
+  lane_queue_init(&bench_lanes);
+
+  for (int i = 0; i < producers; i++)
+    pthread_create(&threads[i], NULL, lane_producer, &iterations);
+
+  while (popped < total) {
+    pthread_mutex_lock(&r_lock);
+
+    while ((msg = lane_pop(&bench_lanes)) == NULL)
+      pthread_cond_wait(&message_ready, &r_lock);
+
+    pthread_mutex_unlock(&r_lock);
+
+    free(msg);
+    popped++;
+  }
+
+  for (int i = 0; i < producers; i++)
+    pthread_join(threads[i], NULL);
+
+  return;
+}
+
+void bench_rows(long iterations, int multibyte) {
+  Msg msg;
+
+  if (multibyte) {
+    msg = compose_message(NULL, "42", "bench_user");
+    for (int i = 0; i + 4 < MAX_MSG_LEN; i += 4)
+      memcpy(msg.msg + i, "💯", 4);
+  } else {
+    fill_message(&msg, MAX_MSG_LEN - 1);
+  }
+
+  for (long i = 0; i < iterations; i++) {
+    parse_message_to_rows(&msg);
+    free_msg_rows(&msg);
+  }
+
+  return;
+}
+
+void bench_expressions(long iterations, int _) {
+  char message[MAX_MSG_LEN];
+
+  for (long i = 0; i < iterations; i++) {
+    snprintf(message, MAX_MSG_LEN, "%s", "well :shrug: that was :100: :poop: honestly :eggplant:");
+    patch_msg_expressions(message);
+  }
+
+  return;
+}
+
+/* Bytes the engine has handed over - written on its thread only */
+uint64_t engine_received = 0;
+int engine_pairs[ENGINE_SOCKETS][2];
+
+void count_engine_bytes(void *_, char *data, ssize_t size) {
+  if (size > 0)
+    __atomic_add_fetch(&engine_received, size, __ATOMIC_RELEASE);
+
+  return;
+}
+
+/* Round-robin writes over many sockets, timed until the engine has read them all */
+void bench_io_engine(long iterations, int _) {
+  char chunk[ENGINE_WRITE_BYTES];
+  uint64_t target = __atomic_load_n(&engine_received, __ATOMIC_ACQUIRE) +
+                    (uint64_t)iterations * ENGINE_WRITE_BYTES;
+
+  memset(chunk, 'x', sizeof(chunk));
+
+  for (long i = 0; i < iterations; i++) {
+    if (write(engine_pairs[i % ENGINE_SOCKETS][1], chunk, ENGINE_WRITE_BYTES) != ENGINE_WRITE_BYTES)
+      HANDLE_ERROR("Failed to write to an engine socket", 1);
+  }
+
+  while (__atomic_load_n(&engine_received, __ATOMIC_ACQUIRE) < target)
+    sched_yield();
+
+  return;
+}
+
+/* Epoll against io_uring on the same load - skipped if either isn't there */
+void run_engine_benches(void) {
+  char name[BENCH_NAME_LEN];
+
+  for (Io_kind kind = IO_EPOLL; kind <= IO_URING; kind++) {
+    if (io_engine_start(kind, count_engine_bytes) != kind) {
+      fprintf(stderr, "No %s, skipping its io_engine run\n", io_engine_name(kind));
+      io_engine_stop();
+      continue;
+    }
+
+    for (int i = 0; i < ENGINE_SOCKETS; i++) {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, engine_pairs[i]))
+        HANDLE_ERROR("Failed to create a socket pair", 1);
+
+      io_engine_watch(engine_pairs[i][0], engine_pairs[i]);
+    }
+
+    snprintf(name, BENCH_NAME_LEN, "io_engine_%s", io_engine_name(kind));
+    run_bench(name, bench_io_engine, ENGINE_SOCKETS);
+
+    io_engine_stop();
+
+    for (int i = 0; i < ENGINE_SOCKETS; i++) {
+      close(engine_pairs[i][0]);
+      close(engine_pairs[i][1]);
+    }
+  }
+
+  return;
+}
+
+/* One broadcast sealed for a room of SEAL_RECIPIENTS, each with its own handle */
+Seal_job seal_jobs[SEAL_RECIPIENTS];
+gcry_cipher_hd_t seal_handles[SEAL_RECIPIENTS];
+
+void bench_seal(long iterations, int _) {
+  for (long i = 0; i < iterations; i++) {
+    for (int j = 0; j < SEAL_RECIPIENTS; j++)
+      seal_jobs[j].ctr++;
+
+    seal_all(seal_jobs, SEAL_RECIPIENTS, bench_packet, SEAL_PACKET_BYTES);
+
+    for (int j = 0; j < SEAL_RECIPIENTS; j++)
+      free(seal_jobs[j].frame);
+  }
+
+  return;
+}
+
+/* The broadcaster alone, then with a worker per spare core - param is the worker count */
+void run_seal_benches(void) {
+  for (int j = 0; j < SEAL_RECIPIENTS; j++) {
+    init_cipher(&seal_handles[j], SUITE_AES256_GCM, NULL);
+    seal_jobs[j] = (Seal_job){.handle = &seal_handles[j], .salt = j, .ctr = 0};
+  }
+
+  run_bench("seal_all", bench_seal, 0);
+
+  seal_pool_start(-1);
+
+  if (seal_pool_workers() > 0)
+    run_bench("seal_all", bench_seal, seal_pool_workers());
+  else
+    fprintf(stderr, "One core, skipping the parallel seal_all run\n");
+
+  seal_pool_stop();
+
+  for (int j = 0; j < SEAL_RECIPIENTS; j++)
+    clean_cipher(&seal_handles[j]);
+
+  return;
+}
+
+/**************************   MAIN   ***************************/
+
+int main(int argc, char *argv[]) {
+  char *out_path = NULL, *baseline = NULL;
+  double threshold = BENCH_DEFAULT_THRESHOLD;
+  bool json = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "o:b:t:j")) != -1) {
+    switch (opt) {
+      /* Results file, stdout by default */
+      case 'o':
+        out_path = optarg;
+        break;
+
+      /* Saved CSV results to compare against */
+      case 'b':
+        baseline = optarg;
+        break;
+
+      /* Regression threshold in percent */
+      case 't':
+        threshold = atof(optarg);
+        break;
+
+      case 'j':
+        json = true;
+        break;
+
+      case '?':
+        fprintf(stderr, "Usage: %s [-o out] [-j] [-b baseline.csv] [-t percent]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  init_libgcrypt(1 + SEAL_RECIPIENTS);
+  memset(bench_packet, 'x', sizeof(bench_packet));
+
+  /* AES-GCM keeps the plain names it had before there were suites, the
+     others get their cipher's name - encrypt_packet_chacha20 */
+  int sizes[] = {32, 128, MAX_MSG_SIZE};
+  char name[BENCH_NAME_LEN];
+
+  for (int suite = 0; suite < SUITE_COUNT; suite++) {
+    init_cipher(&bench_handle, suite, NULL);
+    prepared_size = -1;
+
+    const char *cipher = suite_name(suite);
+    int cipher_len = (suite) ? (int)strcspn(cipher, "-") : 0;
+
+    snprintf(
+        name, BENCH_NAME_LEN, "encrypt_packet%s%.*s",
+        (suite) ? "_" : "", cipher_len, cipher);
+    for (int i = 0; i < 3; i++)
+      run_bench(name, bench_encrypt, sizes[i]);
+
+    snprintf(
+        name, BENCH_NAME_LEN, "decrypt_packet%s%.*s",
+        (suite) ? "_" : "", cipher_len, cipher);
+    for (int i = 0; i < 3; i++)
+      run_bench(name, bench_decrypt, sizes[i]);
+
+    clean_cipher(&bench_handle);
+  }
+
+  int lengths[] = {16, MAX_MSG_LEN - 1};
+  for (int i = 0; i < 2; i++)
+    run_bench("message_to_ascii_packet", bench_encode, lengths[i]);
+  for (int i = 0; i < 2; i++)
+    run_bench("ascii_packet_to_message", bench_decode, lengths[i]);
+
+  for (int producers = 1; producers <= MAX_PRODUCERS; producers *= 2)
+    run_bench("message_queue", bench_queue, producers);
+  for (int producers = 1; producers <= MAX_PRODUCERS; producers *= 2)
+    run_bench("lane_queue", bench_lane_queue, producers);
+
+  /* Character widths come from the locale */
+  setlocale(LC_ALL, "");
+  main_maxx = 80;
+  run_bench("parse_message_to_rows", bench_rows, 0);
+  run_bench("parse_message_to_rows", bench_rows, 1);
+
+  run_bench("patch_msg_expressions", bench_expressions, 0);
+
+  run_seal_benches();
+  run_engine_benches();
+
+  FILE *out = stdout;
+  if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+    HANDLE_ERROR("Failed to open the results file", 1);
+  }
+
+  write_results(out, json);
+
+  if (out != stdout)
+    fclose(out);
+
+  if (baseline != NULL)
+    return (compare_to_baseline(baseline, threshold) != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  return 0;
+}
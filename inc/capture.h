@@ -0,0 +1,27 @@
+#ifndef CAPTURE_H
+    #define CAPTURE_H
+
+    #include <inc/general.h>
+
+    /* File: magic, then records of
+       u64 timestamp (ns from capture start) | u32 connection id | u16 size | payload */
+    #define CAPTURE_MAGIC "CLMCAP2"
+    #define CAPTURE_MAGIC_BYTES 8
+    #define CAPTURE_RECORD_HEADER 14
+    #define CAPTURE_BUFFER_BYTES 65536
+
+    typedef struct _capture_record{
+        uint64_t timestamp;
+        uint32_t conn_id;
+        uint16_t size;
+        char *payload;
+    }Capture_record;
+
+    int capture_open(char *path);
+    void capture_frame(uint32_t conn_id, char *payload, uint16_t size);
+    void capture_close(void);
+
+    FILE *capture_open_for_reading(char *path);
+    int capture_read_record(FILE *in, Capture_record *record);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef CIPHER_SLAB_H
+    #define CIPHER_SLAB_H
+
+    #include <inc/general.h>
+    #include <inc/setting.h>
+
+    /* Libgcrypt's secure memory - fixed-size, cache-aligned slots in one
+       mlocked mapping, sized for the sessions we expect instead of its own
+       16 MiB pool. A cipher handle takes one slot */
+    typedef struct _slab_usage{
+        size_t slots;
+        size_t used;
+        size_t slot_bytes;
+        size_t session_bytes; // what one cipher handle asked for, 0 before the first
+        bool locked;
+    }Slab_usage;
+
+    int cipher_slab_init(size_t slots);
+    void *slab_alloc(size_t size);
+    void slab_free(void *p);
+    bool slab_owns(const void *p);
+    void slab_note_session(size_t used_before);
+    void slab_usage(Slab_usage *usage);
+
+#endif
@@ -1,2 +1,11 @@
+#ifndef CLIENT_H
+    #define CLIENT_H
 
-void start_client(void);
+    #include <inc/crypt.h>
+    #include <inc/general.h>
+
+    void start_client(void);
+    int connect_to_server(uint32_t *salt, Suite *suite, uint8_t *key_nonce);
+    int connect_to_host(char *ipv4, char *port, char *unix_path, uint32_t *salt, Suite *suite, uint8_t *key_nonce);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef CLIENT_MAP_H
+    #define CLIENT_MAP_H
+
+    #include <inc/general.h>
+    #include <inc/setting.h>
+    #include <inc/socket_utilities.h>
+
+    /* Generational slot map - a handle is (generation << 16 | slot), so a handle
+       kept after its client left never matches the slot's next occupant */
+    #define CLIENT_SLOTS FD_SETSIZE
+
+    /* Sockets index FD_SETSIZE-sized tables here and in the io engine, so a
+       client's must stay below it - the host's own descriptors take the reserve */
+    #define RESERVED_FDS 64
+    #define MAX_CLIENTS (CLIENT_SLOTS - RESERVED_FDS) // the cap on -m and -k
+    #define HANDLE_SLOT_BITS 16
+    #define HANDLE_SLOT_MASK ((1 << HANDLE_SLOT_BITS) - 1)
+    #define HANDLE_MAX_GENERATION 0x7fff // keeps handles positive
+    #define NO_CLIENT -1
+
+    typedef int Client_handle;
+
+    typedef struct _client_map{
+        Client slots[CLIENT_SLOTS];
+        int generation[CLIENT_SLOTS];
+        int dense_pos[CLIENT_SLOTS];
+
+        /* Handles of every connected client, packed - for iterating */
+        Client_handle dense[CLIENT_SLOTS];
+        int count;
+
+        int free_slots[CLIENT_SLOTS];
+        int free_count;
+    }Client_map;
+
+    void init_client_map(Client_map *map);
+    Client_handle client_map_insert(Client_map *map, Client *client);
+    Client *client_map_get(Client_map *map, Client_handle handle);
+    int client_map_remove(Client_map *map, Client_handle handle, Client *removed);
+
+#endif
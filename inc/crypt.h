@@ -11,18 +11,49 @@
         uint8_t tag[TAG_BYTES];
     }Enc_msg;
 
-    void init_libgcrypt(void);
-    void init_AES_256_cipher(gcry_cipher_hd_t *aes256_gcm_handle);
+    /* AEADs a session can run - the same key, nonce and tag sizes, so they
+       share the packet format and only differ in the opened handle */
+    typedef enum _suite{
+        SUITE_AES256_GCM,
+        SUITE_CHACHA20_POLY1305,
+        SUITE_COUNT
+    }Suite;
+
+    /* Every session keys its ciphers with the password and a nonce the host
+       picks for it, so two sessions never share a key - not even ones of
+       different hosts whose salts and counters meet */
+    #define KEY_NONCE_BYTES 16
+    #define KEY_NONCE_HEX (KEY_NONCE_BYTES * 2 + 1)
+    #define KEY_INFO "clm session" // HKDF's context string
+
+    void init_libgcrypt(size_t sessions);
+    int init_cipher(gcry_cipher_hd_t *handle, Suite suite, const uint8_t *key_nonce);
+    void derive_key(const uint8_t *key_nonce, uint8_t *key);
+    void hmac_sha256(const void *key, size_t key_size, const void *data, size_t size, uint8_t *out);
+    void bytes_to_hex(const uint8_t *bytes, size_t size, char *hex);
+    int hex_to_bytes(const char *hex, uint8_t *bytes, size_t size);
+
+    Suite suite_by_name(char *name);
+    const char *suite_name(Suite suite);
+    int parse_suites(char *list, Suite *suites);
+    void suites_to_str(Suite *suites, int count, char *out, size_t out_size);
+    double probe_suite(Suite suite);
+
+    /* A session's salt is even one way, odd the other - the two directions
+       share the key but never a nonce */
+    #define SALT_TO_SERVER(salt) ((salt) & ~(uint32_t)1)
+    #define SALT_TO_CLIENT(salt) ((salt) | 1)
 
     char *encrypt_packet(
         char *packet, uint16_t size, int *new_size,
-        gcry_cipher_hd_t *aes_gcm, uint16_t ctr
+        gcry_cipher_hd_t *aes_gcm, uint32_t salt, uint64_t ctr
     );	
 
     char *decrypt_packet(
-        char *packet, gcry_cipher_hd_t *aes_gcm, uint16_t cur_ctr);
+        char *packet, gcry_cipher_hd_t *aes_gcm, uint32_t salt, uint64_t cur_ctr);
 	
-    void clean_cipher(gcry_cipher_hd_t *aes256_gcm_handle);
+    uint16_t packet_payload_size(char *packet);
+    void clean_cipher(gcry_cipher_hd_t *handle);
     void clean_enc_msg(Enc_msg *enc_msg);
 
     #define HANDLE_LIBGCRYPT_ERROR(err) handle_libgcrypt_error(err, __FILE__, __LINE__);
@@ -24,6 +24,7 @@
     long timespec_to_nanosec(struct timespec ts);
     struct timespec remainder_timespec(struct timespec t1, struct timespec t2);
     struct timespec get_time_interval(struct timeval start, struct timeval end);
+    uint64_t get_monotonic_nanosecs(void);
 
     #define HANDLE_ERROR(msg, show_err) handle_error(msg, show_err, __FILE__, __LINE__);
     #define MUTEX(line, mlock) if(mlock != NULL)pthread_mutex_lock(mlock); line if(mlock != NULL)pthread_mutex_unlock(mlock);
@@ -0,0 +1,26 @@
+#ifndef HISTORY_H
+    #define HISTORY_H
+
+    #include <inc/general.h>
+    #include <inc/setting.h>
+
+    /* Last HISTORY_SIZE messages of a room, kept as ascii packets so a
+       catch-up is a memcpy per message - callers hold client_lock */
+    typedef struct _history_entry{
+        char packet[MAX_MSG_SIZE];
+        int size;
+        uint64_t seq;
+    }History_entry;
+
+    typedef struct _history{
+        History_entry entries[HISTORY_SIZE];
+        int head; // next slot to write
+        int count;
+    }History;
+
+    void history_append(History *history, char *ascii_packet, int size, uint64_t seq);
+    int history_batch(
+        History *history, int *next, uint64_t after, uint64_t before,
+        char *batch, int batch_size);
+
+#endif
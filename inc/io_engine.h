@@ -0,0 +1,38 @@
+#ifndef IO_ENGINE_H
+    #define IO_ENGINE_H
+
+    #include <inc/general.h>
+    #include <inc/socket_utilities.h>
+
+    /* How the server reads its clients - a listener thread each, or one event
+       loop for all of them. io_uring falls back to epoll if the kernel can't */
+    typedef enum _io_kind{
+        IO_THREADS,
+        IO_EPOLL,
+        IO_URING,
+        IO_KIND_COUNT
+    }Io_kind;
+
+    #define EPOLL_EVENTS 64
+    #define IO_SCRATCH_BYTES 16384 // one epoll recv
+    #define URING_ENTRIES 256
+    #define URING_BUFFERS 512 // provided to multishot recvs, a power of two
+    #define URING_BUFFER_BYTES 2048
+
+    /* Runs on the engine's thread - size 0 or less once, when the peer is gone */
+    typedef void (*Io_callback)(void *context, char *data, ssize_t size);
+
+    Io_kind io_engine_start(Io_kind kind, Io_callback callback);
+    void io_engine_stop(void);
+    void io_engine_pause(void);
+    void io_engine_resume(void);
+    void io_engine_watch(int socket, void *context);
+    void io_engine_forget(int socket, void *context);
+    void io_engine_hold(int socket, void *context);
+    void io_engine_release(int socket, void *context);
+    void io_engine_send(int *sockets, Out_queue **queues, ssize_t *results, int count);
+
+    Io_kind io_engine_kind(char *name);
+    const char *io_engine_name(Io_kind kind);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef LANE_QUEUE_H
+    #define LANE_QUEUE_H
+
+    #include <inc/general.h>
+    #include <inc/message.h>
+
+    /* The server's broadcast queue - a FIFO per priority class, served by
+       weighted round robin so the slower classes still get their share.
+       Callers hold r_lock */
+    typedef enum _lane{
+        LANE_CONTROL, // pings and ring requests
+        LANE_CHAT,
+        LANE_BULK, // joins and resumes, each sends a history catch-up
+        LANE_NOTICE, // server announcements
+        LANE_COUNT
+    }Lane;
+
+    typedef struct _lane_queue{
+        Msg *head[LANE_COUNT];
+        Msg *tail[LANE_COUNT];
+        uint64_t pushed[LANE_COUNT]; // a ticket is still queued while above popped
+        uint64_t popped[LANE_COUNT];
+        int credit[LANE_COUNT]; // left of the lane's weight this round
+    }Lane_queue;
+
+    void lane_queue_init(Lane_queue *queue);
+    void lane_queue_free(Lane_queue *queue);
+    uint64_t lane_push(Lane_queue *queue, Msg msg, Lane lane);
+    Msg *lane_pop(Lane_queue *queue);
+    bool lane_queue_is_empty(Lane_queue *queue);
+    bool lane_holds(Lane_queue *queue, Lane lane, uint64_t ticket);
+
+#endif
@@ -13,10 +13,19 @@
         char msg[MAX_MSG_LEN];
         char **rows;
         int row_count;
+        int layout_width; // rows were cut for this wide a window
         char username[MAX_USERNAME_LEN];
         CChar *username_colors;
         int color_count;
         char id[ID_SIZE];
+        uint64_t queued_at;
+        uint64_t seq; // server-wide broadcast order, 0 for direct replies
+        int sender; // server: handle of the sending client, -1 for system messages
+        int room;
+        char room_name[MAX_ROOM_NAME]; // relayed: the room on every host
+        uint32_t origin; // relayed: host it was first broadcast on, 0 until then
+        uint64_t origin_seq;
+        int via; // server: handle of the peer link it came over, -1 if none
 
         struct msg_ *next;
     }Msg;
@@ -34,8 +43,11 @@
     void empty_list(Msg **head);
     Msg *pop_msg_from_queue(Msg **head, pthread_mutex_t *);
     void add_message_to_queue(Msg new, Msg **head, Msg **tail, pthread_mutex_t *);
+    Msg *new_message_node(Msg msg);
+    void push_message(Msg *new, Msg **head, Msg **tail, pthread_mutex_t *);
     void init_list(Msg **head, Msg **tail);
     Msg compose_message(char *msg, char *id, char *username);
     void parse_username_for_msg(Msg *dest, char *src);
+    void strip_username_colors(char *dest, char *src);
 
 #endif
\ No newline at end of file
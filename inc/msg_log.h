@@ -0,0 +1,37 @@
+#ifndef MSG_LOG_H
+    #define MSG_LOG_H
+
+    #include <inc/general.h>
+    #include <inc/setting.h>
+
+    /* Segment: magic, then records of
+       u32 size | u64 timestamp (ns since epoch) | room name | ascii packet
+       A zero size ends the segment - the unused tail is preallocated zeros */
+    #define MSG_LOG_MAGIC "CLMLOG2"
+    #define MSG_LOG_MAGIC_BYTES 8
+    #define MSG_LOG_RECORD_HEADER (12 + MAX_ROOM_NAME)
+    #define MSG_LOG_SEGMENT_NAME "%08" PRIu32 ".clmlog"
+
+    typedef struct _msg_log_record{
+        uint64_t timestamp;
+        char *room;
+        char *packet; // points into the mapped segment
+        uint32_t size;
+    }Msg_log_record;
+
+    typedef struct _msg_log_reader{
+        char *map;
+        size_t size;
+        size_t offset;
+    }Msg_log_reader;
+
+    int msg_log_open(char *dir, int sync_every);
+    void msg_log_append(char *room, char *ascii_packet, uint32_t size);
+    void msg_log_close(void);
+
+    int msg_log_segments(char *dir, uint32_t **ids);
+    int msg_log_open_segment(char *path, Msg_log_reader *reader);
+    int msg_log_read_record(Msg_log_reader *reader, Msg_log_record *record);
+    void msg_log_close_segment(Msg_log_reader *reader);
+
+#endif
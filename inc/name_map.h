@@ -0,0 +1,28 @@
+#ifndef NAME_MAP_H
+    #define NAME_MAP_H
+
+    #include <inc/general.h>
+    #include <inc/setting.h>
+
+    /* Open addressing, linear probing - size must be a power of two */
+    #define NAME_MAP_SIZE 2048
+    #define NAME_EMPTY -1
+    #define NAME_DELETED -2
+
+    typedef struct _name_entry{
+        char name[MAX_USERNAME_LEN];
+        int value;
+    }Name_entry;
+
+    typedef struct _name_map{
+        Name_entry entries[NAME_MAP_SIZE];
+        int count;
+        int deleted;
+    }Name_map;
+
+    void init_name_map(Name_map *map);
+    int name_map_get(Name_map *map, char *name);
+    int name_map_put(Name_map *map, char *name, int value);
+    void name_map_remove(Name_map *map, char *name, int value);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef PRESENCE_H
+    #define PRESENCE_H
+
+    #include <inc/general.h>
+    #include <inc/setting.h>
+
+    /* Joins and leaves per room - the first in a quiet room is announced right
+       away and opens a window, the rest of the window is tallied into one
+       summary when it ends. A reconnect storm costs a message per room and
+       window instead of one per client */
+    typedef enum _presence_kind{
+        PRESENCE_JOINED,
+        PRESENCE_LEFT
+    }Presence_kind;
+
+    /* Queues the text for the room - called without presence_lock */
+    typedef void (*Presence_flush)(char *text, int room);
+
+    void presence_init(Presence_flush flush);
+    void presence_event(int room, Presence_kind kind, char *text);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef RATE_LIMIT_H
+    #define RATE_LIMIT_H
+
+    #include <inc/general.h>
+    #include <inc/setting.h>
+
+    /* Refilled lazily from the monotonic clock - owned by one listener, no locking */
+    typedef struct _token_bucket{
+        double tokens;
+        double rate; // tokens per second, 0 - unlimited
+        double burst;
+        uint64_t refilled_at;
+    }Token_bucket;
+
+    typedef struct _rate_limit{
+        Token_bucket msgs;
+        Token_bucket bytes;
+        int drops;
+    }Rate_limit;
+
+    void rate_limit_init(Rate_limit *limit, double msgs_per_sec, double bytes_per_sec);
+    uint64_t rate_limit_wait(Rate_limit *limit, int bytes);
+    int rate_limit_admit(Rate_limit *limit, int bytes, bool defer);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef RELAY_H
+    #define RELAY_H
+
+    #include <inc/general.h>
+    #include <inc/message.h>
+    #include <inc/setting.h>
+
+    /* What peered hosts send each other, as many records a frame as fit -
+       the message's id, its room by name, then the ascii packet:
+       origin (4, BE) | origin_seq (8, BE) | room (MAX_ROOM_NAME) | packet.
+       An id is the host the message was first broadcast on and that host's
+       count of relayed messages, so ids from one origin are dense */
+    int relay_append(char *batch, int *filled, Msg *msg, char *ascii_packet, int size);
+    int relay_next(char *batch, int size, int *offset, Msg *msg);
+
+    /* Whether an id hasn't been seen - messages take every path around a
+       loop of peers, only the first copy is broadcast. Broadcaster only */
+    bool relay_is_new(uint32_t origin, uint64_t seq);
+
+#endif
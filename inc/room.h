@@ -0,0 +1,26 @@
+#ifndef ROOM_H
+    #define ROOM_H
+
+    #include <inc/general.h>
+    #include <inc/history.h>
+    #include <inc/setting.h>
+
+    /* Subscribers are client handles - callers hold client_lock */
+    typedef struct _room{
+        char name[MAX_ROOM_NAME];
+        int *subscribers;
+        int subscriber_count;
+        int capacity;
+        History history; // cleared with the room when it closes
+    }Room;
+
+    extern Room rooms[MAX_ROOMS];
+
+    void init_rooms(void);
+    int find_room(char *name);
+    int open_room(char *name);
+    int add_subscriber(int room, int handle);
+    int remove_subscriber(int room, int position);
+    void free_rooms(void);
+
+#endif
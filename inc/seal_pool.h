@@ -0,0 +1,25 @@
+#ifndef SEAL_POOL_H
+    #define SEAL_POOL_H
+
+    #include <inc/crypt.h>
+    #include <inc/general.h>
+    #include <inc/setting.h>
+
+    /* Seals one packet for many recipients - a fan-out is cut into chunks of
+       SEAL_CHUNK jobs that the workers and the caller claim in turn. A job's
+       handle appears in no other job of the run, so every handle is used by
+       one thread at a time without locking */
+    typedef struct _seal_job{
+        gcry_cipher_hd_t *handle;
+        uint32_t salt;
+        uint64_t ctr; // taken by the caller - the frame goes out in its place
+        char *frame; // set by seal_all, the caller frees it
+        int frame_size;
+    }Seal_job;
+
+    void seal_pool_start(int workers);
+    void seal_pool_stop(void);
+    int seal_pool_workers(void);
+    void seal_all(Seal_job *jobs, int count, char *packet, uint16_t size);
+
+#endif
@@ -1,2 +1,71 @@
+#ifndef SERVER_H
+    #define SERVER_H
 
-void start_server(void);
+    #include <inc/client_map.h>
+    #include <inc/lane_queue.h>
+    #include <inc/rate_limit.h>
+    #include <inc/socket_utilities.h>
+
+    /* A client's read side - on the stack of its listener thread, or fed
+       by the io engine */
+    typedef struct _listener{
+        Client_handle handle;
+        Client *client;
+        int socket;
+        Frame_reader reader;
+        Rate_limit limit;
+        bool rate_limited;
+        uint64_t tickets[LANE_COUNT]; // its last message queued in each lane
+        bool peer; // frames are relay batches from another host
+        bool held; // throttled on an io engine, the socket isn't read until released
+        char *backlog; // what came in after the hold, taken up on release
+        size_t backlog_size;
+    }Listener;
+
+    /* A link to another host - relayed messages wait in the batch until the
+       end of the burst, like a client's frames. Under client_lock */
+    typedef struct _peer_link{
+        Client_handle handle;
+        char batch[MAX_BATCH_SIZE];
+        int filled;
+    }Peer_link;
+
+    /* Whoever opened a session sends on the even salt - a peer link we
+       opened is the client's side of it */
+    #define SEND_SALT(client) \
+        ((client)->outbound ? SALT_TO_SERVER((client)->salt) : SALT_TO_CLIENT((client)->salt))
+    #define RECV_SALT(client) \
+        ((client)->outbound ? SALT_TO_CLIENT((client)->salt) : SALT_TO_SERVER((client)->salt))
+
+    /* Restart handoff, over a SOCK_SEQPACKET unix socket - the header carries
+       the listening sockets, every record after it a session's socket.
+       The old host closes the connection once its log is closed */
+    typedef struct _handoff_header{
+        uint32_t magic;
+        uint32_t client_count;
+        uint64_t next_seq;
+        uint32_t next_salt;
+    }Handoff_header;
+
+    typedef struct _handoff_client{
+        uint64_t ctr;
+        uint64_t send_ctr;
+        uint64_t joined_seq;
+        uint32_t salt;
+        uint32_t suite;
+        uint8_t key_nonce[KEY_NONCE_BYTES];
+        struct sockaddr_in addr;
+        char name[MAX_USERNAME_LEN];
+        char room[MAX_ROOM_NAME];
+        uint32_t pending; // bytes of a frame the reader had started on
+        char frame[FRAME_BUFFER_BYTES];
+    }Handoff_client;
+
+    /* Broadcast pipeline - exposed for clm_replay */
+    void start_server(void);
+    void *broadcast_message(void *_);
+    void queue_broadcast(Msg msg, Lane lane);
+    void init_clients(void);
+    Client_handle add_client(Client new_client);
+
+#endif
@@ -9,11 +9,13 @@
     #define MAX_PASSWORD_LEN 20
     #define MAX_MSG_LEN 256
     #define ID_SIZE 5
+    #define SEQ_BYTES 8
     #define DEFAULT_USERNAME "Heikki"
     #define DEFAULT_PASSWORD "KimmoHeikkiPena"
     #define MAX_BUFFER 256
     #define MAX_BYTES_IN_CHAR 4
-    #define MAX_MSG_SIZE MAX_USERNAME_LEN + ID_SIZE + MAX_MSG_LEN
+    #define ASCII_HEADER_BYTES (MAX_USERNAME_LEN + ID_SIZE + SEQ_BYTES)
+    #define MAX_MSG_SIZE ASCII_HEADER_BYTES + MAX_MSG_LEN
     #define ROW_FORMAT "(%s): %s"
     #define ROW_FORMAT_LEN 4
     #define MAX_ROW_SIZE MAX_MSG_SIZE + ROW_FORMAT_LEN
@@ -21,10 +23,11 @@
     #define CTR_BYTES 2
     #define SIZE_BYTES 2
     #define AAD_BYTES CTR_BYTES + SIZE_BYTES
-    #define HEADER_BYTES AAD_BYTES + IV_BYTES + TAG_BYTES
+    #define HEADER_BYTES AAD_BYTES + TAG_BYTES // the IV is derived, not sent
     #define PACKET_MAX_BYTES HEADER_BYTES + MAX_MSG_SIZE
     #define MIN_MSG_LEN 2
-    #define MIN_PACKET_SIZE HEADER_BYTES + MAX_USERNAME_LEN + ID_SIZE + MIN_MSG_LEN
+    #define MIN_PACKET_SIZE HEADER_BYTES + ASCII_HEADER_BYTES + MIN_MSG_LEN
+    #define MAX_BATCH_SIZE 8192 // server -> client frames may carry several packets
 
     #define MAX_PORT_STR 6
     #define MAX_IPV4_STR 16
@@ -32,13 +35,89 @@
     #define DEFAULT_PORT "1337"
     #define RESPONSE_OK "100"
     #define RESPONSE_FAIL "401"
+    #define MAX_PATH_STR 256
+    #define UNIX_PREFIX "unix:" // -s unix:/path - same-host clients skip TCP/IP
+
+    /* Rooms */
+    #define MAX_ROOMS 64
+    #define MAX_ROOM_NAME 20
+    #define LOBBY_ROOM 0
+    #define DEFAULT_ROOM "lobby"
+    #define ROOM_INITIAL_CAPACITY 8
+    #define HISTORY_SIZE 32 // messages replayed to whoever joins the room
+
+    /* Reconnect backoff, doubled after every failed attempt */
+    #define RECONNECT_MIN_MS 250
+    #define RECONNECT_MAX_MS 30000
+
+    /* Timeouts - a link silent for a third of the idle timeout is pinged */
+    #define TIMER_TICK_MS 100
+    #define IDLE_TIMEOUT_SEC 90
+    #define HANDSHAKE_TIMEOUT_MS 5000
+    #define FLUSH_RETRY_MS TIMER_TICK_MS // a socket that had no room is tried again this soon
+
+    /* Joins and leaves after the first in a room are summed up this often */
+    #define PRESENCE_WINDOW_MS 1000
+
+    /* Broadcast lanes - how many messages each takes per round while all are busy */
+    #define LANE_WEIGHT_CONTROL 8
+    #define LANE_WEIGHT_CHAT 4
+    #define LANE_WEIGHT_BULK 2
+    #define LANE_WEIGHT_NOTICE 1
+
+    /* Restart handoff - listener threads are woken with it to stop at a frame boundary */
+    #define HANDOFF_SIGNAL SIGUSR1
+    #define HANDOFF_MAGIC 0x484d4c43 // "CLMH"
+
+    /* Federation - hosts given with -P, relayed messages are told apart by id */
+    #define MAX_PEERS 8
+    #define MAX_PEER_LINKS (MAX_PEERS * 2) // ours and those other hosts opened
+    #define MAX_PEER_STR (MAX_IPV4_STR + MAX_PORT_STR) // ip:port
+    #define MAX_PEER_KEY_LEN 64 // -F, every host of a federation is given the same
+    #define PEER_PROOF_HEX (BYTES_IN_256 * 2 + 1) // HMAC-SHA256 of the key, in hex
+    #define MAX_ORIGINS 64 // hosts whose ids are remembered
+    #define RELAY_WINDOW 64 // ids behind an origin's highest still told apart
+    #define RELAY_ID_BYTES 12 // origin and its sequence
+    #define RELAY_HEADER_BYTES (RELAY_ID_BYTES + MAX_ROOM_NAME)
+
+    /* Rate limiting */
+    #define RATE_BURST_SEC 1 // bucket size in seconds of the rate
+    #define HOLD_BACKLOG_BYTES (64 * 1024) // read off a throttled socket before it was held
+
+    /* Message log */
+    #define MSG_LOG_SEGMENT_BYTES (4 * 1024 * 1024)
+    #define MSG_LOG_SYNC_EVERY 256 // messages per msync, 0 leaves it to the kernel
+
+    /* Output batching - a socket's frames go out together at the end of a burst */
+    #define OUT_MAX_FRAMES 64 // queued per socket before a flush mid-burst
+    #define OUT_BURST_MSGS 32 // broadcasts before everything is flushed anyway
+
+    /* Broadcast sealing - fan-outs this big are split between the workers */
+    #define SEAL_CHUNK 32 // recipients a worker takes at a time
+    #define SEAL_PARALLEL_MIN 64 // below this the broadcaster seals alone
+    #define SEAL_MAX_WORKERS 16
+
+    /* Shared-memory ring for same-host clients */
+    #define RING_SLOTS 1024
+    #define RING_WAIT_MS 100 // readers also look up room switches this often
+
+    /* Statistics */
+    #define STATS_INTERVAL_SEC 10
+    #define RECENT_PEERS 256
 
     /* Libgcrypt*/
     #define MIN_LIBGCRYPT_VERSION "1.9.2"
     #define BYTES_IN_256 32
     #define IV_BYTES 12
+    #define SALT_BYTES 4 // the IV's first bytes, the 64-bit counter makes the rest
     #define TAG_BYTES 16
-    #define SEC_MEM_KIB 16384
+    #define SLAB_SLOT_BYTES 2048 // a GCM or Poly1305 cipher handle, rounded up to cache lines
+    #define SLAB_SPARE_SLOTS 64 // libgcrypt's own - self-tests and the random pool
+    #define CIPHERS_PER_SESSION 2 // one each way, their threads never share a handle
+    #define MAX_SUITES_STR 64
+    #define DEFAULT_SUITES "aes256-gcm,chacha20-poly1305" // offered when -a isn't given
+    #define SUITE_PROBE_PACKETS 512 // sealed per round of the host's startup probe
+    #define SUITE_PROBE_ROUNDS 3
 
     /* Argon2id */
     #define SALT_LEN 16
@@ -46,6 +125,7 @@
 
     #define NANOSECS_IN_SEC 1000000000
     #define NANOSECS_IN_MICRO 1000
+    #define NANOSECS_IN_MILLI 1000000
 
     /* Window border */
     #define SB '|' // Side
@@ -58,18 +138,47 @@
     #define C_CHANGE_FPS "fps"
     #define C_QUIT "quit"
     #define C_KICK "kick"
+    #define C_STATS "stats"
+    #define C_JOIN "join"
+    #define C_LEAVE "leave"
+    #define C_DIRECT_MSG "msg"
+    #define C_RESUME "resume"
+    #define C_PING "ping"
+    #define C_PONG "pong"
+    #define C_RING "ring"
+    #define C_PEER "peer"
+    #define DIRECT_MSG_FORMAT "(dm) %s"
 
     typedef struct _connection{
         char ipv4[MAX_IPV4_STR];
         char port[MAX_PORT_STR];
+        char unix_path[MAX_PATH_STR]; // the client uses it instead of ipv4, the server too
         char password[MAX_PASSWORD_LEN];
         bool is_server;
         uint16_t fps;
         uint16_t max_connections;
+        char stats_path[MAX_PATH_STR];
+        char capture_path[MAX_PATH_STR];
+        char log_dir[MAX_PATH_STR];
+        int log_sync_every;
+        int rate_msgs; // per client and second, 0 - unlimited
+        int rate_bytes;
+        int rate_kick; // drops before a kick, 0 - defer instead of dropping
+        int idle_timeout; // seconds, 0 - never
+        bool shm_ring; // host publishes broadcasts into it, unix clients ask for it
+        int io_engine; // Io_kind the host reads its clients with
+        int cipher_sessions; // cipher slab capacity, 0 - one per allowed connection
+        int seal_workers; // threads sealing broadcasts next to the broadcaster, -1 - a core each
+        char suites[MAX_SUITES_STR]; // AEAD preference, empty - the host probes, the client offers all
+        char handoff_path[MAX_PATH_STR]; // host: sessions are taken over from whoever listens here, then offered on
+        char peers[MAX_PEERS][MAX_PEER_STR]; // hosts we link to and relay room traffic with
+        int peer_count;
+        char peer_key[MAX_PEER_KEY_LEN]; // proves a link is another host's, empty - no links are taken
     }Connection;
 
     typedef struct _user{
         char username[MAX_USERNAME_LEN];
+        char room[MAX_ROOM_NAME]; // rejoined after a reconnect, empty for the lobby
     }User;
 
     typedef struct _expression{
@@ -89,10 +198,27 @@
     Connection connection = {
         .ipv4 = LOCAL_HOST,
         .port = DEFAULT_PORT,
+        .unix_path = "",
         .password = DEFAULT_PASSWORD,
         .is_server = false,
         .fps = 60,
-        .max_connections = 2
+        .max_connections = 2,
+        .stats_path = "",
+        .capture_path = "",
+        .log_dir = "",
+        .log_sync_every = MSG_LOG_SYNC_EVERY,
+        .rate_msgs = 0,
+        .rate_bytes = 0,
+        .rate_kick = 0,
+        .idle_timeout = IDLE_TIMEOUT_SEC,
+        .shm_ring = false,
+        .io_engine = 0, // IO_THREADS
+        .cipher_sessions = 0,
+        .seal_workers = -1,
+        .suites = "",
+        .handoff_path = "",
+        .peer_count = 0,
+        .peer_key = ""
     };
 
     User user = {.username = DEFAULT_USERNAME};
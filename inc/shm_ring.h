@@ -0,0 +1,47 @@
+#ifndef SHM_RING_H
+    #define SHM_RING_H
+
+    #include <inc/crypt.h>
+    #include <inc/general.h>
+    #include <inc/setting.h>
+
+    /* Broadcasts for same-host clients - written once into a memfd by the
+       broadcaster, read straight from the mapping by every local client.
+       Frames are sealed like on the wire, the counter in the AAD is the
+       slot's position, so a frame only authenticates where it was written */
+    #define RING_MAGIC "CLMRING"
+    #define RING_MAGIC_BYTES 8
+
+    typedef struct _ring_slot{
+        uint64_t stamp; // position + 1 once written, 0 while it's being written
+        int32_t room;
+        uint16_t size;
+        char frame[PACKET_MAX_BYTES];
+    }Ring_slot;
+
+    typedef struct _ring{
+        char magic[RING_MAGIC_BYTES];
+        uint64_t head; // next position to write
+        uint32_t futex; // low half of head - readers sleep on it
+        uint32_t salt; // the ring's nonces, like a session's
+        uint32_t suite; // the AEAD its frames are sealed with
+        uint8_t key_nonce[KEY_NONCE_BYTES]; // and the key's, like a session's
+        Ring_slot slots[RING_SLOTS];
+    }Ring;
+
+    /* Server - one writer, the broadcaster */
+    int ring_open(uint32_t salt, int suite, const uint8_t *key_nonce);
+    int ring_memfd(void);
+    uint64_t ring_head(void);
+    uint32_t ring_salt(void);
+    void ring_publish(int room, char *frame, uint16_t size);
+    void ring_close(void);
+
+    /* Clients - read-only mappings */
+    Ring *ring_map(int fd);
+    void ring_unmap(Ring *ring);
+    int ring_read(Ring *ring, uint64_t *position, Ring_slot *slot);
+    void ring_wait(Ring *ring, uint64_t position, int timeout_ms);
+    void ring_wake(Ring *ring);
+
+#endif
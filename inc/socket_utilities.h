@@ -8,26 +8,88 @@
     #include <sys/socket.h>
     #include <sys/select.h>
     
+    #include <sys/un.h>
+    #include <sys/uio.h>
     #include <arpa/inet.h> //For inet_ntop
     #include <netinet/in.h> //Structures for address information
 
     #include <inc/message.h>
     #include <inc/crypt.h>
+    #include <inc/timer_wheel.h>
 
     in_addr_t str_to_bin_IP(char *string);
     void bin_IP_to_str(in_addr_t ip, char *buffer);
+    void set_connection_address(char *address);
 
     void read_message_to_buffer(int client_socket);
     char *message_to_ascii_packet(Msg *message, int *size);
-    Msg ascii_packet_to_message(char *data_buffer);
-    int read_one_packet(int socket, char *buffer, size_t buffer_size);
+    Msg ascii_packet_to_message(char *data_buffer, int size);
+    int read_one_packet(int socket, char *buffer, size_t buffer_size, int timeout_ms);
+    #define MAX_PASSED_FDS 2
+
+    ssize_t send_with_fd(int socket, char *data, size_t size, int fd);
+    ssize_t send_with_fds(int socket, void *data, size_t size, int *fds, int count);
+    ssize_t recv_with_fds(int socket, void *data, size_t size, int *fds, int *count);
+    int ascii_packet_size(char *packet, int available);
+
+    #define FRAME_BUFFER_BYTES ((HEADER_BYTES) + MAX_BATCH_SIZE) * 2
+
+    /* TCP is a stream - frames are cut out of it by the size in their AAD */
+    typedef struct _frame_reader{
+        char buffer[FRAME_BUFFER_BYTES];
+        size_t filled;
+        size_t offset;
+        size_t max_payload; // MAX_MSG_SIZE from clients, MAX_BATCH_SIZE from the server
+        bool take_fds; // unix sockets only - otherwise passed fds are dropped
+        int passed_fd; // the last one taken, -1 if none
+    }Frame_reader;
+
+    ssize_t recv_frames(int socket, Frame_reader *reader);
+    size_t frame_reader_append(Frame_reader *reader, char *data, size_t size);
+    int next_frame(Frame_reader *reader, char **frame, int *size);
+
+    /* Encrypted frames waiting for one sendmsg - owned until sent */
+    typedef struct _out_queue{
+        struct iovec frames[OUT_MAX_FRAMES];
+        int count;
+        size_t first_sent; // bytes of the first frame a short send got out
+    }Out_queue;
+
+    void queue_frame(Out_queue *out, char *frame, int size);
+    ssize_t send_frames(int socket, Out_queue *out, int flags);
+    int pending_frames(Out_queue *out, struct iovec *iov);
+    bool frames_sent(Out_queue *out, size_t sent);
+    void clear_frames(Out_queue *out);
 
     typedef struct _client{
         int socket;
-        uint16_t ctr;
+        uint64_t ctr;
+        uint64_t send_ctr;
+        uint32_t salt; // nonces are derived from it and the counters
+        Suite suite;
+        uint8_t key_nonce[KEY_NONCE_BYTES]; // the session's key is derived from it
+        int room;
+        int room_pos;
+        uint64_t joined_seq; // first broadcast the client got live in its room
+        uint64_t last_heard; // written by the listener, read by the idle timer
+        bool pinged;
+        bool ring; // broadcasts come from the shared ring, not the socket
+        bool peer; // another host - relayed to, never in a room
+        bool outbound; // a peer link we opened, its salts go the other way round
+        Out_queue out; // flushed at the end of the broadcaster's burst
+        bool dirty;
+        bool corked;
+        bool send_failed; // nothing more is queued, it's being disconnected
+        Timer idle_timer;
+        Timer flush_timer; // retries what the socket had no room for
+        Timer throttle_timer; // releases its listener an io engine holds
+        char name[MAX_USERNAME_LEN];
         struct sockaddr_in addr;
-        pthread_t read_thread;
-        gcry_cipher_hd_t aes_gcm_handle;
+        pthread_t read_thread; // not started when an io engine reads the clients
+        bool reading; // read_thread was started - it may be dropped before that
+        void *io_context; // its Listener while the engine reads it, or until its thread takes it over
+        gcry_cipher_hd_t recv_cipher; // the listener's
+        gcry_cipher_hd_t send_cipher; // used under client_lock, or by a seal run holding it
     }Client;
 
 #endif
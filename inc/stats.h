@@ -0,0 +1,66 @@
+#ifndef STATS_H
+    #define STATS_H
+
+    #include <inc/general.h>
+    #include <stdatomic.h>
+
+    /* Log-linear (HDR style) buckets: 2^HIST_SUB_BITS buckets per power of two */
+    #define HIST_SUB_BITS 4
+    #define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+    #define HIST_MAX_EXP 40 // ~18 min in nanoseconds, larger values are clamped
+    #define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+    typedef enum _stage{
+        STAGE_RECV,
+        STAGE_DECRYPT,
+        STAGE_QUEUE_WAIT,
+        STAGE_ENCODE,
+        STAGE_ENCRYPT,
+        STAGE_SEND,
+        STAGE_COUNT
+    }Stage;
+
+    typedef enum _stat_counter{
+        STAT_BYTES_IN,
+        STAT_BYTES_OUT,
+        STAT_MSGS_IN,
+        STAT_MSGS_OUT,
+        STAT_DROPS,
+        STAT_AUTH_FAILURES,
+        STAT_CONNECTS,
+        STAT_DISCONNECTS,
+        STAT_RECONNECTS,
+        STAT_THROTTLED,
+        STAT_FLOOD_KICKS,
+        STAT_TIMEOUTS,
+        STAT_RING_FRAMES,
+        STAT_SEND_CALLS,
+        STAT_RECV_CALLS,
+        STAT_COALESCED, // joins and leaves folded into a summary
+        STAT_RELAYED, // messages sent over peer links, once per link
+        STAT_RELAY_DUPS, // copies that came back around a loop of peers
+        STAT_COUNT
+    }Stat_counter;
+
+    /* One block per thread - only the owning thread writes into it */
+    typedef struct _stats_block{
+        _Atomic uint64_t hist[STAGE_COUNT][HIST_BUCKETS];
+        _Atomic uint64_t sum[STAGE_COUNT];
+        _Atomic uint64_t counters[STAT_COUNT];
+        bool in_use;
+
+        struct _stats_block *next;
+    }Stats_block;
+
+    void stats_init(char *path, int interval_secs);
+    void stats_stop(void);
+    void stats_record(Stage stage, uint64_t nanosecs);
+    void stats_add(Stat_counter counter, uint64_t amount);
+    void stats_dump(FILE *out);
+    uint64_t stats_counter(Stat_counter counter);
+
+    /* Times the statement(s) in line into the given stage */
+    #define STATS_TIME(line, stage) {uint64_t _t0 = get_monotonic_nanosecs(); line\
+            stats_record(stage, get_monotonic_nanosecs() - _t0);}
+
+#endif
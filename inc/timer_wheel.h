@@ -0,0 +1,37 @@
+#ifndef TIMER_WHEEL_H
+    #define TIMER_WHEEL_H
+
+    #include <inc/general.h>
+    #include <inc/setting.h>
+
+    /* Hierarchical wheel - WHEEL_LEVELS levels of WHEEL_SLOTS slots, each level
+       WHEEL_SLOTS times coarser than the one below. Arming and cancelling
+       are O(1), a tick touches one slot (plus a cascade every WHEEL_SLOTS ticks) */
+    #define WHEEL_BITS 6
+    #define WHEEL_SLOTS (1 << WHEEL_BITS)
+    #define WHEEL_MASK (WHEEL_SLOTS - 1)
+    #define WHEEL_LEVELS 4
+    #define WHEEL_MAX_TICKS ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+    #define WHEEL_FIRE_BATCH 256
+
+    /* Runs on the wheel's thread without the wheel locked - may take other locks */
+    typedef void (*Timer_callback)(void *arg);
+
+    typedef struct _timer{
+        uint64_t expires; // tick
+        Timer_callback callback;
+        void *arg;
+        bool armed;
+
+        struct _timer *next;
+        struct _timer *prev;
+    }Timer;
+
+    void timer_wheel_start(void);
+    void timer_wheel_stop(void);
+
+    void timer_init(Timer *timer, Timer_callback callback, void *arg);
+    void timer_arm(Timer *timer, uint64_t delay_ms);
+    void timer_cancel(Timer *timer);
+
+#endif
@@ -4,6 +4,7 @@
     #include <ncurses.h>
     #include <locale.h>
     #include <stdarg.h>
+    #include <wchar.h>
 
     #define MAX_MESSAGE_LIST 100
     #define MSGBOX_LINES 1
@@ -12,9 +13,27 @@
     #define WIN_BORDER_SIZE_Y 1
     #define WIN_BORDER_SIZE_X 1
 
+    /* Bracketed paste - the terminal wraps pasted text in these, ncurses
+       hands them over as the keys below */
+    #define PASTE_MODE_ON "\033[?2004h"
+    #define PASTE_MODE_OFF "\033[?2004l"
+    #define PASTE_BEGIN_SEQ "\033[200~"
+    #define PASTE_END_SEQ "\033[201~"
+    #define KEY_PASTE_BEGIN (KEY_MAX + 1)
+    #define KEY_PASTE_END (KEY_MAX + 2)
+
     #define COLOR(lines, win, cid) wattron(win, COLOR_PAIR(cid)); lines\
             wattroff(win, COLOR_PAIR(cid));
 
+    #include <inc/message.h>
+
+    extern int main_maxx;
+
     void *run_ncurses_window(void *_);
+    int parse_message_to_rows(Msg *message);
+    void patch_msg_expressions(char *message);
+    void free_msg_rows(Msg *msg);
+    void queue_incoming(Msg msg);
+    void queue_outgoing(char *text);
 
 #endif
\ No newline at end of file
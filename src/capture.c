@@ -0,0 +1,106 @@
+#include <inc/capture.h>
+#include <inc/general.h>
+#include <inc/setting.h>
+
+FILE *capture_file = NULL;
+uint64_t capture_start;
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int capture_open(char *path) {
+  if (path == NULL || *path == '\0')
+    return 1;
+
+  if ((capture_file = fopen(path, "wb")) == NULL) {
+    fprintf(stderr, "Failed to open capture %s - %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  /* Records are small, let stdio batch them into big writes */
+  setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFFER_BYTES);
+
+  fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_BYTES, capture_file);
+  capture_start = get_monotonic_nanosecs();
+
+  return 0;
+}
+
+/* Called by every listener thread - cheap no-op when capturing is off */
+void capture_frame(uint32_t conn_id, char *payload, uint16_t size) {
+  if (capture_file == NULL)
+    return;
+
+  char header[CAPTURE_RECORD_HEADER];
+  uint64_t timestamp = get_monotonic_nanosecs() - capture_start;
+
+  memcpy(header, &timestamp, sizeof(timestamp));
+  memcpy(header + 8, &conn_id, sizeof(conn_id));
+  memcpy(header + 12, &size, sizeof(size));
+
+  pthread_mutex_lock(&capture_lock);
+
+  /* Closed while waiting for the lock */
+  if (capture_file != NULL) {
+    fwrite(header, 1, CAPTURE_RECORD_HEADER, capture_file);
+    fwrite(payload, 1, size, capture_file);
+  }
+
+  pthread_mutex_unlock(&capture_lock);
+
+  return;
+}
+
+void capture_close(void) {
+  if (capture_file == NULL)
+    return;
+
+  pthread_mutex_lock(&capture_lock);
+
+  fclose(capture_file);
+  capture_file = NULL;
+
+  pthread_mutex_unlock(&capture_lock);
+
+  return;
+}
+
+FILE *capture_open_for_reading(char *path) {
+  FILE *in;
+  char magic[CAPTURE_MAGIC_BYTES];
+
+  if ((in = fopen(path, "rb")) == NULL)
+    return NULL;
+
+  if (fread(magic, 1, CAPTURE_MAGIC_BYTES, in) != CAPTURE_MAGIC_BYTES ||
+      memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_BYTES)) {
+    fclose(in);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return in;
+}
+
+/* Caller frees record->payload - returns 1 at the end of the capture */
+int capture_read_record(FILE *in, Capture_record *record) {
+  char header[CAPTURE_RECORD_HEADER];
+
+  if (fread(header, 1, CAPTURE_RECORD_HEADER, in) != CAPTURE_RECORD_HEADER)
+    return 1;
+
+  memcpy(&record->timestamp, header, sizeof(record->timestamp));
+  memcpy(&record->conn_id, header + 8, sizeof(record->conn_id));
+  memcpy(&record->size, header + 12, sizeof(record->size));
+
+  if ((record->payload = (char *)malloc(record->size + 1)) == NULL) {
+    HANDLE_ERROR("Failed to allocate memory for a capture record", 1);
+  }
+
+  if (fread(record->payload, 1, record->size, in) != record->size) {
+    free(record->payload);
+    return 1;  // truncated, the server was probably killed mid-write
+  }
+
+  record->payload[record->size] = '\0';
+
+  return 0;
+}
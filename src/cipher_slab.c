@@ -0,0 +1,121 @@
+#include <sys/mman.h>
+
+#include <inc/cipher_slab.h>
+#include <inc/general.h>
+#include <inc/setting.h>
+
+/* Set once before any thread starts, the free list is under slab_lock */
+char *slab = NULL;
+size_t slab_slots = 0, slab_used = 0, session_bytes = 0;
+uint32_t *free_slots = NULL;  // a stack of free slot indices
+size_t free_count = 0;
+bool slab_locked = false;
+pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Size of the latest request - a cipher open's is what a session costs */
+size_t last_request = 0;
+
+int cipher_slab_init(size_t slots) {
+  size_t bytes = slots * SLAB_SLOT_BYTES;
+
+  slab = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+  if (slab == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %zu cipher slots - %s\n", slots, strerror(errno));
+    slab = NULL;
+    return 1;
+  }
+
+  /* Keys stay out of swap and core dumps, if the limits allow it */
+  if (mlock(slab, bytes) == 0) {
+    slab_locked = true;
+  } else {
+    fprintf(
+        stderr, "Cipher slab (%zu KiB) is not locked in memory - %s, see ulimit -l\n",
+        bytes / 1024, strerror(errno));
+  }
+
+  madvise(slab, bytes, MADV_DONTDUMP);
+
+  if ((free_slots = (uint32_t *)malloc(slots * sizeof(uint32_t))) == NULL) {
+    HANDLE_ERROR("Failed to allocate memory for the cipher slab", 1);
+  }
+
+  /* Lowest slots handed out first */
+  for (size_t i = 0; i < slots; i++)
+    free_slots[i] = slots - 1 - i;
+
+  slab_slots = slots;
+  free_count = slots;
+
+  return 0;
+}
+
+/* NULL once the slab is full or the request doesn't fit a slot -
+   libgcrypt reports it as out of memory */
+void *slab_alloc(size_t size) {
+  char *p = NULL;
+
+  if (size > SLAB_SLOT_BYTES) {
+    errno = ENOMEM;  // what libgcrypt reports
+    return NULL;
+  }
+
+  pthread_mutex_lock(&slab_lock);
+
+  if (free_count > 0) {
+    p = slab + (size_t)free_slots[--free_count] * SLAB_SLOT_BYTES;
+    slab_used++;
+    last_request = size;
+  } else {
+    errno = ENOMEM;
+  }
+
+  pthread_mutex_unlock(&slab_lock);
+
+  return p;
+}
+
+/* Wiped before it can be handed out again */
+void slab_free(void *p) {
+  explicit_bzero(p, SLAB_SLOT_BYTES);
+
+  pthread_mutex_lock(&slab_lock);
+
+  free_slots[free_count++] = ((char *)p - slab) / SLAB_SLOT_BYTES;
+  slab_used--;
+
+  pthread_mutex_unlock(&slab_lock);
+
+  return;
+}
+
+bool slab_owns(const void *p) {
+  return slab != NULL && (char *)p >= slab && (char *)p < slab + slab_slots * SLAB_SLOT_BYTES;
+}
+
+/* Called after a cipher handle is opened - its size is what a session costs */
+void slab_note_session(size_t used_before) {
+  pthread_mutex_lock(&slab_lock);
+
+  if (session_bytes == 0 && slab_used > used_before)
+    session_bytes = last_request;
+
+  pthread_mutex_unlock(&slab_lock);
+
+  return;
+}
+
+void slab_usage(Slab_usage *usage) {
+  pthread_mutex_lock(&slab_lock);
+
+  usage->slots = slab_slots;
+  usage->used = slab_used;
+  usage->slot_bytes = SLAB_SLOT_BYTES;
+  usage->session_bytes = session_bytes;
+  usage->locked = slab_locked;
+
+  pthread_mutex_unlock(&slab_lock);
+
+  return;
+}
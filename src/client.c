@@ -1,27 +1,117 @@
+#include <inc/client.h>
 #include <inc/crypt.h>
 #include <inc/general.h>
 #include <inc/message.h>
 #include <inc/setting.h>
+#include <inc/shm_ring.h>
 #include <inc/socket_utilities.h>
 #include <inc/window_manager.h>
 
-void *write_to_server(void *p_socket);
-void *read_from_server(void *p_socket);
-
-gcry_cipher_hd_t aes256_gcm_handle;
+void *write_to_server(void *_);
+void *read_from_server(void *_);
+int send_to_server(Msg **msgs, int count);
+void send_hello(void);
+void reconnect(void);
+void deliver_packets(char *packet, int payload_size, int *passed_fd);
+void note_seq(uint64_t seq);
+void handle_ring_room(char *args, int *passed_fd);
+void *read_from_ring(void *_);
+void stop_ring(void);
+
+/* One each way - the reader and the writer never share a handle */
+gcry_cipher_hd_t send_cipher, recv_cipher;
+
+/* The link to the server - replaced on reconnect, under link_lock */
+int server_socket = -1;
+uint64_t send_ctr = 0;
+uint32_t session_salt;  // from the server's handshake, both ways' nonces start from it
+Suite session_suite;  // picked by the server from what we offered
+uint8_t session_key_nonce[KEY_NONCE_BYTES];  // the server's pick, the session's key is derived from it
+bool link_ready = false;
+pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t link_up = PTHREAD_COND_INITIALIZER;
+
+/* Highest broadcast sequence seen - the server resumes from here */
+uint64_t last_seq = 0;
+
+/* Broadcasts from the server's shared ring, when a unix link asked for it.
+   Where our room's broadcasts start is passed from the socket's reader */
+Ring *local_ring = NULL;
+pthread_t ring_reader;
+bool ring_stopping = false;
+bool ring_switch = false;
+uint64_t ring_switch_at;
+int ring_switch_room;
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void start_client(void) {
-  /*******************   SETTING UP THE CONNECTTION   *******************/
+  init_libgcrypt(CIPHERS_PER_SESSION + 1);  // the session and the shared ring
+
+  server_socket = connect_to_server(&session_salt, &session_suite, session_key_nonce);
+
+  if (server_socket == -1)
+    return;
+
+  /**********************   CONNECTION ACCEPTED   ***********************/
+
+  init_cipher(&send_cipher, session_suite, session_key_nonce);
+  init_cipher(&recv_cipher, session_suite, session_key_nonce);
+
+  /* Widths are known from the locale, messages are laid out before the UI runs */
+  setlocale(LC_ALL, "");  //for utf-8
+
+  /* Init the message queues */
+  init_list(&read_head, &read_tail);
+  init_list(&write_head, &write_tail);
+
+  send_hello();
+  link_ready = true;
+
+  pthread_t message_sender, message_listener, user_interface;
+
+  pthread_create(&message_listener, NULL, read_from_server, NULL);
+  pthread_create(&message_sender, NULL, write_to_server, NULL);
+  pthread_create(&user_interface, NULL, run_ncurses_window, NULL);
+
+  pthread_join(user_interface, NULL);
+
+  /* Close the other threads */
+  pthread_cancel(message_sender);
+  pthread_cancel(message_listener);
+  pthread_join(message_listener, NULL);
+  stop_ring();
+
+  /***********************   CONNECTION CLOSED   ************************/
+
+  /* Free queues */
+  empty_list(&read_head);
+  empty_list(&write_head);
+
+  close(server_socket);
 
-  init_libgcrypt();
+  return;
+}
+
+/* Connects and authenticates - returns the socket or -1, and the session's
+   salt and suite */
+int connect_to_server(uint32_t *salt, Suite *suite, uint8_t *key_nonce) {
+  return connect_to_host(connection.ipv4, connection.port, connection.unix_path, salt, suite, key_nonce);
+}
+
+/* The same for any host - peered hosts link to each other with it */
+int connect_to_host(char *ipv4, char *port, char *unix_path, uint32_t *salt, Suite *suite, uint8_t *key_nonce) {
+  /*******************   SETTING UP THE CONNECTTION   *******************/
 
   /* Set IP and port */
-  in_addr_t addr = str_to_bin_IP(connection.ipv4);
-  int16_t port_num = str_to_uint16_t(connection.port);
+  in_addr_t addr = str_to_bin_IP(ipv4);
+  int16_t port_num = str_to_uint16_t(port);
+
+  /* Same-host server - the rest of the session doesn't know the difference */
+  bool local = (*unix_path != '\0');
 
   /* Create a new socket int protocol = 0 default)*/
   /* SOCK_STREAM -> TCP, SOCK_DGRAM -> UDP */
-  int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+  int server_socket = socket((local) ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
 
   if (server_socket == -1) {
     HANDLE_ERROR("Failed to create a socket.", 1);
@@ -29,182 +119,462 @@ void start_client(void) {
 
   /* Create server address */
   struct sockaddr_in server_address;
-
-  server_address.sin_family = AF_INET;
-  server_address.sin_port = htons(port_num);
-  server_address.sin_addr.s_addr = addr;
-
-  int status = connect(
-      server_socket,
-      (struct sockaddr *)&server_address,
-      sizeof(server_address));
+  struct sockaddr_un unix_address = {.sun_family = AF_UNIX};
+  int status;
+
+  if (local) {
+    strncpy(unix_address.sun_path, unix_path, sizeof(unix_address.sun_path) - 1);
+
+    status = connect(
+        server_socket,
+        (struct sockaddr *)&unix_address,
+        sizeof(unix_address));
+
+  } else {
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port_num);
+    server_address.sin_addr.s_addr = addr;
+
+    status = connect(
+        server_socket,
+        (struct sockaddr *)&server_address,
+        sizeof(server_address));
+  }
 
   /* If binding succeeds, connect returns 0, -1 if error and errno */
   if (status) {
-    fprintf(
-        stderr, "Failed to connect %s:%d - %s\n",
-        connection.ipv4, port_num,
-        strerror(errno));
-    exit(EXIT_FAILURE);
+    if (local)
+      fprintf(stderr, "Failed to connect %s%s - %s\n", UNIX_PREFIX, unix_path, strerror(errno));
+    else
+      fprintf(
+          stderr, "Failed to connect %s:%d - %s\n",
+          ipv4, port_num,
+          strerror(errno));
+    close(server_socket);
+    return -1;
   }
 
   /**********************   CONNECTED TO SERVER   ***********************/
 
+  /* The hash and the suites we'd run, most wanted first */
   char *argon2id_hash = generate_argon2id_hash(connection.password);
-  char server_response[MAX_BUFFER];
+  char server_response[MAX_BUFFER], code[MAX_BUFFER] = "", suite_str[MAX_BUFFER] = "";
+  char nonce_str[MAX_BUFFER] = "";
+  char hello[MAX_BUFFER];
 
-  send(server_socket, argon2id_hash, strlen(argon2id_hash) + 1, 0);
+  snprintf(
+      hello, MAX_BUFFER, "%s %s", argon2id_hash,
+      (*connection.suites != '\0') ? connection.suites : DEFAULT_SUITES);
 
-  if (read_one_packet(server_socket, server_response, MAX_BUFFER)) {
+  send(server_socket, hello, strlen(hello) + 1, 0);
+  free(argon2id_hash);
+
+  if (read_one_packet(server_socket, server_response, MAX_BUFFER, HANDSHAKE_TIMEOUT_MS)) {
     close(server_socket);
-    return;
+    return -1;
   }
 
-  if (strcmp(server_response, RESPONSE_OK)) {
+  server_response[MAX_BUFFER - 1] = '\0';
+  sscanf(server_response, "%s %" SCNx32 " %s %s", code, salt, suite_str, nonce_str);
+
+  if (strcmp(code, RESPONSE_OK)) {
     printf("Could not connect (%s). Closing client.\n", server_response);
-    return;
+    close(server_socket);
+    return -1;
   }
 
-  free(argon2id_hash);
-
-  /**********************   CONNECTION ACCEPTED   ***********************/
-
-  init_AES_256_cipher(&aes256_gcm_handle);
+  /* A server from before suites names none */
+  *suite = (*suite_str != '\0') ? suite_by_name(suite_str) : SUITE_AES256_GCM;
 
-  /* Init the message queues */
-  init_list(&read_head, &read_tail);
-  init_list(&write_head, &write_tail);
+  if (*suite == -1) {
+    printf("Server picked an unknown cipher suite (%s). Closing client.\n", suite_str);
+    close(server_socket);
+    return -1;
+  }
 
-  pthread_t message_sender, message_listener, user_interface;
+  /* Keys are per session now, a server without them can't be talked to */
+  if (hex_to_bytes(nonce_str, key_nonce, KEY_NONCE_BYTES)) {
+    printf("Server sent no session key. Closing client.\n");
+    close(server_socket);
+    return -1;
+  }
 
-  /* Allocating heap mem for socket fd as it's sent to threads */
-  int *sock_fd;
+  return server_socket;
+}
 
-  if ((sock_fd = (int *)malloc(sizeof(server_socket))) == NULL) {
-    HANDLE_ERROR("Failed to allocate memory for socket fd", 1);
-  }
-  *sock_fd = server_socket;
+/* One sendmsg for all of them - callers hold link_lock, returns -1 if the link is down */
+int send_to_server(Msg **msgs, int count) {
+  static Out_queue out;
+  char *ascii_packet, *enc_packet;
+  int packet_size, new_size;
 
-  pthread_create(&message_listener, NULL, read_from_server, sock_fd);
+  for (int i = 0; i < count; i++) {
+    ascii_packet = message_to_ascii_packet(msgs[i], &packet_size);
+    enc_packet = encrypt_packet(
+        ascii_packet,
+        packet_size, &new_size,
+        &send_cipher, SALT_TO_SERVER(session_salt), ++send_ctr);
+    queue_frame(&out, enc_packet, new_size);
 
-  /* Read/write func frees the memory, hence the reallocation */
-  if ((sock_fd = (int *)malloc(sizeof(server_socket))) == NULL) {
-    HANDLE_ERROR("Failed to allocate memory for socket fd", 1);
+    free(ascii_packet);
   }
-  *sock_fd = server_socket;
 
-  pthread_create(&message_sender, NULL, write_to_server, sock_fd);
-  pthread_create(&user_interface, NULL, run_ncurses_window, NULL);
+  return (send_frames(server_socket, &out, 0) == -1) ? -1 : 0;
+}
 
-  pthread_join(user_interface, NULL);
+/* First thing on every link - who we are, where we were and what we saw last.
+   Callers hold link_lock (or run before the other threads) */
+void send_hello(void) {
+  char resume[MAX_MSG_LEN];
+  Msg hello[3], *msgs[3] = {&hello[0], &hello[1], &hello[2]};
+  int count = 0;
 
-  /* Close the other threads */
-  pthread_cancel(message_sender);
-  pthread_cancel(message_listener);
+  /* The name lets direct messages find us before we speak */
+  hello[count++] = compose_message("/" C_CHANGE_USERNAME, NULL, user.username);
 
-  /***********************   CONNECTION CLOSED   ************************/
+  snprintf(
+      resume, MAX_MSG_LEN, "/" C_RESUME " %" PRIu64 " %s",
+      __atomic_load_n(&last_seq, __ATOMIC_RELAXED), user.room);
+  hello[count++] = compose_message(resume, NULL, user.username);
 
-  /* Free queues */
-  empty_list(&read_head);
-  empty_list(&write_head);
+  /* Same host - broadcasts can come through shared memory */
+  if (connection.shm_ring && *connection.unix_path != '\0')
+    hello[count++] = compose_message("/" C_RING, NULL, user.username);
 
-  close(server_socket);
+  send_to_server(msgs, count);
 
   return;
 }
 
-/* Sends messages to server */
-void *write_to_server(void *p_socket) {
-  int socket = *((int *)p_socket), msg_count = 0;
-  free(p_socket);
-
+/* Sends messages to server - whatever has piled up goes in one call.
+   Waits out reconnects, nothing typed meanwhile is lost */
+void *write_to_server(void *_) {
   pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
-  Msg *outgoing_msg;
-  char *ascii_packet, *enc_packet;
-  int packet_size, new_size;
+  Msg *outgoing_msgs[OUT_MAX_FRAMES];
+  int count;
 
   while (true) {
     pthread_mutex_lock(&w_lock);
 
-    if ((outgoing_msg = pop_msg_from_queue(&write_head, NULL)) == NULL) {
+    while (write_head == NULL)
       pthread_cond_wait(&message_ready, &w_lock);
 
-      /* Message should be ready now */
-      outgoing_msg = pop_msg_from_queue(&write_head, NULL);
-    }
+    for (count = 0; count < OUT_MAX_FRAMES && write_head != NULL; count++)
+      outgoing_msgs[count] = pop_msg_from_queue(&write_head, NULL);
 
     pthread_mutex_unlock(&w_lock);
 
-    ascii_packet = message_to_ascii_packet(outgoing_msg, &packet_size);
-    enc_packet = encrypt_packet(
-        ascii_packet,
-        packet_size, &new_size,
-        &aes256_gcm_handle, ++msg_count);
-    send(socket, enc_packet, new_size, 0);
+    pthread_mutex_lock(&link_lock);
 
-    free(ascii_packet);
-    free(enc_packet);
-    free(outgoing_msg);
+    while (!link_ready || send_to_server(outgoing_msgs, count)) {
+      link_ready = false;  // the reader notices too, and reconnects
+      pthread_cond_wait(&link_up, &link_lock);
+    }
+
+    pthread_mutex_unlock(&link_lock);
+
+    for (int i = 0; i < count; i++)
+      free(outgoing_msgs[i]);
   }
 
   return NULL;
 }
 
+/* Backs off exponentially (with jitter) until the server takes us back */
+void reconnect(void) {
+  int socket, delay_ms = RECONNECT_MIN_MS;
+  uint32_t salt;
+  Suite suite;
+  uint8_t key_nonce[KEY_NONCE_BYTES];
+  struct timespec delay;
+  char text[MAX_MSG_LEN];
+
+  /* The new session asks for the ring again */
+  stop_ring();
+
+  pthread_mutex_lock(&link_lock);
+
+  link_ready = false;
+  close(server_socket);
+
+  pthread_mutex_unlock(&link_lock);
+
+  while (true) {
+    snprintf(text, MAX_MSG_LEN, "Connection lost - reconnecting in %d ms", delay_ms);
+    queue_incoming(compose_message(text, "0", "/7:System"));
+
+    delay = nanosec_to_timespec((delay_ms + rand() % (delay_ms / 2 + 1)) * 1000000L);
+    nanosleep(&delay, NULL);
+
+    if ((socket = connect_to_server(&salt, &suite, key_nonce)) != -1)
+      break;
+
+    delay_ms = (delay_ms * 2 > RECONNECT_MAX_MS) ? RECONNECT_MAX_MS : delay_ms * 2;
+  }
+
+  /* A new session - the server counts from zero again */
+  pthread_mutex_lock(&link_lock);
+
+  server_socket = socket;
+  session_salt = salt;
+
+  /* A new key, maybe another suite too - nobody else holds the ciphers
+     while the link is down */
+  memcpy(session_key_nonce, key_nonce, KEY_NONCE_BYTES);
+  clean_cipher(&send_cipher);
+  clean_cipher(&recv_cipher);
+  init_cipher(&send_cipher, suite, session_key_nonce);
+  init_cipher(&recv_cipher, suite, session_key_nonce);
+  session_suite = suite;
+
+  send_ctr = 0;
+  send_hello();
+  link_ready = true;
+  pthread_cond_broadcast(&link_up);
+
+  pthread_mutex_unlock(&link_lock);
+
+  queue_incoming(compose_message("Reconnected.", "0", "/7:System"));
+
+  return;
+}
+
 /* Reads messages coming from the server and puts them into queue */
-void *read_from_server(void *p_socket) {
-  int socket = *((int *)p_socket), msg_count = 0;
-  free(p_socket);
+void *read_from_server(void *_) {
+  int socket = server_socket;
+  uint64_t msg_count = 0;
 
   pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
-  fd_set connected_socks, ready_socks;
-
-  /* Initialize structs */
-  FD_ZERO(&connected_socks);
-  FD_SET(socket, &connected_socks);
+  fd_set ready_socks;
+  struct timeval timeout;
+  int silent_checks = 0, ready;
 
   ssize_t received_bytes;
-  Msg msg;
 
-  char data_buffer[PACKET_MAX_BYTES], *packet;
+  Frame_reader reader = {
+      .filled = 0, .offset = 0, .max_payload = MAX_BATCH_SIZE,
+      .take_fds = connection.shm_ring && *connection.unix_path != '\0', .passed_fd = -1};
+  char *frame, *packet;
+  int frame_size, status = 0;
 
   while (true) {
-    ready_socks = connected_socks;
+    FD_ZERO(&ready_socks);
+    FD_SET(socket, &ready_socks);
 
-    if (select(socket + 1, &ready_socks, NULL, NULL, NULL) < 0) {
+    /* Checked every third of the idle timeout - pinged twice, then given up on */
+    timeout = (struct timeval){
+        .tv_sec = connection.idle_timeout / 3,
+        .tv_usec = (connection.idle_timeout % 3) * 1000000 / 3};
+
+    ready = select(
+        socket + 1, &ready_socks, NULL, NULL,
+        (connection.idle_timeout > 0) ? &timeout : NULL);
+
+    if (ready < 0) {
       HANDLE_ERROR("There was problem with read select", 1);
     }
 
-    if (FD_ISSET(socket, &ready_socks)) {
-      received_bytes = recv(socket, data_buffer, PACKET_MAX_BYTES, 0);
+    if (ready == 0) {
+      if (++silent_checks < 3) {
+        queue_outgoing("/" C_PING);
+        continue;
+      }
 
-      if (received_bytes <= 0) {
-        add_message_to_queue(
-            compose_message(
-                "Server closed the connection",
-                "0",
-                "/7:System"),
-            &read_head, &read_tail, &r_lock);
+      received_bytes = 0;  // a dead link
+    }
 
-        return NULL;
+    if (ready == 0 || FD_ISSET(socket, &ready_socks)) {
+      if (ready > 0) {
+        received_bytes = recv_frames(socket, &reader);
+        silent_checks = 0;
       }
 
-      if (received_bytes < MIN_PACKET_SIZE)
-        continue;  //rejected, malformed size
+      while (received_bytes > 0 && (status = next_frame(&reader, &frame, &frame_size)) == 1) {
+        if (frame_size < MIN_PACKET_SIZE)
+          continue;  //rejected, malformed size
 
-      packet = decrypt_packet(
-          data_buffer, &aes256_gcm_handle, msg_count++);
+        packet = decrypt_packet(
+            frame, &recv_cipher, SALT_TO_CLIENT(session_salt), msg_count++);
 
-      if (packet == NULL) {
-        continue;
+        if (packet == NULL) {
+          continue;
+        }
+
+        deliver_packets(packet, packet_payload_size(frame), &reader.passed_fd);
+        free(packet);
+      }
+
+      /* Closed, or the frame boundaries are lost */
+      if (received_bytes <= 0 || status == -1) {
+        reconnect();
+
+        socket = server_socket;
+        msg_count = 0;
+        silent_checks = 0;
+        reader.filled = reader.offset = 0;
+        status = 0;
+
+        if (reader.passed_fd != -1) {
+          close(reader.passed_fd);
+          reader.passed_fd = -1;
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* A frame's packets to the UI - history catch-up comes as several in one frame.
+   Keepalives and ring notices from the server aren't shown */
+void deliver_packets(char *packet, int payload_size, int *passed_fd) {
+  int offset, size;
+  Msg msg;
+
+  for (offset = 0; (size = ascii_packet_size(packet + offset, payload_size - offset)) != -1; offset += size) {
+    msg = ascii_packet_to_message(packet + offset, size);
+    note_seq(msg.seq);
+
+    if (*msg.username == '/' && !strcmp(msg.msg, "/" C_PING)) {
+      queue_outgoing("/" C_PONG);
+      continue;
+    }
+
+    if (*msg.username == '/' && !strcmp(msg.msg, "/" C_PONG))
+      continue;
+
+    if (*msg.username == '/' && !strncmp(msg.msg, "/" C_RING " ", strlen(C_RING) + 2)) {
+      handle_ring_room(msg.msg + strlen(C_RING) + 2, passed_fd);
+      continue;
+    }
+
+    queue_incoming(msg);
+  }
+
+  return;
+}
+
+/* Both readers see broadcasts - keeps the highest */
+void note_seq(uint64_t seq) {
+  uint64_t seen = __atomic_load_n(&last_seq, __ATOMIC_RELAXED);
+
+  while (seq > seen && !__atomic_compare_exchange_n(
+                           &last_seq, &seen, seq, false,
+                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  return;
+}
+
+/* "<position> <room>" - the first notice of a session comes with the ring's fd,
+   later ones follow room switches. The ring's reader picks them up within RING_WAIT_MS */
+void handle_ring_room(char *args, int *passed_fd) {
+  uint64_t position;
+  int room;
+
+  if (sscanf(args, "%" SCNu64 " %d", &position, &room) != 2)
+    return;
+
+  pthread_mutex_lock(&ring_lock);
+
+  ring_switch_at = position;
+  ring_switch_room = room;
+  __atomic_store_n(&ring_switch, true, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&ring_lock);
+
+  if (local_ring != NULL || passed_fd == NULL || *passed_fd == -1)
+    return;
+
+  local_ring = ring_map(*passed_fd);
+  *passed_fd = -1;
+
+  if (local_ring == NULL)
+    return;
+
+  __atomic_store_n(&ring_stopping, false, __ATOMIC_RELAXED);
+  pthread_create(&ring_reader, NULL, read_from_ring, NULL);
+
+  return;
+}
+
+/* Our room's broadcasts, straight from the server's memory */
+void *read_from_ring(void *_) {
+  gcry_cipher_hd_t ring_cipher;
+  uint64_t position;
+  int room, status;
+  Ring_slot slot;
+  char *packet;
+
+  /* Sealed with the server's favourite, which we have whether we offered it or not,
+     on the ring's own key */
+  init_cipher(&ring_cipher, local_ring->suite, local_ring->key_nonce);
+
+  /* Started by the first notice */
+  pthread_mutex_lock(&ring_lock);
+
+  position = ring_switch_at;
+  room = ring_switch_room;
+  ring_switch = false;
+
+  pthread_mutex_unlock(&ring_lock);
+
+  while (!__atomic_load_n(&ring_stopping, __ATOMIC_RELAXED)) {
+    /* Behind the switch the old room's broadcasts are still ours. Past it
+       the new room's ones were skipped - back to where they start */
+    if (__atomic_load_n(&ring_switch, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_lock(&ring_lock);
+
+      if (position >= ring_switch_at) {
+        position = ring_switch_at;
+        room = ring_switch_room;
+        ring_switch = false;
       }
 
-      msg = ascii_packet_to_message(packet);
-      add_message_to_queue(msg, &read_head, &read_tail, &r_lock);
-      free(packet);
+      pthread_mutex_unlock(&ring_lock);
     }
+
+    if ((status = ring_read(local_ring, &position, &slot)) == 0) {
+      ring_wait(local_ring, position, RING_WAIT_MS);
+      continue;
+    }
+
+    if (status == -1) {
+      queue_incoming(
+          compose_message("Fell behind the shared ring - messages were lost", "0", "/7:System"));
+      continue;
+    }
+
+    if (slot.room != room || slot.size > PACKET_MAX_BYTES ||
+        slot.size != HEADER_BYTES + packet_payload_size(slot.frame))
+      continue;
+
+    /* The frame's counter is its position - it doesn't authenticate anywhere else */
+    if ((packet = decrypt_packet(slot.frame, &ring_cipher, local_ring->salt, position - 1)) == NULL)
+      continue;
+
+    deliver_packets(packet, packet_payload_size(slot.frame), NULL);
+    free(packet);
   }
 
+  clean_cipher(&ring_cipher);
+
   return NULL;
-}
\ No newline at end of file
+}
+
+/* The socket's reader only (or after it's gone) */
+void stop_ring(void) {
+  if (local_ring == NULL)
+    return;
+
+  __atomic_store_n(&ring_stopping, true, __ATOMIC_RELAXED);
+  pthread_join(ring_reader, NULL);
+
+  ring_unmap(local_ring);
+  local_ring = NULL;
+  ring_switch = false;
+
+  return;
+}
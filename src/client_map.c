@@ -0,0 +1,67 @@
+#include <inc/client_map.h>
+#include <inc/general.h>
+#include <inc/setting.h>
+
+void init_client_map(Client_map *map) {
+  map->count = 0;
+  map->free_count = CLIENT_SLOTS;
+
+  /* Lowest slots are handed out first */
+  for (int i = 0; i < CLIENT_SLOTS; i++) {
+    map->generation[i] = 1;
+    map->free_slots[i] = CLIENT_SLOTS - 1 - i;
+  }
+
+  return;
+}
+
+/* Returns the new client's handle, NO_CLIENT if every slot is taken */
+Client_handle client_map_insert(Client_map *map, Client *client) {
+  if (map->free_count == 0)
+    return NO_CLIENT;
+
+  int slot = map->free_slots[--map->free_count];
+  Client_handle handle = (map->generation[slot] << HANDLE_SLOT_BITS) | slot;
+
+  map->slots[slot] = *client;
+  map->dense_pos[slot] = map->count;
+  map->dense[map->count++] = handle;
+
+  return handle;
+}
+
+/* NULL when the handle is stale - the client has left, maybe someone else took the slot */
+Client *client_map_get(Client_map *map, Client_handle handle) {
+  if (handle < 0)
+    return NULL;
+
+  int slot = handle & HANDLE_SLOT_MASK;
+
+  if (slot >= CLIENT_SLOTS || map->generation[slot] != handle >> HANDLE_SLOT_BITS)
+    return NULL;
+
+  return &map->slots[slot];
+}
+
+/* Copies the client into removed (when not NULL) - returns 1 if the handle was stale */
+int client_map_remove(Client_map *map, Client_handle handle, Client *removed) {
+  Client *client = client_map_get(map, handle);
+
+  if (client == NULL)
+    return 1;
+
+  int slot = handle & HANDLE_SLOT_MASK, pos = map->dense_pos[slot];
+
+  if (removed != NULL)
+    *removed = *client;
+
+  /* The last handle fills the hole in the dense list */
+  map->dense[pos] = map->dense[--map->count];
+  map->dense_pos[map->dense[pos] & HANDLE_SLOT_MASK] = pos;
+
+  /* Invalidates every copy of the handle */
+  map->generation[slot] = (map->generation[slot] == HANDLE_MAX_GENERATION) ? 1 : map->generation[slot] + 1;
+  map->free_slots[map->free_count++] = slot;
+
+  return 0;
+}
@@ -1,14 +1,22 @@
+#include <ctype.h>
 #include <arpa/inet.h>
+#include <inc/cipher_slab.h>
 #include <inc/crypt.h>
 
-void AES_256_GCM_128_encrypt(
-    gcry_cipher_hd_t *aes256_gcm_handle, char *msg_in,
+void aead_encrypt(
+    gcry_cipher_hd_t *handle, char *msg_in,
     size_t msg_len, Enc_msg *enc_msg);
 
-int AES_256_GCM_128_decrypt(
-    gcry_cipher_hd_t *aes256_gcm_handle, char *msg_out,
+int aead_decrypt(
+    gcry_cipher_hd_t *handle, char *msg_out,
     size_t msg_len, Enc_msg *enc_msg);
 
+/* Names on the wire and for -a, in Suite order */
+static const char *suite_names[SUITE_COUNT] = {"aes256-gcm", "chacha20-poly1305"};
+static const int suite_algos[SUITE_COUNT][2] = {
+    {GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM},
+    {GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305}};
+
 void handle_libgcrypt_error(gcry_error_t err, char *file, int line) {
   fprintf(
       stderr,
@@ -19,7 +27,34 @@ void handle_libgcrypt_error(gcry_error_t err, char *file, int line) {
   return;
 }
 
-void init_libgcrypt(void) {
+/* Libgcrypt's secure allocations go to the slab, the rest to the heap */
+int slab_is_secure(const void *p) {
+  return slab_owns(p);
+}
+
+void *slab_realloc(void *p, size_t size) {
+  if (!slab_owns(p))
+    return realloc(p, size);
+
+  return (size <= SLAB_SLOT_BYTES) ? p : NULL;
+}
+
+void slab_release(void *p) {
+  if (slab_owns(p))
+    slab_free(p);
+  else
+    free(p);
+
+  return;
+}
+
+/* Room for this many cipher handles at once, on top of libgcrypt's own */
+void init_libgcrypt(size_t sessions) {
+  if (cipher_slab_init(sessions + SLAB_SPARE_SLOTS))
+    exit(EXIT_FAILURE);
+
+  gcry_set_allocation_handler(malloc, slab_alloc, slab_is_secure, slab_realloc, slab_release);
+
   if (!gcry_check_version(MIN_LIBGCRYPT_VERSION)) {
     printf(
         "You are using old version of libgcrypt (%s)."
@@ -30,10 +65,6 @@ void init_libgcrypt(void) {
 
   gcry_control(GCRYCTL_USE_SECURE_RNDPOOL);
 
-  gcry_control(GCRYCTL_SUSPEND_SECMEM_WARN);
-  gcry_control(GCRYCTL_INIT_SECMEM, SEC_MEM_KIB, 0);
-  gcry_control(GCRYCTL_RESUME_SECMEM_WARN);
-
   gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 
   gcry_error_t err = GPG_ERR_NO_ERROR;
@@ -45,40 +76,199 @@ void init_libgcrypt(void) {
   return;
 }
 
-void init_AES_256_cipher(gcry_cipher_hd_t *aes256_gcm_handle) {
+Suite suite_by_name(char *name) {
+  for (int suite = 0; suite < SUITE_COUNT; suite++) {
+    if (!strcmp(name, suite_names[suite]))
+      return suite;
+  }
+
+  return -1;
+}
+
+const char *suite_name(Suite suite) {
+  return suite_names[suite];
+}
+
+/* Comma separated names into suites, in order - unknown names and repeats are
+   skipped, so an offer may name suites a newer peer has. Returns the count */
+int parse_suites(char *list, Suite *suites) {
+  char copy[MAX_SUITES_STR], *name, *save;
+  int count = 0;
+  Suite suite;
+
+  snprintf(copy, MAX_SUITES_STR, "%s", list);
+
+  for (name = strtok_r(copy, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+    if ((suite = suite_by_name(name)) == -1)
+      continue;
+
+    bool seen = false;
+    for (int i = 0; i < count; i++)
+      seen |= (suites[i] == suite);
+
+    if (!seen)
+      suites[count++] = suite;
+  }
+
+  return count;
+}
+
+void suites_to_str(Suite *suites, int count, char *out, size_t out_size) {
+  size_t len = 0;
+
+  *out = '\0';
+  for (int i = 0; i < count && len < out_size; i++)
+    len += snprintf(out + len, out_size - len, "%s%s", (i) ? "," : "", suite_names[suites[i]]);
+
+  return;
+}
+
+/* 1 when the slab is full - anything else is fatal. The key comes from the
+   session's nonce, NULL gives a random one nothing else ever has */
+int init_cipher(gcry_cipher_hd_t *handle, Suite suite, const uint8_t *key_nonce) {
   gcry_error_t err = GPG_ERR_NO_ERROR;
+  uint8_t key[BYTES_IN_256];
+  Slab_usage usage;
+
+  slab_usage(&usage);
+
+  if ((err = gcry_cipher_open(handle,
+                              suite_algos[suite][0], suite_algos[suite][1], GCRY_CIPHER_SECURE))) {
+    if (gcry_err_code(err) == GPG_ERR_ENOMEM) {
+      fprintf(stderr, "No room for another session, all %zu cipher slots are taken\n", usage.slots);
+      return 1;
+    }
 
-  if ((err = gcry_cipher_open(aes256_gcm_handle,
-                              GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM, GCRY_CIPHER_SECURE))) {
     HANDLE_LIBGCRYPT_ERROR(err);
   }
-  /*
-	void *key_256 = gcry_random_bytes_secure(
-		BYTES_IN_256, GCRY_VERY_STRONG_RANDOM
-	);*/
 
-  char *key_256 = "1234567890123456789123123123123";  // fixed for testing
+  slab_note_session(usage.used);
+
+  if (key_nonce != NULL)
+    derive_key(key_nonce, key);
+  else
+    gcry_randomize(key, BYTES_IN_256, GCRY_STRONG_RANDOM);
+
+  err = gcry_cipher_setkey(*handle, key, BYTES_IN_256);
+  explicit_bzero(key, BYTES_IN_256);
 
-  if ((err = gcry_cipher_setkey(*aes256_gcm_handle, key_256, BYTES_IN_256))) {
+  if (err) {
     HANDLE_LIBGCRYPT_ERROR(err);
   }
 
+  return 0;
+}
+
+/* HKDF-SHA256 (RFC 5869) of the password, salted with the nonce - one block
+   of output is the whole key. Only the password's Argon2id hash goes over
+   the wire, the nonce goes in the clear, so the keys are as secret as the
+   password is - with the default one (-w) anybody can derive them */
+void derive_key(const uint8_t *key_nonce, uint8_t *key) {
+  uint8_t prk[BYTES_IN_256];
+  char info[] = KEY_INFO "\x01";
+
+  hmac_sha256(key_nonce, KEY_NONCE_BYTES, connection.password, strlen(connection.password), prk);
+  hmac_sha256(prk, BYTES_IN_256, info, sizeof(info) - 1, key);
+  explicit_bzero(prk, BYTES_IN_256);
+
   return;
 }
 
-void AES_256_GCM_128_encrypt(
-    gcry_cipher_hd_t *aes256_gcm_handle, char *msg_in, size_t msg_len, Enc_msg *enc_msg) {
+/* out takes the 32 byte MAC, the state is kept in secure memory */
+void hmac_sha256(const void *key, size_t key_size, const void *data, size_t size, uint8_t *out) {
   gcry_error_t err = GPG_ERR_NO_ERROR;
+  gcry_md_hd_t md;
 
-  gcry_create_nonce(enc_msg->nonce, IV_BYTES);
+  if ((err = gcry_md_open(&md, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE))) {
+    HANDLE_LIBGCRYPT_ERROR(err);
+  }
+
+  if ((err = gcry_md_setkey(md, key, key_size))) {
+    HANDLE_LIBGCRYPT_ERROR(err);
+  }
+
+  gcry_md_write(md, data, size);
+  memcpy(out, gcry_md_read(md, GCRY_MD_SHA256), BYTES_IN_256);
+  gcry_md_close(md);
+
+  return;
+}
+
+/* Lowercase, hex takes size * 2 + 1 */
+void bytes_to_hex(const uint8_t *bytes, size_t size, char *hex) {
+  for (size_t i = 0; i < size; i++)
+    sprintf(hex + i * 2, "%02x", bytes[i]);
+
+  hex[size * 2] = '\0';
+
+  return;
+}
+
+/* 1 unless hex is exactly size bytes of it */
+int hex_to_bytes(const char *hex, uint8_t *bytes, size_t size) {
+  unsigned int byte;
+
+  if (strlen(hex) != size * 2)
+    return 1;
+
+  for (size_t i = 0; i < size; i++) {
+    if (!isxdigit((unsigned char)hex[i * 2]) || !isxdigit((unsigned char)hex[i * 2 + 1]) ||
+        sscanf(hex + i * 2, "%2x", &byte) != 1)
+      return 1;
+
+    bytes[i] = byte;
+  }
+
+  return 0;
+}
+
+/* Nanoseconds per full-size packet, sealed like a session seals them - the
+   best of a few rounds, so a preempted round doesn't decide. -1 if the slab is full.
+   The key is a throwaway, no session's is used on packets anyone can see */
+double probe_suite(Suite suite) {
+  gcry_cipher_hd_t handle;
+  char packet[MAX_MSG_SIZE];
+  char *enc_packet;
+  int new_size;
+  uint64_t start, elapsed, best = UINT64_MAX;
+
+  if (init_cipher(&handle, suite, NULL))
+    return -1;
+
+  memset(packet, 'x', MAX_MSG_SIZE);
+
+  for (int round = 0; round <= SUITE_PROBE_ROUNDS; round++) {
+    start = get_monotonic_nanosecs();
+
+    for (int i = 0; i < SUITE_PROBE_PACKETS; i++) {
+      enc_packet = encrypt_packet(packet, MAX_MSG_SIZE, &new_size, &handle, 0, i);
+      free(enc_packet);
+    }
+
+    elapsed = get_monotonic_nanosecs() - start;
+
+    /* The first round only warms up */
+    if (round > 0 && elapsed < best)
+      best = elapsed;
+  }
+
+  clean_cipher(&handle);
+
+  return (double)best / SUITE_PROBE_PACKETS;
+}
+
+/* Either suite - both take a 12 byte nonce, the AAD first and give a 16 byte tag */
+void aead_encrypt(
+    gcry_cipher_hd_t *handle, char *msg_in, size_t msg_len, Enc_msg *enc_msg) {
+  gcry_error_t err = GPG_ERR_NO_ERROR;
 
   if ((err = gcry_cipher_setiv(
-           *aes256_gcm_handle, enc_msg->nonce, IV_BYTES))) {
+           *handle, enc_msg->nonce, IV_BYTES))) {
     HANDLE_LIBGCRYPT_ERROR(err);
   }
 
   if ((err = gcry_cipher_authenticate(
-           *aes256_gcm_handle, enc_msg->aad, AAD_BYTES))) {
+           *handle, enc_msg->aad, AAD_BYTES))) {
     HANDLE_LIBGCRYPT_ERROR(err);
   }
 
@@ -87,56 +277,71 @@ void AES_256_GCM_128_encrypt(
   }
 
   if ((err = gcry_cipher_encrypt(
-           *aes256_gcm_handle, enc_msg->cipher_text, msg_len, msg_in, msg_len))) {
+           *handle, enc_msg->cipher_text, msg_len, msg_in, msg_len))) {
     HANDLE_LIBGCRYPT_ERROR(err);
   }
 
-  if ((err = gcry_cipher_gettag(*aes256_gcm_handle, enc_msg->tag, TAG_BYTES))) {
+  if ((err = gcry_cipher_gettag(*handle, enc_msg->tag, TAG_BYTES))) {
     HANDLE_LIBGCRYPT_ERROR(err);
   }
 
   return;
 }
 
-int AES_256_GCM_128_decrypt(
-    gcry_cipher_hd_t *aes256_gcm_handle, char *msg_out, size_t msg_len, Enc_msg *enc_msg) {
+int aead_decrypt(
+    gcry_cipher_hd_t *handle, char *msg_out, size_t msg_len, Enc_msg *enc_msg) {
   gcry_error_t err = GPG_ERR_NO_ERROR;
 
   if ((err = gcry_cipher_setiv(
-           *aes256_gcm_handle, enc_msg->nonce, IV_BYTES))) {
+           *handle, enc_msg->nonce, IV_BYTES))) {
     HANDLE_LIBGCRYPT_ERROR(err);
   }
 
   if ((err = gcry_cipher_authenticate(
-           *aes256_gcm_handle, enc_msg->aad, AAD_BYTES))) {
+           *handle, enc_msg->aad, AAD_BYTES))) {
     HANDLE_LIBGCRYPT_ERROR(err);
   }
 
   if ((err = gcry_cipher_decrypt(
-           *aes256_gcm_handle, msg_out, msg_len, enc_msg->cipher_text, msg_len))) {
+           *handle, msg_out, msg_len, enc_msg->cipher_text, msg_len))) {
     HANDLE_LIBGCRYPT_ERROR(err);
   }
 
-  if ((err = gcry_cipher_checktag(*aes256_gcm_handle, enc_msg->tag, TAG_BYTES))) {
+  if ((err = gcry_cipher_checktag(*handle, enc_msg->tag, TAG_BYTES))) {
     return 1;
   }
 
   return 0;
 }
 
+/* Salt then counter, big endian - never repeats while a salt's counter doesn't,
+   so neither side needs the RNG or sends the IV */
+void build_nonce(uint8_t *nonce, uint32_t salt, uint64_t ctr) {
+  uint32_t n_salt = htonl(salt);
+  uint64_t n_ctr = htobe64(ctr);
+
+  memcpy(nonce, &n_salt, SALT_BYTES);
+  memcpy(nonce + SALT_BYTES, &n_ctr, sizeof(n_ctr));
+
+  return;
+}
+
+/* Only the counter's low bits go on the wire, the receiver knows the rest */
 char *encrypt_packet(
-    char *packet, uint16_t size, int *new_size, gcry_cipher_hd_t *aes_gcm, uint16_t ctr) {
+    char *packet, uint16_t size, int *new_size,
+    gcry_cipher_hd_t *aes_gcm, uint32_t salt, uint64_t ctr) {
   Enc_msg enc_msg;
 
-  uint16_t n_ctr = htons(ctr);
+  uint16_t n_ctr = htons((uint16_t)ctr);
   uint16_t n_size = htons(size);
 
   memcpy(enc_msg.aad, &n_ctr, CTR_BYTES);
   memcpy(enc_msg.aad + CTR_BYTES, &n_size, SIZE_BYTES);
+  build_nonce(enc_msg.nonce, salt, ctr);
 
   char *enc_packet;
 
-  if ((enc_packet = (char *)malloc(PACKET_MAX_BYTES)) == NULL) {
+  if ((enc_packet = (char *)malloc(HEADER_BYTES + size)) == NULL) {
     HANDLE_ERROR("Failed to allocate memory for a packet", 1);
   }
 
@@ -145,10 +350,7 @@ char *encrypt_packet(
   memcpy(enc_packet, enc_msg.aad, AAD_BYTES);
   offset += AAD_BYTES;
 
-  AES_256_GCM_128_encrypt(aes_gcm, packet, size, &enc_msg);
-
-  memcpy(enc_packet + offset, enc_msg.nonce, IV_BYTES);
-  offset += IV_BYTES;
+  aead_encrypt(aes_gcm, packet, size, &enc_msg);
 
   memcpy(enc_packet + offset, enc_msg.tag, TAG_BYTES);
   offset += TAG_BYTES;
@@ -162,7 +364,8 @@ char *encrypt_packet(
   return enc_packet;
 }
 
-char *decrypt_packet(char *packet, gcry_cipher_hd_t *aes_gcm, uint16_t cur_ctr) {
+/* The frame must carry the counter after cur_ctr - its nonce is built from that */
+char *decrypt_packet(char *packet, gcry_cipher_hd_t *aes_gcm, uint32_t salt, uint64_t cur_ctr) {
   Enc_msg enc_msg;
 
   int offset = 0;
@@ -173,7 +376,7 @@ char *decrypt_packet(char *packet, gcry_cipher_hd_t *aes_gcm, uint16_t cur_ctr)
   ctr = ntohs(ctr);
   offset += CTR_BYTES;
 
-  if (ctr != (cur_ctr + 1))
+  if (ctr != (uint16_t)(cur_ctr + 1))
     return NULL;  //rejected, possibly a replay attack
 
   memcpy(&size, packet + offset, SIZE_BYTES);
@@ -181,11 +384,10 @@ char *decrypt_packet(char *packet, gcry_cipher_hd_t *aes_gcm, uint16_t cur_ctr)
   size = ntohs(size);
   offset += SIZE_BYTES;
 
-  if (size > MAX_MSG_SIZE)
+  if (size > MAX_BATCH_SIZE)
     return NULL;  //rejected, message too long
 
-  memcpy(enc_msg.nonce, packet + offset, IV_BYTES);
-  offset += IV_BYTES;
+  build_nonce(enc_msg.nonce, salt, cur_ctr + 1);
 
   memcpy(enc_msg.tag, packet + offset, TAG_BYTES);
   offset += TAG_BYTES;
@@ -201,8 +403,9 @@ char *decrypt_packet(char *packet, gcry_cipher_hd_t *aes_gcm, uint16_t cur_ctr)
     HANDLE_ERROR("Failed to allocate memory for a packet", 1);
   }
 
-  if (AES_256_GCM_128_decrypt(aes_gcm, msg_out, size, &enc_msg)) {
+  if (aead_decrypt(aes_gcm, msg_out, size, &enc_msg)) {
     clean_enc_msg(&enc_msg);
+    free(msg_out);
     return NULL;  //rejected, the tag does not match
   }
 
@@ -211,8 +414,17 @@ char *decrypt_packet(char *packet, gcry_cipher_hd_t *aes_gcm, uint16_t cur_ctr)
   return msg_out;
 }
 
-void clean_cipher(gcry_cipher_hd_t *aes256_gcm_handle) {
-  gcry_cipher_close(*aes256_gcm_handle);
+/* Plaintext size of an encrypted packet, read from its AAD */
+uint16_t packet_payload_size(char *packet) {
+  uint16_t size;
+
+  memcpy(&size, packet + CTR_BYTES, SIZE_BYTES);
+
+  return ntohs(size);
+}
+
+void clean_cipher(gcry_cipher_hd_t *handle) {
+  gcry_cipher_close(*handle);
 
   return;
 }
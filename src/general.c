@@ -112,3 +112,10 @@ struct timespec get_time_interval(struct timeval start, struct timeval end) {
 
   return nanosec_to_timespec(time_between);
 }
+
+uint64_t get_monotonic_nanosecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * NANOSECS_IN_SEC + ts.tv_nsec;
+}
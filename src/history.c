@@ -0,0 +1,49 @@
+#include <inc/general.h>
+#include <inc/history.h>
+#include <inc/setting.h>
+
+void history_append(History *history, char *ascii_packet, int size, uint64_t seq) {
+  History_entry *entry = &history->entries[history->head];
+
+  if (size > MAX_MSG_SIZE)
+    return;
+
+  memcpy(entry->packet, ascii_packet, size);
+  entry->size = size;
+  entry->seq = seq;
+
+  history->head = (history->head + 1) % HISTORY_SIZE;
+
+  if (history->count < HISTORY_SIZE)
+    history->count++;
+
+  return;
+}
+
+/* Packs the entries with after < seq < before, oldest first, starting from the next'th one -
+   returns the batch's size and advances next, 0 once everything has been packed */
+int history_batch(
+    History *history, int *next, uint64_t after, uint64_t before,
+    char *batch, int batch_size) {
+  int oldest = (history->head - history->count + HISTORY_SIZE) % HISTORY_SIZE;
+  int size = 0;
+  History_entry *entry;
+
+  while (*next < history->count) {
+    entry = &history->entries[(oldest + *next) % HISTORY_SIZE];
+
+    if (entry->seq <= after || entry->seq >= before) {
+      (*next)++;
+      continue;
+    }
+
+    if (size + entry->size > batch_size)
+      break;
+
+    memcpy(batch + size, entry->packet, entry->size);
+    size += entry->size;
+    (*next)++;
+  }
+
+  return size;
+}
@@ -0,0 +1,627 @@
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <inc/general.h>
+#include <inc/io_engine.h>
+#include <inc/setting.h>
+#include <inc/stats.h>
+
+/* No liburing - the rings are set up and driven with the raw syscalls */
+typedef struct _uring{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned to_submit;
+}Uring;
+
+int uring_init(Uring *ring, unsigned entries);
+void uring_exit(Uring *ring);
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+int uring_enter(Uring *ring, unsigned wait);
+void uring_wait(Uring *ring);
+int uring_setup_buffers(void);
+int uring_probe(void);
+void uring_arm_recv(int socket);
+void uring_cancel_recv(int socket);
+void uring_return_buffer(int bid);
+void *run_epoll(void *_);
+void *run_uring(void *_);
+
+static const char *engine_names[IO_KIND_COUNT] = {"threads", "epoll", "uring"};
+
+Io_kind engine_kind = IO_THREADS;
+Io_callback engine_callback;
+bool engine_running = false;
+pthread_t engine_thread;
+
+/* Held by the engine while it runs callbacks - forgetting a socket waits them out.
+   Taken through io_engine_pause, which a thread may nest */
+pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread int pause_depth = 0;
+
+/* Socket -> context, NULL when not watched. The generation tells io_uring
+   completions for a forgotten socket from the ones for its next owner */
+void *contexts[FD_SETSIZE];
+uint32_t generations[FD_SETSIZE];
+
+/* Not read until released - io_uring's recv may still be ending after the hold */
+bool held[FD_SETSIZE];
+bool recv_armed[FD_SETSIZE];
+
+int epoll_fd = -1;
+
+/* Receiving ring and its provided buffers - submissions under sq_lock, a leaf lock.
+   Sends have a ring of their own, used under the server's client_lock */
+Uring recv_ring, send_ring;
+pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;
+struct io_uring_buf_ring *buffer_ring = NULL;
+char *buffers = NULL;
+uint16_t buffer_tail = 0;
+
+#define URING_BUFFER_GROUP 0
+#define URING_CANCEL_KEY UINT64_MAX
+#define URING_KEY(socket) (((uint64_t)generations[socket] << 32) | (uint32_t)(socket))
+
+Io_kind io_engine_kind(char *name) {
+  for (int kind = 0; kind < IO_KIND_COUNT; kind++) {
+    if (!strcmp(name, engine_names[kind]))
+      return kind;
+  }
+
+  return -1;
+}
+
+const char *io_engine_name(Io_kind kind) {
+  return engine_names[kind];
+}
+
+/* Returns the engine that actually runs */
+Io_kind io_engine_start(Io_kind kind, Io_callback callback) {
+  engine_callback = callback;
+  memset(contexts, 0, sizeof(contexts));
+
+  if (kind == IO_URING) {
+    if (uring_init(&recv_ring, URING_ENTRIES) == 0 && uring_setup_buffers() == 0 &&
+        uring_probe() == 0 && uring_init(&send_ring, URING_ENTRIES) == 0) {
+      engine_kind = IO_URING;
+      pthread_create(&engine_thread, NULL, run_uring, NULL);
+      engine_running = true;
+
+      return engine_kind;
+    }
+
+    fprintf(stderr, "io_uring not supported (%s) - falling back to epoll\n", strerror(errno));
+    io_engine_stop();
+    kind = IO_EPOLL;
+  }
+
+  if (kind == IO_EPOLL) {
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+      HANDLE_ERROR("Failed to create an epoll instance", 1);
+    }
+
+    engine_kind = IO_EPOLL;
+    pthread_create(&engine_thread, NULL, run_epoll, NULL);
+    engine_running = true;
+
+    return engine_kind;
+  }
+
+  engine_kind = IO_THREADS;
+
+  return engine_kind;
+}
+
+void io_engine_stop(void) {
+  if (engine_running) {
+    pthread_cancel(engine_thread);
+    pthread_join(engine_thread, NULL);
+    engine_running = false;
+  }
+
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+
+  uring_exit(&send_ring);
+  uring_exit(&recv_ring);
+
+  if (buffer_ring != NULL) {
+    munmap(buffer_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(buffers);
+    buffer_ring = NULL;
+    buffers = NULL;
+  }
+
+  engine_kind = IO_THREADS;
+
+  return;
+}
+
+/* Callable with the server's client_lock held - takes no lock the callbacks need */
+void io_engine_watch(int socket, void *context) {
+  held[socket] = false;
+  __atomic_store_n(&contexts[socket], context, __ATOMIC_RELEASE);
+
+  if (engine_kind == IO_EPOLL) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = socket};
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event);
+
+  } else if (engine_kind == IO_URING) {
+    uring_arm_recv(socket);
+  }
+
+  return;
+}
+
+/* Holds the engine off between batches - its callbacks take the server's locks,
+   so this comes before them. Nested calls, like a callback's, just count */
+void io_engine_pause(void) {
+  if (engine_kind != IO_THREADS && pause_depth++ == 0)
+    pthread_mutex_lock(&dispatch_lock);
+
+  return;
+}
+
+void io_engine_resume(void) {
+  if (engine_kind != IO_THREADS && --pause_depth == 0)
+    pthread_mutex_unlock(&dispatch_lock);
+
+  return;
+}
+
+/* Paused callers only - the socket isn't read until released, so TCP pushes back
+   on the sender. Data the engine had already taken still comes to the callback */
+void io_engine_hold(int socket, void *context) {
+  struct epoll_event event = {.events = 0, .data.fd = socket};
+
+  if (engine_kind == IO_THREADS || contexts[socket] != context || held[socket])
+    return;
+
+  held[socket] = true;
+
+  if (engine_kind == IO_EPOLL)
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket, &event);
+  else
+    uring_cancel_recv(socket);
+
+  return;
+}
+
+/* Paused callers only - a recv still ending rearms itself when it's done */
+void io_engine_release(int socket, void *context) {
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = socket};
+
+  if (engine_kind == IO_THREADS || contexts[socket] != context || !held[socket])
+    return;
+
+  held[socket] = false;
+
+  if (engine_kind == IO_EPOLL)
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket, &event);
+  else if (!recv_armed[socket])
+    uring_arm_recv(socket);
+
+  return;
+}
+
+/* Paused callers only - no callback runs for the context after this.
+   A socket since handed to someone else is left alone */
+void io_engine_forget(int socket, void *context) {
+  if (engine_kind == IO_THREADS || contexts[socket] != context)
+    return;
+
+  contexts[socket] = NULL;
+
+  if (engine_kind == IO_EPOLL) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket, NULL);
+    return;
+  }
+
+  uring_cancel_recv(socket);
+
+  pthread_mutex_lock(&sq_lock);
+  generations[socket]++;  // whatever the recv still completes is stale
+  pthread_mutex_unlock(&sq_lock);
+
+  return;
+}
+
+/* A burst's queues - io_uring takes all the sends in one submission, the
+   others make a sendmsg each. Nothing blocks - what a full socket didn't take
+   stays queued, sent frames are freed, results are like send_frames' */
+void io_engine_send(int *sockets, Out_queue **queues, ssize_t *results, int count) {
+  static struct msghdr headers[URING_ENTRIES];
+  static struct iovec iovs[URING_ENTRIES][OUT_MAX_FRAMES];
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int batch, index, live[URING_ENTRIES], live_count, next, reaped;
+
+  if (engine_kind != IO_URING) {
+    for (int i = 0; i < count; i++)
+      results[i] = send_frames(sockets[i], queues[i], MSG_DONTWAIT);
+
+    return;
+  }
+
+  for (int first = 0; first < count; first += batch) {
+    batch = (count - first < URING_ENTRIES) ? count - first : URING_ENTRIES;
+
+    for (int i = 0; i < batch; i++) {
+      live[i] = first + i;
+      results[first + i] = 0;
+    }
+
+    /* Rounds until every queue is out - a short send goes again with the rest */
+    for (live_count = batch; live_count > 0; live_count = next) {
+      for (int i = 0; i < live_count; i++) {
+        headers[i] = (struct msghdr){
+            .msg_iov = iovs[i],
+            .msg_iovlen = pending_frames(queues[live[i]], iovs[i])};
+
+        sqe = uring_get_sqe(&send_ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sockets[live[i]];
+        sqe->addr = (uint64_t)(uintptr_t)&headers[i];
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        sqe->user_data = live[i];
+      }
+
+      uring_enter(&send_ring, live_count);
+      stats_add(STAT_SEND_CALLS, 1);
+
+      /* The wait may end early - every completion is reaped before the headers are reused */
+      for (next = 0, reaped = 0; reaped < live_count; reaped++) {
+        while (__atomic_load_n(send_ring.cq_tail, __ATOMIC_ACQUIRE) == *send_ring.cq_head)
+          uring_enter(&send_ring, 1);
+
+        cqe = &send_ring.cqes[*send_ring.cq_head & *send_ring.cq_mask];
+        index = cqe->user_data;
+
+        if (cqe->res == -EAGAIN) {
+          ;  // full, the caller retries the rest
+
+        } else if (cqe->res <= 0) {
+          results[index] = -1;
+          clear_frames(queues[index]);
+
+        } else {
+          results[index] += cqe->res;
+
+          if (!frames_sent(queues[index], cqe->res))
+            live[next++] = index;
+        }
+
+        __atomic_store_n(send_ring.cq_head, *send_ring.cq_head + 1, __ATOMIC_RELEASE);
+      }
+    }
+  }
+
+  return;
+}
+
+/*****************************   EPOLL   *****************************/
+
+/* Level triggered - whatever doesn't fit one recv is reported again */
+void *run_epoll(void *_) {
+  static char scratch[IO_SCRATCH_BYTES];
+  struct epoll_event events[EPOLL_EVENTS];
+  ssize_t received_bytes;
+  void *context;
+  int ready, socket;
+
+  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+  while (true) {
+    ready = epoll_wait(epoll_fd, events, EPOLL_EVENTS, -1);
+    stats_add(STAT_RECV_CALLS, 1);
+
+    /* Callbacks take locks, stopping is only allowed between batches */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    io_engine_pause();
+
+    for (int i = 0; i < ready; i++) {
+      socket = events[i].data.fd;
+
+      if ((context = contexts[socket]) == NULL)
+        continue;  // forgotten after the wait
+
+      received_bytes = recv(socket, scratch, IO_SCRATCH_BYTES, MSG_DONTWAIT);
+      stats_add(STAT_RECV_CALLS, 1);
+
+      if (received_bytes == -1 && (errno == EAGAIN || errno == EINTR))
+        continue;
+
+      engine_callback(context, scratch, received_bytes);
+    }
+
+    io_engine_resume();
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  }
+
+  return NULL;
+}
+
+/****************************   IO_URING   ****************************/
+
+int uring_init(Uring *ring, unsigned entries) {
+  struct io_uring_params params;
+
+  memset(ring, 0, sizeof(Uring));
+  memset(&params, 0, sizeof(params));
+
+  if ((ring->fd = syscall(SYS_io_uring_setup, entries, &params)) == -1)
+    return 1;
+
+  ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_map = mmap(
+      NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_map = mmap(
+      NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(
+      NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    uring_exit(ring);
+    return 1;
+  }
+
+  ring->sq_head = (unsigned *)((char *)ring->sq_map + params.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)ring->sq_map + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_map + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_map + params.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->cq_map + params.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_map + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_map + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + params.cq_off.cqes);
+
+  return 0;
+}
+
+void uring_exit(Uring *ring) {
+  if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+    munmap(ring->sq_map, ring->sq_map_size);
+  if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED)
+    munmap(ring->cq_map, ring->cq_map_size);
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->fd > 0)
+    close(ring->fd);
+
+  memset(ring, 0, sizeof(Uring));
+
+  return;
+}
+
+/* Zeroed and queued - NULL if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+  unsigned tail = *ring->sq_tail, index;
+
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= *ring->sq_mask + 1)
+    return NULL;
+
+  index = tail & *ring->sq_mask;
+  memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+  ring->sq_array[index] = index;
+
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+
+  return &ring->sqes[index];
+}
+
+/* Submits what was queued, waits for that many completions */
+int uring_enter(Uring *ring, unsigned wait) {
+  int submitted;
+
+  do {
+    submitted = syscall(
+        SYS_io_uring_enter, ring->fd, ring->to_submit, wait,
+        (wait > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (submitted == -1 && errno == EINTR);
+
+  if (submitted > 0)
+    ring->to_submit -= submitted;
+
+  return submitted;
+}
+
+/* Submits nothing - what others queued under sq_lock they submit themselves,
+   the kernel returns at once when asked for more than is there */
+void uring_wait(Uring *ring) {
+  syscall(SYS_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+  return;
+}
+
+/* Buffers the kernel picks from for multishot recvs */
+int uring_setup_buffers(void) {
+  struct io_uring_buf_reg reg;
+
+  buffer_ring = mmap(
+      NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (buffer_ring == MAP_FAILED) {
+    buffer_ring = NULL;
+    return 1;
+  }
+
+  if ((buffers = (char *)malloc(URING_BUFFERS * URING_BUFFER_BYTES)) == NULL) {
+    HANDLE_ERROR("Failed to allocate memory for io_uring buffers", 1);
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)buffer_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+
+  if (syscall(SYS_io_uring_register, recv_ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+    return 1;
+
+  buffer_tail = 0;
+
+  for (int bid = 0; bid < URING_BUFFERS; bid++)
+    uring_return_buffer(bid);
+
+  return 0;
+}
+
+void uring_return_buffer(int bid) {
+  struct io_uring_buf *buffer = &buffer_ring->bufs[buffer_tail & (URING_BUFFERS - 1)];
+
+  buffer->addr = (uint64_t)(uintptr_t)(buffers + (size_t)bid * URING_BUFFER_BYTES);
+  buffer->len = URING_BUFFER_BYTES;
+  buffer->bid = bid;
+
+  __atomic_store_n(&buffer_ring->tail, ++buffer_tail, __ATOMIC_RELEASE);
+
+  return;
+}
+
+void uring_arm_recv(int socket) {
+  struct io_uring_sqe *sqe;
+
+  pthread_mutex_lock(&sq_lock);
+
+  if ((sqe = uring_get_sqe(&recv_ring)) != NULL) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_KEY(socket);
+    uring_enter(&recv_ring, 0);
+    recv_armed[socket] = true;
+  }
+
+  pthread_mutex_unlock(&sq_lock);
+
+  return;
+}
+
+/* Its last completion comes as -ECANCELED, or whatever ended it first */
+void uring_cancel_recv(int socket) {
+  struct io_uring_sqe *sqe;
+
+  pthread_mutex_lock(&sq_lock);
+
+  if ((sqe = uring_get_sqe(&recv_ring)) != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URING_KEY(socket);
+    sqe->user_data = URING_CANCEL_KEY;
+    uring_enter(&recv_ring, 0);
+  }
+
+  pthread_mutex_unlock(&sq_lock);
+
+  return;
+}
+
+/* Multishot recv landed in a kernel 6.0 - older ones take the ring but fail the recv */
+int uring_probe(void) {
+  struct io_uring_cqe *cqe;
+  int pair[2], status = 1;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+    return 1;
+
+  uring_arm_recv(pair[0]);
+
+  if (write(pair[1], "x", 1) == 1 && uring_enter(&recv_ring, 1) >= 0) {
+    cqe = &recv_ring.cqes[*recv_ring.cq_head & *recv_ring.cq_mask];
+
+    if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE))
+      status = 0;
+    else
+      errno = (cqe->res < 0) ? -cqe->res : EINVAL;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+      uring_return_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+    __atomic_store_n(recv_ring.cq_head, *recv_ring.cq_head + 1, __ATOMIC_RELEASE);
+  }
+
+  /* The recv still armed on it ends with the socket */
+  generations[pair[0]]++;
+  close(pair[0]);
+  close(pair[1]);
+
+  return status;
+}
+
+/* One io_uring_enter per batch of completions - no syscall per recv */
+void *run_uring(void *_) {
+  struct io_uring_cqe *cqe;
+  uint64_t key;
+  uint32_t flags;
+  int result, socket, bid;
+  char *data;
+  void *context;
+
+  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+  while (true) {
+    if (__atomic_load_n(recv_ring.cq_tail, __ATOMIC_ACQUIRE) == *recv_ring.cq_head) {
+      uring_wait(&recv_ring);
+      stats_add(STAT_RECV_CALLS, 1);
+    }
+
+    /* Callbacks take locks, stopping is only allowed between batches */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    io_engine_pause();
+
+    while (__atomic_load_n(recv_ring.cq_tail, __ATOMIC_ACQUIRE) != *recv_ring.cq_head) {
+      cqe = &recv_ring.cqes[*recv_ring.cq_head & *recv_ring.cq_mask];
+      key = cqe->user_data;
+      result = cqe->res;
+      flags = cqe->flags;
+      __atomic_store_n(recv_ring.cq_head, *recv_ring.cq_head + 1, __ATOMIC_RELEASE);
+
+      if (key == URING_CANCEL_KEY)
+        continue;
+
+      socket = key & UINT32_MAX;
+      bid = (flags & IORING_CQE_F_BUFFER) ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+      data = (bid != -1) ? buffers + (size_t)bid * URING_BUFFER_BYTES : NULL;
+
+      context = (socket < FD_SETSIZE && generations[socket] == key >> 32) ? contexts[socket] : NULL;
+
+      /* Out of buffers or a hold ends the recv, it's armed again below */
+      if (context != NULL && result != -ENOBUFS && result != -ECANCELED)
+        engine_callback(context, data, result);
+
+      if (bid != -1)
+        uring_return_buffer(bid);
+
+      if (!(flags & IORING_CQE_F_MORE) && context != NULL && generations[socket] == key >> 32)
+        recv_armed[socket] = false;
+
+      /* Still watched after the callback - a multishot that stopped is rearmed */
+      if (!(flags & IORING_CQE_F_MORE) && (result > 0 || result == -ENOBUFS || result == -ECANCELED) &&
+          context != NULL && contexts[socket] == context && generations[socket] == key >> 32 &&
+          !held[socket])
+        uring_arm_recv(socket);
+    }
+
+    io_engine_resume();
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  }
+
+  return NULL;
+}
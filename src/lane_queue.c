@@ -0,0 +1,68 @@
+#include <inc/general.h>
+#include <inc/lane_queue.h>
+#include <inc/setting.h>
+
+const int lane_weights[LANE_COUNT] = {
+    LANE_WEIGHT_CONTROL, LANE_WEIGHT_CHAT, LANE_WEIGHT_BULK, LANE_WEIGHT_NOTICE};
+
+void lane_queue_init(Lane_queue *queue) {
+  memset(queue, 0, sizeof(Lane_queue));
+  memcpy(queue->credit, lane_weights, sizeof(queue->credit));
+
+  return;
+}
+
+/* Not thread safe, should be only used after threads have exited */
+void lane_queue_free(Lane_queue *queue) {
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+    empty_list(&queue->head[lane]);
+
+  return;
+}
+
+/* Returns the message's ticket for lane_holds */
+uint64_t lane_push(Lane_queue *queue, Msg msg, Lane lane) {
+  add_message_to_queue(msg, &queue->head[lane], &queue->tail[lane], NULL);
+
+  return ++queue->pushed[lane];
+}
+
+/* The fastest lane with credit left - a round is over once every busy lane
+   has used up its weight. NULL when all are empty, the caller frees */
+Msg *lane_pop(Lane_queue *queue) {
+  int lane;
+
+  if (lane_queue_is_empty(queue))
+    return NULL;
+
+  while (true) {
+    for (lane = 0; lane < LANE_COUNT; lane++) {
+      if (queue->head[lane] != NULL && queue->credit[lane] > 0)
+        break;
+    }
+
+    if (lane < LANE_COUNT)
+      break;
+
+    memcpy(queue->credit, lane_weights, sizeof(queue->credit));
+  }
+
+  queue->credit[lane]--;
+  queue->popped[lane]++;
+
+  return pop_msg_from_queue(&queue->head[lane], NULL);
+}
+
+bool lane_queue_is_empty(Lane_queue *queue) {
+  for (int lane = 0; lane < LANE_COUNT; lane++) {
+    if (queue->head[lane] != NULL)
+      return false;
+  }
+
+  return true;
+}
+
+/* Whether the message pushed with this ticket is still waiting, 0 never is */
+bool lane_holds(Lane_queue *queue, Lane lane, uint64_t ticket) {
+  return ticket > queue->popped[lane];
+}
@@ -1,5 +1,7 @@
 #include <inc/client.h>
+#include <inc/crypt.h>
 #include <inc/general.h>
+#include <inc/io_engine.h>
 #include <inc/server.h>
 #include <inc/socket_utilities.h>
 
@@ -8,7 +10,7 @@
 
 int main(int argc, char *argv[]) {
   if (argc < 2) {
-    HANDLE_ERROR("Usage: ./clm -[h] -p port -[suwfm] arg", 0);
+    HANDLE_ERROR("Usage: ./clm -[h] -[R] -p port -[suwfmoClyLtekaWHPF] arg", 0);
   }
 
   optind = 1;
@@ -16,7 +18,7 @@ int main(int argc, char *argv[]) {
 
   srand(time(NULL));
 
-  while ((opt = getopt(argc, argv, "hcp:s:u:w:f:m:")) != -1) {
+  while ((opt = getopt(argc, argv, "hcRp:s:u:w:f:m:o:C:l:y:L:t:e:k:a:W:H:P:F:")) != -1) {
     switch (opt) {
       /* Host-mode */
       case 'h':
@@ -30,12 +32,11 @@ int main(int argc, char *argv[]) {
             "%s", optarg);
         break;
 
-        /* Source IP - connection or binding for host */
+        /* Source IP - connection or binding for host. unix:/path - the client
+           connects to it, the host listens on it next to TCP */
       case 's':
         if (optarg)
-          snprintf(
-              connection.ipv4, MAX_IPV4_STR,
-              "%s", optarg);
+          set_connection_address(optarg);
         break;
 
       /* Client's display name */
@@ -65,12 +66,141 @@ int main(int argc, char *argv[]) {
           connection.max_connections = str_to_uint16_t(optarg);
         break;
 
+      /* Server statistics file, rewritten periodically */
+      case 'o':
+        if (optarg)
+          snprintf(
+              connection.stats_path, MAX_PATH_STR,
+              "%s", optarg);
+        break;
+
+      /* Record decrypted inbound frames for clm_replay */
+      case 'C':
+        if (optarg)
+          snprintf(
+              connection.capture_path, MAX_PATH_STR,
+              "%s", optarg);
+        break;
+
+      /* Directory for the message log segments */
+      case 'l':
+        if (optarg)
+          snprintf(
+              connection.log_dir, MAX_PATH_STR,
+              "%s", optarg);
+        break;
+
+      /* Messages between log syncs, 0 - let the kernel write back */
+      case 'y':
+        if (optarg)
+          connection.log_sync_every = atoi(optarg);
+        break;
+
+      /* Per client limits msgs/s:bytes/s[:kick] - excess is deferred,
+         or with kick > 0 dropped and the client kicked after that many */
+      case 'L':
+        if (optarg)
+          sscanf(
+              optarg, "%d:%d:%d",
+              &connection.rate_msgs, &connection.rate_bytes, &connection.rate_kick);
+        break;
+
+      /* Seconds of silence before a link is dropped, 0 - never */
+      case 't':
+        if (optarg)
+          connection.idle_timeout = atoi(optarg);
+        break;
+
+      /* Broadcasts through shared memory for unix socket clients - the
+         host publishes them, the client asks for them */
+      case 'R':
+        connection.shm_ring = true;
+        break;
+
+      /* How the host reads its clients - threads (a listener each), epoll or uring */
+      case 'e':
+        if (optarg && (connection.io_engine = io_engine_kind(optarg)) == -1) {
+          fprintf(stderr, "Unknown io engine: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      /* Sessions the cipher slab holds, 0 - one per allowed connection (-m).
+         Both are capped at MAX_CLIENTS */
+      case 'k':
+        if (optarg)
+          connection.cipher_sessions = atoi(optarg);
+        break;
+
+      /* AEAD suites, most wanted first - the host uses them instead of
+         its startup probe, the client offers only them */
+      case 'a':
+        if (optarg) {
+          Suite suites[SUITE_COUNT];
+
+          if (parse_suites(optarg, suites) == 0) {
+            fprintf(stderr, "No known cipher suite in %s\n", optarg);
+            exit(EXIT_FAILURE);
+          }
+
+          snprintf(
+              connection.suites, MAX_SUITES_STR,
+              "%s", optarg);
+        }
+        break;
+
+      /* Threads sealing big broadcasts next to the broadcaster, 0 - it seals alone */
+      case 'W':
+        if (optarg)
+          connection.seal_workers = atoi(optarg);
+        break;
+
+      /* Restarts without dropping anyone - a host started with the path a
+         running one was given takes its sockets and sessions over */
+      case 'H':
+        if (optarg)
+          snprintf(
+              connection.handoff_path, MAX_PATH_STR,
+              "%s", optarg);
+        break;
+
+      /* Another host, ip:port - repeated for more. Room traffic is relayed
+         between peered hosts, so their clients share the rooms */
+      case 'P':
+        if (optarg && connection.peer_count < MAX_PEERS)
+          snprintf(
+              connection.peers[connection.peer_count++], MAX_PEER_STR,
+              "%s", optarg);
+        break;
+
+      /* The federation's shared key - a host proves with it that it's one,
+         links from hosts that can't are dropped */
+      case 'F':
+        if (optarg)
+          snprintf(
+              connection.peer_key, MAX_PEER_KEY_LEN,
+              "%s", optarg);
+        break;
+
       case '?':
         printf("Unknown argument: %s.\n", optarg);
         exit(EXIT_FAILURE);
     }
   }
 
+  /* More sockets than that couldn't be looked up, add_client turns them away */
+  if (connection.is_server &&
+      (connection.max_connections > MAX_CLIENTS || connection.cipher_sessions > MAX_CLIENTS)) {
+    fprintf(stderr, "At most %d connections (-m) and cipher sessions (-k)\n", MAX_CLIENTS);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Our links would be refused without it */
+  if (connection.is_server && connection.peer_count > 0 && *connection.peer_key == '\0') {
+    fprintf(stderr, "Linking to peers (-P) needs the federation's key (-F)\n");
+    exit(EXIT_FAILURE);
+  }
+
   if (connection.is_server)
     start_server();  // uses connection struct
   else
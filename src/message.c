@@ -10,7 +10,9 @@ pthread_mutex_t w_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t message_ready = PTHREAD_COND_INITIALIZER;
 
 Msg compose_message(char *msg, char *id, char *username) {
-  Msg new_message = {.id = "00", .rows = NULL, .next = NULL};
+  Msg new_message = {
+      .id = "00", .rows = NULL, .next = NULL,
+      .sender = -1, .room = LOBBY_ROOM, .via = -1};
 
   if (msg != NULL)
     snprintf(new_message.msg, MAX_MSG_LEN, "%s", msg);
@@ -28,6 +30,13 @@ void empty_list(Msg **head) {
 
   while (*head != NULL) {
     ptr = (*head)->next;
+
+    /* Laid out ones own their rows */
+    for (int i = 0; i < (*head)->row_count; i++)
+      free((*head)->rows[i]);
+    free((*head)->rows);
+    free((*head)->username_colors);
+
     free(*head);
     *head = ptr;
   }
@@ -50,6 +59,13 @@ Msg *pop_msg_from_queue(Msg **head, pthread_mutex_t *lock) {
 
 void add_message_to_queue(
     Msg msg, Msg **head, Msg **tail, pthread_mutex_t *lock) {
+  push_message(new_message_node(msg), head, tail, lock);
+
+  return;
+}
+
+/* A queue node with the message's contents - not linked anywhere yet */
+Msg *new_message_node(Msg msg) {
   Msg *new;
 
   if ((new = (Msg *)calloc(1, sizeof(Msg))) == NULL) {
@@ -60,6 +76,20 @@ void add_message_to_queue(
   snprintf(new->username, MAX_USERNAME_LEN, "%s", msg.username);
   snprintf(new->id, ID_SIZE, "%s", msg.id);
 
+  snprintf(new->room_name, MAX_ROOM_NAME, "%s", msg.room_name);
+
+  new->seq = msg.seq;
+  new->sender = msg.sender;
+  new->room = msg.room;
+  new->origin = msg.origin;
+  new->origin_seq = msg.origin_seq;
+  new->via = msg.via;
+
+  return new;
+}
+
+void push_message(Msg *new, Msg **head, Msg **tail, pthread_mutex_t *lock) {
+  new->queued_at = get_monotonic_nanosecs();
   new->next = NULL;
 
   /* Linking the new node and updating tail and head */
@@ -146,3 +176,22 @@ void parse_username_for_msg(Msg *dest, char *src) {
 
   return;
 }
+
+/* "/3:Bo/5:b" -> "Bob", dest holds MAX_USERNAME_LEN */
+void strip_username_colors(char *dest, char *src) {
+  char *name_ptr = dest;
+  bool capture_chars = true;
+
+  for (; *src != '\0' && name_ptr < dest + MAX_USERNAME_LEN - 1; src++) {
+    if (*src == '/')
+      capture_chars = false;
+    else if (*src == ':')
+      capture_chars = true;
+    else if (capture_chars)
+      *name_ptr++ = *src;
+  }
+
+  *name_ptr = '\0';
+
+  return;
+}
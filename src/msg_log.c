@@ -0,0 +1,245 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <inc/general.h>
+#include <inc/msg_log.h>
+#include <inc/setting.h>
+
+int open_segment(uint32_t id);
+void close_segment(void);
+void sync_segment(void);
+
+/* Written by the broadcaster only - no locking */
+char log_dir[MAX_PATH_STR];
+char *log_map = NULL;
+int log_fd = -1;
+uint32_t log_segment;
+size_t log_used, log_synced;
+int log_sync_every, log_unsynced = 0;
+long page_size;
+
+int msg_log_open(char *dir, int sync_every) {
+  uint32_t *ids;
+  int count;
+
+  if (dir == NULL || *dir == '\0')
+    return 1;
+
+  snprintf(log_dir, MAX_PATH_STR, "%s", dir);
+  log_sync_every = sync_every;
+  page_size = sysconf(_SC_PAGESIZE);
+
+  if (mkdir(log_dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Failed to create log directory %s - %s\n", log_dir, strerror(errno));
+    return 1;
+  }
+
+  /* Old segments are never touched again, a restart starts the next one */
+  if ((count = msg_log_segments(log_dir, &ids)) == -1)
+    return 1;
+
+  log_segment = (count) ? ids[count - 1] + 1 : 0;
+  free(ids);
+
+  return open_segment(log_segment);
+}
+
+int open_segment(uint32_t id) {
+  char path[MAX_PATH_STR + 32];
+  int err;
+
+  snprintf(path, sizeof(path), "%s/" MSG_LOG_SEGMENT_NAME, log_dir, id);
+
+  if ((log_fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) == -1) {
+    fprintf(stderr, "Failed to open log segment %s - %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  /* Real blocks, so a full disk fails here instead of as a SIGBUS on a store */
+  if ((err = posix_fallocate(log_fd, 0, MSG_LOG_SEGMENT_BYTES))) {
+    fprintf(stderr, "Failed to allocate log segment %s - %s\n", path, strerror(err));
+    close(log_fd);
+    log_fd = -1;
+    return 1;
+  }
+
+  log_map = mmap(NULL, MSG_LOG_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, log_fd, 0);
+
+  if (log_map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map log segment %s - %s\n", path, strerror(errno));
+    close(log_fd);
+    log_fd = -1;
+    log_map = NULL;
+    return 1;
+  }
+
+  memcpy(log_map, MSG_LOG_MAGIC, MSG_LOG_MAGIC_BYTES);
+  log_used = MSG_LOG_MAGIC_BYTES;
+  log_synced = 0;
+
+  return 0;
+}
+
+/* Flushes what was appended since the last sync - whole pages only */
+void sync_segment(void) {
+  size_t from = log_synced - log_synced % page_size;
+
+  if (log_used > log_synced)
+    msync(log_map + from, log_used - from, MS_SYNC);
+
+  log_synced = log_used;
+  log_unsynced = 0;
+
+  return;
+}
+
+void close_segment(void) {
+  sync_segment();
+  munmap(log_map, MSG_LOG_SEGMENT_BYTES);
+
+  /* Drops the preallocated tail */
+  if (ftruncate(log_fd, log_used)) {
+    fprintf(stderr, "Failed to truncate log segment - %s\n", strerror(errno));
+  }
+
+  close(log_fd);
+
+  log_map = NULL;
+  log_fd = -1;
+
+  return;
+}
+
+/* A memcpy into the mapping - syscalls only when syncing or rotating.
+   The size goes in last, a record torn by a crash reads as the end of the segment */
+void msg_log_append(char *room, char *ascii_packet, uint32_t size) {
+  struct timespec now;
+  uint64_t timestamp;
+
+  if (log_map == NULL)
+    return;
+
+  if (log_used + MSG_LOG_RECORD_HEADER + size > MSG_LOG_SEGMENT_BYTES) {
+    close_segment();
+
+    if (open_segment(++log_segment))
+      return;  // logging stops, the chat goes on
+  }
+
+  char *record = log_map + log_used;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  timestamp = (uint64_t)now.tv_sec * NANOSECS_IN_SEC + now.tv_nsec;
+
+  memcpy(record + 4, &timestamp, sizeof(timestamp));
+  strncpy(record + 12, room, MAX_ROOM_NAME);
+  memcpy(record + MSG_LOG_RECORD_HEADER, ascii_packet, size);
+  __atomic_store_n((uint32_t *)record, size, __ATOMIC_RELEASE);
+
+  log_used += MSG_LOG_RECORD_HEADER + size;
+
+  if (log_sync_every > 0 && ++log_unsynced >= log_sync_every)
+    sync_segment();
+
+  return;
+}
+
+void msg_log_close(void) {
+  if (log_map != NULL)
+    close_segment();
+
+  return;
+}
+
+int segment_filter(const struct dirent *entry) {
+  uint32_t id;
+  char rest;
+
+  return sscanf(entry->d_name, "%" SCNu32 ".clmlo%c", &id, &rest) == 2 && rest == 'g';
+}
+
+/* Ids of the directory's segments, oldest first - caller frees ids, -1 on error */
+int msg_log_segments(char *dir, uint32_t **ids) {
+  struct dirent **entries;
+  int count;
+
+  if ((count = scandir(dir, &entries, segment_filter, alphasort)) == -1) {
+    fprintf(stderr, "Failed to read log directory %s - %s\n", dir, strerror(errno));
+    return -1;
+  }
+
+  if ((*ids = (uint32_t *)malloc((count + 1) * sizeof(uint32_t))) == NULL) {
+    HANDLE_ERROR("Failed to allocate memory for log segments", 1);
+  }
+
+  /* Names are zero padded, alphabetical is numerical */
+  for (int i = 0; i < count; i++) {
+    sscanf(entries[i]->d_name, "%" SCNu32, &(*ids)[i]);
+    free(entries[i]);
+  }
+
+  free(entries);
+
+  return count;
+}
+
+int msg_log_open_segment(char *path, Msg_log_reader *reader) {
+  struct stat info;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return 1;
+
+  if (fstat(fd, &info) || info.st_size < MSG_LOG_MAGIC_BYTES) {
+    close(fd);
+    errno = EINVAL;
+    return 1;
+  }
+
+  reader->size = info.st_size;
+  reader->offset = MSG_LOG_MAGIC_BYTES;
+  reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (reader->map == MAP_FAILED)
+    return 1;
+
+  if (memcmp(reader->map, MSG_LOG_MAGIC, MSG_LOG_MAGIC_BYTES)) {
+    msg_log_close_segment(reader);
+    errno = EINVAL;
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Record points into the mapping - returns 1 at the end of the segment */
+int msg_log_read_record(Msg_log_reader *reader, Msg_log_record *record) {
+  char *header = reader->map + reader->offset;
+
+  if (reader->offset + MSG_LOG_RECORD_HEADER > reader->size)
+    return 1;
+
+  memcpy(&record->size, header, sizeof(record->size));
+
+  if (record->size == 0 || reader->offset + MSG_LOG_RECORD_HEADER + record->size > reader->size)
+    return 1;
+
+  memcpy(&record->timestamp, header + 4, sizeof(record->timestamp));
+  record->room = header + 12;
+  record->packet = header + MSG_LOG_RECORD_HEADER;
+
+  reader->offset += MSG_LOG_RECORD_HEADER + record->size;
+
+  return 0;
+}
+
+void msg_log_close_segment(Msg_log_reader *reader) {
+  munmap(reader->map, reader->size);
+  reader->map = NULL;
+
+  return;
+}
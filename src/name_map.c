@@ -0,0 +1,108 @@
+#include <inc/general.h>
+#include <inc/name_map.h>
+
+void rebuild_name_map(Name_map *map);
+
+void init_name_map(Name_map *map) {
+  for (int i = 0; i < NAME_MAP_SIZE; i++)
+    map->entries[i].value = NAME_EMPTY;
+
+  map->count = 0;
+  map->deleted = 0;
+
+  return;
+}
+
+/* FNV-1a */
+uint32_t hash_name(char *name) {
+  uint32_t hash = 2166136261u;
+
+  while (*name != '\0') {
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/* Slot holding the name, or -1 */
+int find_name_slot(Name_map *map, char *name) {
+  int slot = hash_name(name) & (NAME_MAP_SIZE - 1);
+
+  for (int probes = 0; probes < NAME_MAP_SIZE; probes++) {
+    if (map->entries[slot].value == NAME_EMPTY)
+      return -1;
+
+    if (map->entries[slot].value != NAME_DELETED && !strcmp(map->entries[slot].name, name))
+      return slot;
+
+    slot = (slot + 1) & (NAME_MAP_SIZE - 1);
+  }
+
+  return -1;
+}
+
+void rebuild_name_map(Name_map *map) {
+  static Name_entry old[NAME_MAP_SIZE];
+
+  memcpy(old, map->entries, sizeof(old));
+  init_name_map(map);
+
+  for (int i = 0; i < NAME_MAP_SIZE; i++) {
+    if (old[i].value >= 0)
+      name_map_put(map, old[i].name, old[i].value);
+  }
+
+  return;
+}
+
+/* Returns the value or -1 */
+int name_map_get(Name_map *map, char *name) {
+  int slot = find_name_slot(map, name);
+
+  return (slot == -1) ? -1 : map->entries[slot].value;
+}
+
+/* Inserts - returns 1 if the name is another value's or the map is full */
+int name_map_put(Name_map *map, char *name, int value) {
+  int slot = find_name_slot(map, name);
+
+  if (slot != -1)
+    return (map->entries[slot].value == value) ? 0 : 1;
+
+  /* Keep the load factor under 3/4 so probes stay short */
+  if (map->count >= NAME_MAP_SIZE / 4 * 3)
+    return 1;
+
+  slot = hash_name(name) & (NAME_MAP_SIZE - 1);
+
+  while (map->entries[slot].value >= 0)
+    slot = (slot + 1) & (NAME_MAP_SIZE - 1);
+
+  if (map->entries[slot].value == NAME_DELETED)
+    map->deleted--;
+
+  snprintf(map->entries[slot].name, MAX_USERNAME_LEN, "%s", name);
+  map->entries[slot].value = value;
+  map->count++;
+
+  return 0;
+}
+
+/* Removes the name only while it still maps to value - names are not unique */
+void name_map_remove(Name_map *map, char *name, int value) {
+  int slot = find_name_slot(map, name);
+
+  if (slot == -1 || map->entries[slot].value != value)
+    return;
+
+  map->entries[slot].value = NAME_DELETED;
+  map->count--;
+  map->deleted++;
+
+  /* Tombstones lengthen every probe - rebuild once they pile up */
+  if (map->deleted > NAME_MAP_SIZE / 4)
+    rebuild_name_map(map);
+
+  return;
+}
@@ -0,0 +1,112 @@
+#include <inc/general.h>
+#include <inc/presence.h>
+#include <inc/setting.h>
+#include <inc/stats.h>
+#include <inc/timer_wheel.h>
+
+void end_presence_window(void *_);
+
+typedef struct _presence_tally{
+    bool open; // something was announced this window
+    int joined;
+    int left;
+    char last[MAX_MSG_LEN]; // sent as is when it's the only event of the window
+}Presence_tally;
+
+Presence_tally tallies[MAX_ROOMS];
+Presence_flush presence_flush;
+Timer presence_timer;
+bool window_armed = false;
+pthread_mutex_t presence_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void presence_init(Presence_flush flush) {
+  presence_flush = flush;
+  memset(tallies, 0, sizeof(tallies));
+  timer_init(&presence_timer, end_presence_window, NULL);
+
+  return;
+}
+
+/* Lock order: client_lock -> presence_lock -> the wheel's */
+void presence_event(int room, Presence_kind kind, char *text) {
+  Presence_tally *tally = &tallies[room];
+  bool announce_now;
+
+  pthread_mutex_lock(&presence_lock);
+
+  if ((announce_now = !tally->open)) {
+    tally->open = true;
+
+    if (!window_armed)
+      timer_arm(&presence_timer, PRESENCE_WINDOW_MS);
+
+    window_armed = true;
+
+  } else {
+    if (kind == PRESENCE_JOINED)
+      tally->joined++;
+    else
+      tally->left++;
+
+    snprintf(tally->last, MAX_MSG_LEN, "%s", text);
+    stats_add(STAT_COALESCED, 1);
+  }
+
+  pthread_mutex_unlock(&presence_lock);
+
+  if (announce_now)
+    presence_flush(text, room);
+
+  return;
+}
+
+void summarize(Presence_tally *tally, char *text) {
+  if (tally->joined + tally->left == 1)
+    snprintf(text, MAX_MSG_LEN, "%s", tally->last);
+  else if (tally->left == 0)
+    snprintf(text, MAX_MSG_LEN, "%d users joined.", tally->joined);
+  else if (tally->joined == 0)
+    snprintf(text, MAX_MSG_LEN, "%d users left.", tally->left);
+  else
+    snprintf(text, MAX_MSG_LEN, "%d users joined and %d left.", tally->joined, tally->left);
+
+  return;
+}
+
+/* Runs on the timer wheel - rooms that stayed quiet close their window,
+   the others send their summary and keep it open for another */
+void end_presence_window(void *_) {
+  static char texts[MAX_ROOMS][MAX_MSG_LEN];
+  static int summary_rooms[MAX_ROOMS];
+  int count = 0;
+  bool still_open = false;
+
+  pthread_mutex_lock(&presence_lock);
+
+  for (int room = 0; room < MAX_ROOMS; room++) {
+    Presence_tally *tally = &tallies[room];
+
+    if (!tally->open)
+      continue;
+
+    if (tally->joined + tally->left == 0) {
+      tally->open = false;
+      continue;
+    }
+
+    summarize(tally, texts[count]);
+    summary_rooms[count++] = room;
+    tally->joined = tally->left = 0;
+    still_open = true;
+  }
+
+  if ((window_armed = still_open))
+    timer_arm(&presence_timer, PRESENCE_WINDOW_MS);
+
+  pthread_mutex_unlock(&presence_lock);
+
+  for (int i = 0; i < count; i++)
+    presence_flush(texts[i], summary_rooms[i]);
+
+  return;
+}
@@ -0,0 +1,97 @@
+#include <inc/general.h>
+#include <inc/rate_limit.h>
+#include <inc/setting.h>
+#include <inc/stats.h>
+
+void bucket_init(Token_bucket *bucket, double rate, double min_burst) {
+  bucket->rate = rate;
+  bucket->burst = (rate * RATE_BURST_SEC > min_burst) ? rate * RATE_BURST_SEC : min_burst;
+  bucket->tokens = bucket->burst;
+  bucket->refilled_at = get_monotonic_nanosecs();
+
+  return;
+}
+
+void bucket_refill(Token_bucket *bucket, uint64_t now) {
+  bucket->tokens += bucket->rate * (now - bucket->refilled_at) / NANOSECS_IN_SEC;
+  bucket->refilled_at = now;
+
+  if (bucket->tokens > bucket->burst)
+    bucket->tokens = bucket->burst;
+
+  return;
+}
+
+/* Nanoseconds until the bucket holds amount tokens */
+uint64_t bucket_wait(Token_bucket *bucket, double amount) {
+  if (bucket->rate == 0 || bucket->tokens >= amount)
+    return 0;
+
+  return (uint64_t)((amount - bucket->tokens) / bucket->rate * NANOSECS_IN_SEC);
+}
+
+void rate_limit_init(Rate_limit *limit, double msgs_per_sec, double bytes_per_sec) {
+  /* A bucket has to fit at least one message of the largest size */
+  bucket_init(&limit->msgs, msgs_per_sec, 1);
+  bucket_init(&limit->bytes, bytes_per_sec, PACKET_MAX_BYTES);
+  limit->drops = 0;
+
+  return;
+}
+
+void rate_limit_charge(Rate_limit *limit, int bytes) {
+  if (limit->msgs.rate > 0)
+    limit->msgs.tokens -= 1;
+  if (limit->bytes.rate > 0)
+    limit->bytes.tokens -= bytes;
+
+  return;
+}
+
+/* Nanoseconds until the frame may pass - 0 and it's charged for already */
+uint64_t rate_limit_wait(Rate_limit *limit, int bytes) {
+  uint64_t now = get_monotonic_nanosecs(), wait, bytes_wait;
+
+  bucket_refill(&limit->msgs, now);
+  bucket_refill(&limit->bytes, now);
+
+  wait = bucket_wait(&limit->msgs, 1);
+  bytes_wait = bucket_wait(&limit->bytes, bytes);
+
+  if (bytes_wait > wait)
+    wait = bytes_wait;
+
+  if (wait > 0) {
+    stats_add(STAT_THROTTLED, 1);
+    return wait;
+  }
+
+  rate_limit_charge(limit, bytes);
+
+  return 0;
+}
+
+/* 0 - the frame may pass, 1 - drop it. Deferring sleeps until both buckets have
+   enough - the socket isn't read meanwhile, so TCP pushes back on the sender.
+   Only for a thread of its own, an event loop holds the socket instead */
+int rate_limit_admit(Rate_limit *limit, int bytes, bool defer) {
+  uint64_t wait = rate_limit_wait(limit, bytes), now;
+
+  if (wait == 0)
+    return 0;
+
+  if (!defer) {
+    limit->drops++;
+    return 1;
+  }
+
+  struct timespec sleep_time = nanosec_to_timespec(wait);
+  nanosleep(&sleep_time, NULL);
+
+  now = get_monotonic_nanosecs();
+  bucket_refill(&limit->msgs, now);
+  bucket_refill(&limit->bytes, now);
+  rate_limit_charge(limit, bytes);
+
+  return 0;
+}
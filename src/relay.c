@@ -0,0 +1,106 @@
+#include <endian.h>
+
+#include <inc/general.h>
+#include <inc/relay.h>
+#include <inc/setting.h>
+#include <inc/socket_utilities.h>
+
+/* Per origin the highest id seen and which of the RELAY_WINDOW before it were -
+   a copy can arrive after a later message that took a shorter path */
+typedef struct _relay_origin{
+    uint32_t origin;
+    uint64_t highest;
+    uint64_t seen; // bit n - highest - n has been seen
+    uint64_t used; // for evicting the least recently heard of origin
+}Relay_origin;
+
+Relay_origin origins[MAX_ORIGINS];
+uint64_t origin_clock = 0;
+
+/* 1 if the record doesn't fit, the batch is left as it was */
+int relay_append(char *batch, int *filled, Msg *msg, char *ascii_packet, int size) {
+  uint32_t n_origin = htobe32(msg->origin);
+  uint64_t n_seq = htobe64(msg->origin_seq);
+  char *record = batch + *filled;
+
+  if (*filled + RELAY_HEADER_BYTES + size > MAX_BATCH_SIZE)
+    return 1;
+
+  memcpy(record, &n_origin, sizeof(n_origin));
+  memcpy(record + sizeof(n_origin), &n_seq, sizeof(n_seq));
+  memset(record + RELAY_ID_BYTES, 0, MAX_ROOM_NAME);
+  snprintf(record + RELAY_ID_BYTES, MAX_ROOM_NAME, "%s", msg->room_name);
+  memcpy(record + RELAY_HEADER_BYTES, ascii_packet, size);
+
+  *filled += RELAY_HEADER_BYTES + size;
+
+  return 0;
+}
+
+/* The record at offset into msg and offset past it - 1 if there was one,
+   0 at the end of the batch, -1 if the rest can't be parsed */
+int relay_next(char *batch, int size, int *offset, Msg *msg) {
+  char *record = batch + *offset;
+  int packet_size, available = size - *offset;
+  uint32_t n_origin;
+  uint64_t n_seq;
+
+  if (available == 0)
+    return 0;
+
+  if (available <= RELAY_HEADER_BYTES ||
+      (packet_size = ascii_packet_size(record + RELAY_HEADER_BYTES, available - RELAY_HEADER_BYTES)) == -1)
+    return -1;
+
+  *msg = ascii_packet_to_message(record + RELAY_HEADER_BYTES, packet_size);
+
+  memcpy(&n_origin, record, sizeof(n_origin));
+  memcpy(&n_seq, record + sizeof(n_origin), sizeof(n_seq));
+  msg->origin = be32toh(n_origin);
+  msg->origin_seq = be64toh(n_seq);
+
+  record[RELAY_HEADER_BYTES - 1] = '\0';
+  snprintf(msg->room_name, MAX_ROOM_NAME, "%s", record + RELAY_ID_BYTES);
+
+  *offset += RELAY_HEADER_BYTES + packet_size;
+
+  return 1;
+}
+
+/* Older than the window counts as seen - it's a copy that took the long way round */
+bool relay_is_new(uint32_t origin, uint64_t seq) {
+  Relay_origin *entry = NULL, *oldest = &origins[0];
+  uint64_t behind;
+
+  for (int i = 0; i < MAX_ORIGINS; i++) {
+    if (origins[i].origin == origin && origins[i].used != 0) {
+      entry = &origins[i];
+      break;
+    }
+
+    if (origins[i].used < oldest->used)
+      oldest = &origins[i];
+  }
+
+  if (entry == NULL) {
+    entry = oldest;
+    *entry = (Relay_origin){.origin = origin, .highest = seq, .seen = 1, .used = ++origin_clock};
+    return true;
+  }
+
+  entry->used = ++origin_clock;
+
+  if (seq > entry->highest) {
+    behind = seq - entry->highest;
+    entry->seen = (behind >= RELAY_WINDOW) ? 1 : (entry->seen << behind) | 1;
+    entry->highest = seq;
+    return true;
+  }
+
+  if ((behind = entry->highest - seq) >= RELAY_WINDOW || (entry->seen & ((uint64_t)1 << behind)))
+    return false;
+
+  entry->seen |= (uint64_t)1 << behind;
+
+  return true;
+}
@@ -0,0 +1,89 @@
+#include <inc/general.h>
+#include <inc/room.h>
+#include <inc/setting.h>
+
+Room rooms[MAX_ROOMS];
+
+void init_rooms(void) {
+  memset(rooms, 0, sizeof(rooms));
+  snprintf(rooms[LOBBY_ROOM].name, MAX_ROOM_NAME, "%s", DEFAULT_ROOM);
+
+  return;
+}
+
+int find_room(char *name) {
+  for (int i = 0; i < MAX_ROOMS; i++) {
+    if (*rooms[i].name != '\0' && !strcmp(rooms[i].name, name))
+      return i;
+  }
+
+  return -1;
+}
+
+/* Returns the room's index, an existing one if the name is taken, -1 if full */
+int open_room(char *name) {
+  int room = find_room(name), free_room = -1;
+
+  if (room != -1)
+    return room;
+
+  for (int i = 0; i < MAX_ROOMS; i++) {
+    if (*rooms[i].name == '\0') {
+      free_room = i;
+      break;
+    }
+  }
+
+  if (free_room != -1)
+    snprintf(rooms[free_room].name, MAX_ROOM_NAME, "%s", name);
+
+  return free_room;
+}
+
+/* Returns the subscriber's position in the room */
+int add_subscriber(int room, int handle) {
+  Room *r = &rooms[room];
+
+  if (r->subscriber_count == r->capacity) {
+    r->capacity = (r->capacity) ? r->capacity * 2 : ROOM_INITIAL_CAPACITY;
+
+    if ((r->subscribers = (int *)realloc(r->subscribers, r->capacity * sizeof(int))) == NULL) {
+      HANDLE_ERROR("Failed to allocate memory for room subscribers", 1);
+    }
+  }
+
+  r->subscribers[r->subscriber_count] = handle;
+
+  return r->subscriber_count++;
+}
+
+/* The last subscriber takes the freed position - returns its handle (-1 if none moved),
+   whose position has to be updated by the caller */
+int remove_subscriber(int room, int position) {
+  Room *r = &rooms[room];
+  int moved = -1;
+
+  r->subscriber_count--;
+
+  if (position != r->subscriber_count) {
+    moved = r->subscribers[r->subscriber_count];
+    r->subscribers[position] = moved;
+  }
+
+  /* Empty rooms are closed, the lobby always stays */
+  if (r->subscriber_count == 0 && room != LOBBY_ROOM) {
+    free(r->subscribers);
+    memset(r, 0, sizeof(Room));
+  }
+
+  return moved;
+}
+
+void free_rooms(void) {
+  for (int i = 0; i < MAX_ROOMS; i++)
+    free(rooms[i].subscribers);
+
+  memset(rooms, 0, sizeof(rooms));
+
+  return;
+}
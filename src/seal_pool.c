@@ -0,0 +1,145 @@
+#include <inc/crypt.h>
+#include <inc/general.h>
+#include <inc/seal_pool.h>
+#include <inc/setting.h>
+#include <inc/stats.h>
+
+void *run_sealer(void *_);
+
+pthread_t sealers[SEAL_MAX_WORKERS];
+int sealer_count = 0;
+
+/* The run in progress - set under pool_lock, read by the sealers once woken */
+Seal_job *run_jobs;
+int run_count;
+char *run_packet;
+uint16_t run_size;
+int next_chunk;
+
+uint64_t run_generation = 0;
+int sealers_busy = 0;
+bool pool_stopping = false;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t run_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t run_done = PTHREAD_COND_INITIALIZER;
+
+/* -1 - one per core next to the caller's, 0 - the caller seals alone */
+void seal_pool_start(int workers) {
+  if (workers < 0)
+    workers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+  if (workers > SEAL_MAX_WORKERS)
+    workers = SEAL_MAX_WORKERS;
+
+  for (sealer_count = 0; sealer_count < workers; sealer_count++)
+    pthread_create(&sealers[sealer_count], NULL, run_sealer, NULL);
+
+  return;
+}
+
+/* Not while a run is in progress */
+void seal_pool_stop(void) {
+  pthread_mutex_lock(&pool_lock);
+  pool_stopping = true;
+  pthread_cond_broadcast(&run_ready);
+  pthread_mutex_unlock(&pool_lock);
+
+  for (int i = 0; i < sealer_count; i++)
+    pthread_join(sealers[i], NULL);
+
+  sealer_count = 0;
+  pool_stopping = false;
+
+  return;
+}
+
+int seal_pool_workers(void) {
+  return sealer_count;
+}
+
+void seal_job(Seal_job *job) {
+  STATS_TIME(
+      job->frame = encrypt_packet(
+          run_packet, run_size, &job->frame_size,
+          job->handle, job->salt, job->ctr);
+      , STAGE_ENCRYPT)
+
+  return;
+}
+
+/* Until every chunk is claimed - whoever is awake takes the next one */
+void seal_chunks(void) {
+  int chunk, end;
+
+  while ((chunk = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED) * SEAL_CHUNK) < run_count) {
+    end = (chunk + SEAL_CHUNK < run_count) ? chunk + SEAL_CHUNK : run_count;
+
+    for (int i = chunk; i < end; i++)
+      seal_job(&run_jobs[i]);
+  }
+
+  return;
+}
+
+void *run_sealer(void *_) {
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&pool_lock);
+
+  while (true) {
+    while (run_generation == seen && !pool_stopping)
+      pthread_cond_wait(&run_ready, &pool_lock);
+
+    if (pool_stopping)
+      break;
+
+    seen = run_generation;
+    pthread_mutex_unlock(&pool_lock);
+
+    seal_chunks();
+
+    pthread_mutex_lock(&pool_lock);
+
+    if (--sealers_busy == 0)
+      pthread_cond_signal(&run_done);
+  }
+
+  pthread_mutex_unlock(&pool_lock);
+
+  return NULL;
+}
+
+/* Returns once every job has its frame. Small fan-outs aren't worth the
+   wake-ups, the caller seals them alone */
+void seal_all(Seal_job *jobs, int count, char *packet, uint16_t size) {
+  run_jobs = jobs;
+  run_count = count;
+  run_packet = packet;
+  run_size = size;
+  next_chunk = 0;
+
+  if (sealer_count == 0 || count < SEAL_PARALLEL_MIN) {
+    seal_chunks();
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+
+  sealers_busy = sealer_count;
+  run_generation++;
+  pthread_cond_broadcast(&run_ready);
+
+  pthread_mutex_unlock(&pool_lock);
+
+  seal_chunks();
+
+  /* Everyone has let go of the jobs before they're handed back */
+  pthread_mutex_lock(&pool_lock);
+
+  while (sealers_busy > 0)
+    pthread_cond_wait(&run_done, &pool_lock);
+
+  pthread_mutex_unlock(&pool_lock);
+
+  return;
+}
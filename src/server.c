@@ -1,29 +1,384 @@
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
+
+#include <inc/capture.h>
+#include <inc/client.h>
+#include <inc/client_map.h>
 #include <inc/crypt.h>
 #include <inc/general.h>
+#include <inc/io_engine.h>
 #include <inc/message.h>
+#include <inc/msg_log.h>
+#include <inc/name_map.h>
+#include <inc/presence.h>
+#include <inc/rate_limit.h>
+#include <inc/relay.h>
+#include <inc/room.h>
+#include <inc/seal_pool.h>
+#include <inc/server.h>
 #include <inc/setting.h>
+#include <inc/shm_ring.h>
 #include <inc/socket_utilities.h>
+#include <inc/stats.h>
+#include <inc/timer_wheel.h>
 
-void *handle_connections(void *p_socket);
+void *handle_connections(void *p_sockets);
+int listen_inet(void);
+int listen_unix(char *path, int type);
 void handle_sigpipe(int _);
+int take_over(char *path, Handoff_header *header, int *inet_socket, int *unix_socket);
+void take_over_clients(int predecessor, uint32_t count);
+void hand_off(int successor, pthread_t broadcaster, int inet_socket, int unix_socket);
+void park_listener(Listener *listener);
+void wake_listener(int _);
+void start_reading(Client_handle handle, char *pending, size_t pending_size);
 int accept_connection(int server_socket);
-void handle_disconnect(int index);
-
-void *message_listener(void *socket);
+void handle_disconnect(Client_handle handle);
+void init_clients(void);
+uint32_t take_salt(void);
+void rank_suites(void);
+int choose_suite(char *offer);
+void move_to_room(Client_handle handle, int room);
+void handle_client_command(Msg *msg, Client_handle handle);
+void handle_room_command(char *command, char *args, Client_handle handle);
+void handle_resume(char *args, Client_handle handle);
+void switch_room(Client_handle handle, int room, uint64_t after);
+void route_direct_message(Msg *msg, Client_handle handle);
+void reply_to_client(Client_handle handle, char *text);
+void grant_ring(Client_handle handle);
+void tell_ring_room(Client_handle handle, int passed_fd);
+void publish_to_ring(int room, char *ascii_packet, int size);
+int update_client_name(Client_handle handle, char *username);
+int send_to_client(Client_handle handle, char *ascii_packet, int size);
+int send_to_client_with_fd(Client_handle handle, char *ascii_packet, int size, int passed_fd);
+int queue_sealed(Client_handle handle, char *enc_packet, int new_size);
+void fan_out(Room *room, char *ascii_packet, int size);
+int init_session_ciphers(Client *client, Suite suite);
+void clean_session_ciphers(Client *client);
+void flush_client(Client_handle handle, bool burst_over);
+int note_backlog(Client_handle handle);
+void retry_flush(void *p_handle);
+int note_flushed(Client_handle handle, int frames, ssize_t sent);
+void flush_output(void);
+bool queue_is_empty(void);
+void send_history(Client_handle handle, int room, uint64_t after);
+int take_failed_sends(Client_handle *failed);
+void check_idle(void *p_handle);
+void handshake_expired(void *_);
+void announce(char *text, int room);
+Lane lane_for(Msg *msg);
+void *link_to_peer(void *p_address);
+int register_peer(Client_handle handle);
+Client_handle insert_client(Client new_client, bool outbound);
+void unregister_peer(Client_handle handle);
+void handle_peer(char *args, Client_handle handle);
+void peer_proof(Client *client, uint32_t id, bool from_linker, char *proof);
+bool peer_proven(Client *client, char *args, bool from_linker, uint32_t *id);
+void relay_to_peers(Msg *msg, char *ascii_packet, int size);
+void flush_peer_batches(void);
+void queue_relayed(Listener *listener, char *batch, int size);
+
+void *message_listener(void *p_handle);
+void init_listener(Listener *listener, Client_handle handle, Client *client);
+int process_frames(Listener *listener);
+int feed_listener(Listener *listener, char *data, size_t size);
+int unhold_listener(Listener *listener);
+Listener *held_listener(Client_handle handle);
+void release_throttle(void *p_handle);
+void on_client_data(void *context, char *data, ssize_t size);
 void *broadcast_message(void *_);
 
-int find_client_index(int socket);
+Client_handle find_client(int socket);
+
+Client_map clients;
+
+/* What the broadcaster sends next - under r_lock */
+Lane_queue out_queue;
+
+/* Socket -> handle, NO_CLIENT when not connected - ids and kicks are sockets */
+Client_handle socket_handles[FD_SETSIZE];
+
+/* Sequence number of the next broadcast - stamped under client_lock */
+uint64_t next_seq;
+
+/* Salt of the next session or ring, starting anywhere - each takes two, one per direction */
+uint32_t next_salt;
+
+/* AEAD suites we accept, most wanted first - from -a or the startup probe */
+Suite host_suites[SUITE_COUNT];
+int host_suite_count = 0;
 
-Client clients[FD_SETSIZE];
-int client_index = 0;
+/* Plain username -> handle, for direct messages */
+Name_map client_names;
+
+/* Clients with frames waiting for the end of the burst - under client_lock */
+Client_handle dirty_clients[CLIENT_SLOTS];
+int dirty_count = 0;
+
+/* Sends that failed during a fan-out - disconnected once client_lock is released */
+Client_handle failed_clients[CLIENT_SLOTS];
+int failed_count = 0;
+
+/* Addresses of recently left clients, direct-mapped - used to spot reconnects */
+in_addr_t recent_peers[RECENT_PEERS];
 
 pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Clients reading broadcasts from the shared ring - published into only if any */
+int ring_readers = 0;
+gcry_cipher_hd_t ring_cipher;
+
+/* Restart handoff - set once, listeners then park instead of reading on.
+   The broadcaster stops when the queue runs dry after stop_when_drained */
+bool handing_off = false;
+bool stop_when_drained = false;  // under r_lock
+
+/* This host among its peers, never 0 - ids of the messages it relays start with it */
+uint32_t host_id;
+uint64_t relay_seq = 0;  // under client_lock
+
+/* Links to other hosts, either way round - under client_lock */
+Peer_link peer_links[MAX_PEER_LINKS];
+int peer_link_count = 0;
+
+/* Handshakes are read one at a time on the accept thread */
+Timer handshake_timer;
+int handshake_socket = -1;
+pthread_mutex_t handshake_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void start_server(void) {
   /*******************   SETTING UP THE CONNECTTION   *******************/
 
-  init_libgcrypt();
+  /* A session per connection and the ring's, unless told otherwise */
+  init_libgcrypt(
+      CIPHERS_PER_SESSION *
+          ((connection.cipher_sessions > 0) ? connection.cipher_sessions : connection.max_connections) +
+      1);
+
+  rank_suites();
+
+  int inet_socket, unix_socket, predecessor = -1;
+  Handoff_header handoff;
+
+  /* A host still running with the same -H path hands its sockets over */
+  if (*connection.handoff_path != '\0')
+    predecessor = take_over(connection.handoff_path, &handoff, &inet_socket, &unix_socket);
+
+  if (predecessor == -1) {
+    inet_socket = listen_inet();
+
+    /* Same-host clients, same framing and crypto without the TCP/IP stack */
+    unix_socket = (*connection.unix_path != '\0') ? listen_unix(connection.unix_path, SOCK_STREAM) : -1;
+  }
+
+  /*******************   LISTENING FOR CONNECTIONS   ********************/
+
+  lane_queue_init(&out_queue);
+  init_clients();
+
+  /* Sequences go on from where the old host was, salts are never reused */
+  if (predecessor != -1) {
+    next_seq = handoff.next_seq;
+    next_salt = handoff.next_salt;
+  }
+
+  stats_init(connection.stats_path, STATS_INTERVAL_SEC);
+  timer_init(&handshake_timer, handshake_expired, NULL);
+  timer_wheel_start();
+  presence_init(announce);
+
+  /* Receives io_uring has armed would go on taking the bytes of sessions handed off */
+  if (*connection.handoff_path != '\0' && connection.io_engine == IO_URING) {
+    printf("Handing off needs epoll instead of uring\n");
+    connection.io_engine = IO_EPOLL;
+  }
+
+  /* Falls back to epoll, or the kernel says why */
+  if (connection.io_engine != IO_THREADS) {
+    connection.io_engine = io_engine_start(connection.io_engine, on_client_data);
+    printf("Reading clients with %s\n", io_engine_name(connection.io_engine));
+  }
+
+  /* Returns once the old host has closed its log */
+  if (predecessor != -1)
+    take_over_clients(predecessor, handoff.client_count);
+
+  if (*connection.capture_path != '\0' && capture_open(connection.capture_path)) {
+    exit(EXIT_FAILURE);
+  }
+
+  if (*connection.log_dir != '\0' && msg_log_open(connection.log_dir, connection.log_sync_every)) {
+    exit(EXIT_FAILURE);
+  }
+
+  /* Handed out over the unix socket, so there's no ring without one */
+  if (connection.shm_ring) {
+    if (unix_socket == -1) {
+      fprintf(stderr, "The shared ring needs a unix socket (-s %s/path)\n", UNIX_PREFIX);
+      exit(EXIT_FAILURE);
+    }
+
+    /* Every local client has every suite - the ring runs our favourite,
+       on a key of its own */
+    uint8_t ring_nonce[KEY_NONCE_BYTES];
+
+    gcry_create_nonce(ring_nonce, KEY_NONCE_BYTES);
+
+    if (ring_open(take_salt(), host_suites[0], ring_nonce))
+      exit(EXIT_FAILURE);
+
+    init_cipher(&ring_cipher, host_suites[0], ring_nonce);
+  }
+
+  /* For the next host - listeners are woken out of pselect to park for it */
+  int handoff_socket = -1;
+
+  if (*connection.handoff_path != '\0') {
+    struct sigaction wake = {.sa_handler = wake_listener};
+
+    sigemptyset(&wake.sa_mask);
+    sigaction(HANDOFF_SIGNAL, &wake, NULL);
+
+    handoff_socket = listen_unix(connection.handoff_path, SOCK_SEQPACKET);
+  }
+
+  printf("Listening for connections...\n");
+
+  pthread_t broadcaster, connection_handler, linkers[MAX_PEERS];
+
+  do {
+    gcry_create_nonce(&host_id, sizeof(host_id));
+  } while (host_id == 0);
+
+  if (connection.peer_count > 0)
+    printf("Relaying to peers as host %08" PRIx32 "\n", host_id);
+
+  /* Start message broadcast thread, and whoever helps it seal */
+  seal_pool_start(connection.seal_workers);
+  pthread_create(&broadcaster, NULL, broadcast_message, NULL);
+
+  if (seal_pool_workers() > 0)
+    printf("Sealing broadcasts on %d more threads\n", seal_pool_workers());
+
+  int *sock_fds;
+
+  if ((sock_fds = (int *)malloc(2 * sizeof(int))) == NULL) {
+    HANDLE_ERROR("Failed to allocate memory for socket fds", 1);
+  }
+  sock_fds[0] = inet_socket;
+  sock_fds[1] = unix_socket;
+
+  pthread_create(&connection_handler, NULL, handle_connections, sock_fds);
+
+  /* The rooms are shared with every -P host, and whoever links to us */
+  for (int i = 0; i < connection.peer_count; i++)
+    pthread_create(&linkers[i], NULL, link_to_peer, connection.peers[i]);
 
+  /* The console, and a new host asking for the sessions */
+  struct pollfd waiting[2] = {
+      {.fd = STDIN_FILENO, .events = POLLIN},
+      {.fd = handoff_socket, .events = POLLIN}};
+  int successor = -1;
+
+  /* Unbuffered, so no line waits in stdio where poll can't see it */
+  setvbuf(stdin, NULL, _IONBF, 0);
+
+  char buffer[MAX_BUFFER], command[MAX_BUFFER], args[MAX_BUFFER];
+  while (true) {
+    if (poll(waiting, 2, -1) < 0)
+      continue;  // interrupted
+
+    if ((waiting[1].revents & POLLIN) && (successor = accept(handoff_socket, NULL, NULL)) != -1)
+      break;
+
+    if (!(waiting[0].revents & (POLLIN | POLLHUP)))
+      continue;
+
+    /* The console is gone - only a handoff ends the host now */
+    if (fgets(buffer, MAX_BUFFER, stdin) == NULL) {
+      waiting[0].fd = -1;
+      continue;
+    }
+
+    sscanf(buffer, "%s %s", command, args);
+
+    if (!strcmp(command, C_QUIT)) {
+      break;
+
+    } else if (!strcmp(command, C_KICK)) {
+      handle_disconnect(find_client(atoi(args)));
+
+    } else if (!strcmp(command, C_STATS)) {
+      stats_dump(stdout);
+    }
+  }
+
+  pthread_cancel(connection_handler);
+
+  /* Links are cut with the rest, a new host makes its own */
+  for (int i = 0; i < connection.peer_count; i++) {
+    pthread_cancel(linkers[i]);
+    pthread_join(linkers[i], NULL);
+  }
+
+  if (successor != -1) {
+    pthread_join(connection_handler, NULL);
+    hand_off(successor, broadcaster, inet_socket, unix_socket);
+  } else {
+    pthread_cancel(broadcaster);
+    pthread_join(broadcaster, NULL);  // the log is unmapped under it otherwise
+  }
+
+  seal_pool_stop();
+  io_engine_stop();
+  timer_wheel_stop();
+  stats_stop();
+  capture_close();
+  msg_log_close();
+
+  if (ring_memfd() != -1) {
+    ring_close();
+    clean_cipher(&ring_cipher);
+  }
+
+  /* Close all client connections */
+  for (int i = 0; i < clients.count; i++) {
+    Client *client = client_map_get(&clients, clients.dense[i]);
+
+    if (client->reading)
+      pthread_cancel(client->read_thread);
+
+    close(client->socket);
+  }
+
+  lane_queue_free(&out_queue);
+  free_rooms();
+  close(inet_socket);
+
+  /* Handed off, the paths are the new host's */
+  if (unix_socket != -1) {
+    close(unix_socket);
+
+    if (successor == -1)
+      unlink(connection.unix_path);
+  }
+
+  if (handoff_socket != -1) {
+    close(handoff_socket);
+
+    if (successor == -1)
+      unlink(connection.handoff_path);
+  }
+
+  /* The new host opens the log after this */
+  if (successor != -1)
+    close(successor);
+
+  return;
+}
+
+int listen_inet(void) {
   /* Set IP and port */
   in_addr_t addr = str_to_bin_IP(connection.ipv4);
   int16_t port_num = str_to_uint16_t(connection.port);
@@ -71,316 +426,2178 @@ void start_server(void) {
     exit(EXIT_FAILURE);
   }
 
-  /*******************   LISTENING FOR CONNECTIONS   ********************/
+  return inet_socket;
+}
 
-  init_list(&read_head, &read_tail);
+/* SOCK_STREAM for clients, SOCK_SEQPACKET for a handoff */
+int listen_unix(char *path, int type) {
+  struct sockaddr_un server_address = {.sun_family = AF_UNIX};
 
-  printf("Listening for connections...\n");
+  if (strlen(path) >= sizeof(server_address.sun_path)) {
+    fprintf(stderr, "Unix socket path is too long - %s\n", path);
+    exit(EXIT_FAILURE);
+  }
 
-  pthread_t broadcaster, connection_handler;
+  strcpy(server_address.sun_path, path);
 
-  /* Start message broadcast thread */
-  pthread_create(&broadcaster, NULL, broadcast_message, NULL);
+  int unix_socket = socket(AF_UNIX, type, 0);
 
-  int *sock_fd;
+  if (unix_socket == -1) {
+    HANDLE_ERROR("Failed to create a unix socket.", 1);
+  }
+
+  /* Left behind by a server that didn't shut down cleanly */
+  unlink(path);
 
-  if ((sock_fd = (int *)malloc(sizeof(inet_socket))) == NULL) {
-    HANDLE_ERROR("Failed to allocate memory for socket fd", 1);
+  if (bind(unix_socket, (struct sockaddr *)&server_address, sizeof(server_address))) {
+    fprintf(stderr, "Failed to bind %s - %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
   }
-  *sock_fd = inet_socket;
 
-  pthread_create(&connection_handler, NULL, handle_connections, sock_fd);
+  if (listen(unix_socket, 5) != 0) {
+    fprintf(stderr, "Failed to listen %s\n", path);
+    exit(EXIT_FAILURE);
+  }
 
-  char buffer[MAX_BUFFER], command[MAX_BUFFER], args[MAX_BUFFER];
-  int index;
-  while (true) {
-    fgets(buffer, MAX_BUFFER, stdin);
-    sscanf(buffer, "%s %s", command, args);
+  printf("Bound %s%s\n", UNIX_PREFIX, path);
 
-    if (!strcmp(command, C_QUIT)) {
-      break;
+  return unix_socket;
+}
 
-    } else if (!strcmp(command, C_KICK)) {
-      if ((index = find_client_index(atoi(args))) != -1)
-        handle_disconnect(index);
-    }
+/* New host's side - -1 if nobody listens on the path, it's the first host then */
+int take_over(char *path, Handoff_header *header, int *inet_socket, int *unix_socket) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  int predecessor, fds[MAX_PASSED_FDS], count = MAX_PASSED_FDS;
+
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+  if ((predecessor = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+    HANDLE_ERROR("Failed to create a unix socket.", 1);
   }
 
-  pthread_cancel(broadcaster);
-  pthread_cancel(connection_handler);
+  if (connect(predecessor, (struct sockaddr *)&address, sizeof(address))) {
+    close(predecessor);
+    return -1;
+  }
 
-  /* Close all client connections */
-  for (int i = 0; i <= client_index; i++) {
-    pthread_cancel(clients[i].read_thread);
-    close(clients[i].socket);
+  printf("Taking over from the host at %s\n", path);
+
+  if (recv_with_fds(predecessor, header, sizeof(Handoff_header), fds, &count) != sizeof(Handoff_header) ||
+      header->magic != HANDOFF_MAGIC || count == 0) {
+    fprintf(stderr, "No handoff came from %s\n", path);
+    exit(EXIT_FAILURE);
   }
 
-  empty_list(&read_head);
-  close(inet_socket);
+  /* Its sockets as they were, -p and -s are left unused */
+  *inet_socket = fds[0];
+  *unix_socket = (count > 1) ? fds[1] : -1;
 
-  return;
+  return predecessor;
 }
 
-/* One thread handles connections - 
-The thread will start a new thread for every client*/
-void *handle_connections(void *p_socket) {
-  int server_socket = *((int *)p_socket);
-  free(p_socket);
+/* The sessions go on where they were - same salts, counters and rooms */
+void take_over_clients(int predecessor, uint32_t count) {
+  static Handoff_client record;
+  Client new_client;
+  Client_handle handle;
+  int socket, fds, room, taken = 0;
+  ssize_t size;
 
-  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+  for (uint32_t i = 0; i < count; i++) {
+    fds = 1;
 
-  int clients_connected = 0;
-  fd_set server_sockets, ready_socks;
+    if ((size = recv_with_fds(predecessor, &record, sizeof(record), &socket, &fds)) <= 0)
+      break;  // the old host is gone
 
-  /* Initialize structs */
-  FD_ZERO(&server_sockets);
+    if (fds == 0)
+      continue;
 
-  /* Add server_socket into set */
-  FD_SET(server_socket, &server_sockets);
+    if ((size_t)size < offsetof(Handoff_client, frame) + record.pending ||
+        record.pending > FRAME_BUFFER_BYTES || record.suite >= SUITE_COUNT) {
+      close(socket);
+      continue;
+    }
 
-  while (clients_connected < connection.max_connections) {
-    ready_socks = server_sockets;
+    memset(&new_client, 0, sizeof(new_client));
+    new_client.socket = socket;
+    new_client.addr = record.addr;
+    new_client.salt = record.salt;
+    memcpy(new_client.key_nonce, record.key_nonce, KEY_NONCE_BYTES);
 
-    if (select(server_socket + 1, &ready_socks, NULL, NULL, NULL) < 0) {
-      HANDLE_ERROR("There was problem with read select connections", 1);
+    if (init_session_ciphers(&new_client, record.suite)) {
+      close(socket);
+      continue;
     }
 
-    /* Client is attempting to connect */
-    if (FD_ISSET(server_socket, &ready_socks)) {
-      if (!accept_connection(server_socket))
-        clients_connected++;
+    if ((handle = add_client(new_client)) == NO_CLIENT) {
+      clean_session_ciphers(&new_client);
+      close(socket);
+      continue;
     }
-  }
 
-  return NULL;
-}
-
-int accept_connection(int server_socket) {
-  Client new_client;
+    record.name[MAX_USERNAME_LEN - 1] = '\0';
+    record.room[MAX_ROOM_NAME - 1] = '\0';
 
-  socklen_t addr_size = sizeof(new_client.addr);
+    pthread_mutex_lock(&client_lock);
 
-  new_client.socket = accept(
-      server_socket,
-      (struct sockaddr *)&new_client.addr,
-      &addr_size);
+    Client *client = client_map_get(&clients, handle);
 
-  char ip_v4[MAX_IPV4_STR];
-  bin_IP_to_str(new_client.addr.sin_addr.s_addr, ip_v4);
-  printf("Connection incoming from %s\n", ip_v4);
+    if ((room = open_room(record.room)) != -1 && room != LOBBY_ROOM)
+      move_to_room(handle, room);
 
-  char argon2id_hash[MAX_BUFFER];
+    client->ctr = record.ctr;
+    client->send_ctr = record.send_ctr;
+    client->joined_seq = record.joined_seq;
 
-  if (read_one_packet(new_client.socket, argon2id_hash, MAX_BUFFER)) {
-    close(new_client.socket);
-    return 1;
-  }
+    if (*record.name != '\0')
+      update_client_name(handle, record.name);
 
-  /* Drop connection - wrong password */
-  if (verify_argon2id(argon2id_hash, connection.password)) {
-    send(
-        new_client.socket,
-        RESPONSE_FAIL,
-        sizeof(RESPONSE_FAIL), MSG_NOSIGNAL);
-    close(new_client.socket);
+    pthread_mutex_unlock(&client_lock);
 
-    return 1;
+    start_reading(handle, record.frame, record.pending);
+    taken++;
   }
 
-  /**********************   CONNECTION ACCEPTED   **********************/
-
-  send(
-      new_client.socket,
-      RESPONSE_OK,
-      sizeof(RESPONSE_OK), MSG_NOSIGNAL);
+  /* Closed once the old host is done with the log */
+  while (recv(predecessor, &record, sizeof(record), 0) > 0)
+    ;
 
-  printf("Connection accepted from %s\n", ip_v4);
+  close(predecessor);
+  printf("Took over %d sessions\n", taken);
 
-  pthread_mutex_lock(&r_lock);
+  return;
+}
 
-  add_message_to_queue(
-      compose_message(
-          "New connection accepted",
-          "0",
-          "/7:Server"),
-      &read_head, &read_tail, NULL);
+/* Old host's side, accepting has stopped - the readers stop between frames,
+   what's queued goes out, then the sessions and listening sockets go over.
+   Ring readers and peer links aren't handed off, they reconnect */
+void hand_off(int successor, pthread_t broadcaster, int inet_socket, int unix_socket) {
+  static Handoff_client record;
+  static Client_handle held[CLIENT_SLOTS];
+  Handoff_header header = {.magic = HANDOFF_MAGIC, .client_count = 0};
+  int fds[MAX_PASSED_FDS] = {inet_socket, unix_socket}, reading, handed = 0, held_count = 0;
+  Client *client;
+  Listener *listener;
+
+  __atomic_store_n(&handing_off, true, __ATOMIC_RELEASE);
+
+  /* The engine's are just forgotten, their listeners stay with the clients */
+  io_engine_pause();
+  pthread_mutex_lock(&client_lock);
 
-  pthread_cond_signal(&message_ready);
+  for (int i = 0; i < clients.count; i++) {
+    client = client_map_get(&clients, clients.dense[i]);
 
-  pthread_mutex_unlock(&r_lock);
+    if (client->reading) {
+      pthread_kill(client->read_thread, HANDOFF_SIGNAL);
 
-  /* Allocating heap mem for socket num as it's sent to a thread */
-  int *sock_fd;
+    } else if (client->io_context != NULL) {
+      io_engine_forget(client->socket, client->io_context);
 
-  if ((sock_fd = (int *)malloc(sizeof(new_client.socket))) == NULL) {
-    HANDLE_ERROR("Failed to allocate memory for socket fd", 1);
+      if (((Listener *)client->io_context)->held)
+        held[held_count++] = clients.dense[i];
+    }
   }
 
-  *sock_fd = new_client.socket;
-  init_AES_256_cipher(&new_client.aes_gcm_handle);
-  new_client.ctr = 0;
+  pthread_mutex_unlock(&client_lock);
 
-  /* Start message listening thread for the new client */
-  pthread_create(
-      &new_client.read_thread,
-      NULL, message_listener, sock_fd);
+  /* Throttled frames go out with the rest, the new host limits the client afresh */
+  for (int i = 0; i < held_count; i++) {
+    if ((listener = held_listener(held[i])) != NULL) {
+      listener->rate_limited = false;
+      unhold_listener(listener);
+    }
+  }
 
-  pthread_mutex_lock(&client_lock);
-  clients[client_index++] = new_client;
-  pthread_mutex_unlock(&client_lock);
+  io_engine_resume();
 
-  return 0;
-}
+  /* Threads park at their next frame boundary */
+  do {
+    usleep(1000);
+    reading = 0;
 
-void handle_disconnect(int index) {
-  char buffer[MAX_BUFFER];
+    pthread_mutex_lock(&client_lock);
 
-  snprintf(
-      buffer, MAX_BUFFER,
-      "Client(%d) has left the chat.",
-      clients[index].socket);
+    for (int i = 0; i < clients.count; i++)
+      reading += client_map_get(&clients, clients.dense[i])->reading;
 
-  /* Don't cancel yourself */
-  if (pthread_self() != clients[index].read_thread)
-    pthread_cancel(clients[index].read_thread);
+    pthread_mutex_unlock(&client_lock);
+  } while (reading > 0);
 
-  close(clients[index].socket);
-  clean_cipher(&clients[index].aes_gcm_handle);
+  pthread_mutex_lock(&r_lock);
+  stop_when_drained = true;
+  pthread_cond_signal(&message_ready);
+  pthread_mutex_unlock(&r_lock);
+
+  pthread_join(broadcaster, NULL);
+  timer_wheel_stop();  // idle checks send and disconnect
 
-  /* Remove the client from the clients arr */
   pthread_mutex_lock(&client_lock);
 
-  for (int i = index; i < client_index; i++) {
-    clients[i] = clients[i + 1];
+  for (int i = 0; i < clients.count; i++)
+    header.client_count += !client_map_get(&clients, clients.dense[i])->ring &&
+                           !client_map_get(&clients, clients.dense[i])->peer;
+
+  header.next_seq = next_seq;
+  header.next_salt = next_salt;
+
+  if (send_with_fds(successor, &header, sizeof(header), fds, (unix_socket != -1) ? 2 : 1) == -1) {
+    fprintf(stderr, "Failed to hand off - %s\n", strerror(errno));
+    pthread_mutex_unlock(&client_lock);
+    return;
   }
-  client_index--;
 
-  pthread_mutex_unlock(&client_lock);
+  for (int i = 0; i < clients.count; i++) {
+    client = client_map_get(&clients, clients.dense[i]);
+    listener = (Listener *)client->io_context;
+
+    if (client->ring || client->peer)
+      continue;
+
+    record.ctr = client->ctr;
+    record.send_ctr = client->send_ctr;
+    record.joined_seq = client->joined_seq;
+    record.salt = client->salt;
+    record.suite = client->suite;
+    memcpy(record.key_nonce, client->key_nonce, KEY_NONCE_BYTES);
+    record.addr = client->addr;
+    snprintf(record.name, MAX_USERNAME_LEN, "%s", client->name);
+    snprintf(record.room, MAX_ROOM_NAME, "%s", rooms[client->room].name);
+    record.pending = 0;
+
+    /* Nothing else is sending now, a backlog may block on its way out */
+    send_frames(client->socket, &client->out, 0);
+
+    if (listener != NULL) {
+      record.pending = listener->reader.filled - listener->reader.offset;
+      memcpy(record.frame, listener->reader.buffer + listener->reader.offset, record.pending);
+    }
 
-  /* Broadcast the lost boi */
-  pthread_mutex_lock(&r_lock);
+    if (send_with_fds(
+            successor, &record, offsetof(Handoff_client, frame) + record.pending,
+            &client->socket, 1) == -1) {
+      fprintf(stderr, "Failed to hand off - %s\n", strerror(errno));
+      break;
+    }
 
-  add_message_to_queue(
-      compose_message(buffer, "0", "/7:Server"),
-      &read_head, &read_tail, NULL);
-  pthread_cond_signal(&message_ready);
+    handed++;
+  }
 
-  pthread_mutex_unlock(&r_lock);
+  pthread_mutex_unlock(&client_lock);
 
-  return;
-}
+  printf("Handed %d sessions off\n", handed);
 
-int find_client_index(int socket) {
-  for (int i = 0; i <= client_index; i++) {
-    if (clients[i].socket == socket)
-      return i;
-  }
-  return -1;
+  return;
 }
 
-/* Puts messages sent by client into a queue for broadcasts */
-void *message_listener(void *p_socket) {
-  int index, socket = *((int *)p_socket);
-  free(p_socket);
+/* One thread handles connections - 
+The thread will start a new thread for every client*/
+void *handle_connections(void *p_sockets) {
+  int server_sockets[2] = {((int *)p_sockets)[0], ((int *)p_sockets)[1]};
+  free(p_sockets);
 
   pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
-  fd_set connected_socks, ready_socks;
+  int clients_connected = 0, max_socket = -1;
+  fd_set listening_socks, ready_socks;
 
   /* Initialize structs */
-  FD_ZERO(&connected_socks);
-  FD_SET(socket, &connected_socks);
+  FD_ZERO(&listening_socks);
 
-  ssize_t received_bytes;
-  Msg msg;
+  /* TCP and, when set up, the unix socket */
+  for (int i = 0; i < 2; i++) {
+    if (server_sockets[i] == -1)
+      continue;
 
-  char data_buffer[PACKET_MAX_BYTES], *packet;
+    FD_SET(server_sockets[i], &listening_socks);
 
-  index = find_client_index(socket);
+    if (server_sockets[i] > max_socket)
+      max_socket = server_sockets[i];
+  }
 
-  while (true) {
-    ready_socks = connected_socks;
+  while (clients_connected < connection.max_connections) {
+    ready_socks = listening_socks;
 
-    /* TODO Time out should be set */
-    if (select(socket + 1, &ready_socks, NULL, NULL, NULL) < 0) {
-      HANDLE_ERROR("There was problem with read select", 1);
+    if (select(max_socket + 1, &ready_socks, NULL, NULL, NULL) < 0) {
+      HANDLE_ERROR("There was problem with read select connections", 1);
     }
 
-    if (FD_ISSET(socket, &ready_socks)) {
-      received_bytes = recv(socket, data_buffer, PACKET_MAX_BYTES, 0);
+    /* Client is attempting to connect */
+    for (int i = 0; i < 2; i++) {
+      if (server_sockets[i] != -1 && FD_ISSET(server_sockets[i], &ready_socks)) {
+        /* Seen through before a cancel lands - it takes client_lock on the way */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-      /* There was a connection error or it was orderly closed */
-      if (received_bytes <= 0) {
-        if (index != -1)
-          handle_disconnect(index);
+        if (!accept_connection(server_sockets[i]))
+          clients_connected++;
 
-        return NULL;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
       }
+    }
+  }
 
-      if (received_bytes < MIN_PACKET_SIZE)
-        continue;  //rejected, malformed size
+  return NULL;
+}
 
-      packet = decrypt_packet(
-          data_buffer,
-          &clients[index].aes_gcm_handle, clients[index].ctr++);
+int accept_connection(int server_socket) {
+  Client new_client;
+  struct sockaddr_storage addr;
 
-      if (packet == NULL) {
-        printf("Malformed message from %d idx: %d\n", socket, index);
-        continue;
-      }
+  socklen_t addr_size = sizeof(addr);
 
-      msg = ascii_packet_to_message(packet);
-      snprintf(msg.id, ID_SIZE, "%d", socket);
-      free(packet);
+  new_client.socket = accept(
+      server_socket,
+      (struct sockaddr *)&addr,
+      &addr_size);
 
-      pthread_mutex_lock(&r_lock);
+  if (new_client.socket == -1)
+    return 1;
 
-      add_message_to_queue(msg, &read_head, &read_tail, NULL);
-      pthread_cond_signal(&message_ready);
+  /* Unix peers have no address - left zeroed, they're never seen as reconnects */
+  char ip_v4[MAX_IPV4_STR] = "unix";
+  memset(&new_client.addr, 0, sizeof(new_client.addr));
 
-      pthread_mutex_unlock(&r_lock);
-    }
+  if (addr.ss_family == AF_INET) {
+    memcpy(&new_client.addr, &addr, sizeof(new_client.addr));
+    bin_IP_to_str(new_client.addr.sin_addr.s_addr, ip_v4);
   }
 
-  return NULL;
-}
+  printf("Connection incoming from %s\n", ip_v4);
 
-/* Broadcasts every client message to every client connected */
-void *broadcast_message(void *_) {
-  Msg *outgoing_msg;
-  int size, new_size, msg_count = 0;
-  char *ascii_packet, *enc_packet;
+  char argon2id_hash[MAX_BUFFER];
+  int status, suite;
 
-  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+  /* A client that never says anything is cut off by the wheel */
+  pthread_mutex_lock(&handshake_lock);
+  handshake_socket = new_client.socket;
+  pthread_mutex_unlock(&handshake_lock);
 
-  while (true) {
-    pthread_mutex_lock(&r_lock);
+  timer_arm(&handshake_timer, HANDSHAKE_TIMEOUT_MS);
 
-    if ((outgoing_msg = pop_msg_from_queue(&read_head, NULL)) == NULL) {
-      pthread_cond_wait(&message_ready, &r_lock);
+  status = read_one_packet(new_client.socket, argon2id_hash, MAX_BUFFER, -1);
 
-      /* Message should be ready now */
-      outgoing_msg = pop_msg_from_queue(&read_head, NULL);
-    }
+  pthread_mutex_lock(&handshake_lock);
+  handshake_socket = -1;
+  pthread_mutex_unlock(&handshake_lock);
+
+  timer_cancel(&handshake_timer);
+
+  if (status) {
+    stats_add(STAT_AUTH_FAILURES, 1);
+    close(new_client.socket);
+    return 1;
+  }
+
+  /* The hash, then the client's suites - an encoded hash has no spaces */
+  argon2id_hash[MAX_BUFFER - 1] = '\0';
+  char *offer = strchr(argon2id_hash, ' ');
+
+  if (offer != NULL)
+    *offer++ = '\0';
+
+  /* Drop connection - wrong password */
+  if (verify_argon2id(argon2id_hash, connection.password)) {
+    stats_add(STAT_AUTH_FAILURES, 1);
+    send(
+        new_client.socket,
+        RESPONSE_FAIL,
+        sizeof(RESPONSE_FAIL), MSG_NOSIGNAL);
+    close(new_client.socket);
+
+    return 1;
+  }
+
+  /* Turned away like a wrong password - no suite in common, or the slab
+     (sized with -k) is full */
+  if ((suite = choose_suite(offer)) == -1) {
+    printf("No common cipher suite with %s (%s)\n", ip_v4, (offer != NULL) ? offer : "");
+  }
+
+  /* Every session gets a key of its own - nothing sealed for one opens another */
+  gcry_create_nonce(new_client.key_nonce, KEY_NONCE_BYTES);
+
+  if (suite == -1 || init_session_ciphers(&new_client, suite)) {
+    send(
+        new_client.socket,
+        RESPONSE_FAIL,
+        sizeof(RESPONSE_FAIL), MSG_NOSIGNAL);
+    close(new_client.socket);
+
+    return 1;
+  }
+
+  /**********************   CONNECTION ACCEPTED   **********************/
+
+  char response[MAX_BUFFER], nonce_hex[KEY_NONCE_HEX];
+
+  /* The client derives its nonces from the salt too, and its key from ours */
+  new_client.salt = take_salt();
+  bytes_to_hex(new_client.key_nonce, KEY_NONCE_BYTES, nonce_hex);
+  snprintf(
+      response, MAX_BUFFER, "%s %08" PRIx32 " %s %s",
+      RESPONSE_OK, new_client.salt, suite_name(suite), nonce_hex);
+
+  send(
+      new_client.socket,
+      response,
+      strlen(response) + 1, MSG_NOSIGNAL);
+
+  printf("Connection accepted from %s (%s)\n", ip_v4, suite_name(suite));
+
+  stats_add(STAT_CONNECTS, 1);
+
+  if (new_client.addr.sin_family == AF_INET &&
+      recent_peers[new_client.addr.sin_addr.s_addr % RECENT_PEERS] == new_client.addr.sin_addr.s_addr)
+    stats_add(STAT_RECONNECTS, 1);
+
+  Client_handle handle;
+
+  /* The listener looks itself up, so the client is added first */
+  if ((handle = add_client(new_client)) == NO_CLIENT) {
+    clean_session_ciphers(&new_client);
+    close(new_client.socket);
+    return 1;
+  }
+
+  presence_event(LOBBY_ROOM, PRESENCE_JOINED, "New connection accepted");
+  start_reading(handle, NULL, 0);
+
+  return 0;
+}
+
+/* Watched by the engine, or a message listening thread for the client - the
+   listener starts with what an old host's reader had of an unfinished frame */
+void start_reading(Client_handle handle, char *pending, size_t pending_size) {
+  Listener *listener;
+  Client_handle *p_handle;
+
+  pthread_mutex_lock(&client_lock);
+
+  Client *client = client_map_get(&clients, handle);
+
+  if (client == NULL) {
+    pthread_mutex_unlock(&client_lock);
+    return;  // gone already
+  }
+
+  if ((listener = (Listener *)malloc(sizeof(Listener))) == NULL) {
+    HANDLE_ERROR("Failed to allocate memory for a listener", 1);
+  }
+
+  init_listener(listener, handle, client);
+
+  if (pending_size > 0)
+    frame_reader_append(&listener->reader, pending, pending_size);
+
+  client->io_context = listener;
+
+  if (connection.io_engine != IO_THREADS) {
+    io_engine_watch(client->socket, listener);
+
+  } else {
+    /* Allocating heap mem for the handle as it's sent to a thread */
+    if ((p_handle = (Client_handle *)malloc(sizeof(Client_handle))) == NULL) {
+      HANDLE_ERROR("Failed to allocate memory for client handle", 1);
+    }
+
+    *p_handle = handle;
+    pthread_create(&client->read_thread, NULL, message_listener, p_handle);
+    client->reading = true;
+  }
+
+  pthread_mutex_unlock(&client_lock);
+
+  return;
+}
+
+void init_clients(void) {
+  struct timespec now;
+
+  for (int i = 0; i < FD_SETSIZE; i++)
+    socket_handles[i] = NO_CLIENT;
+
+  /* Starts from the wall clock, so sequences keep growing over restarts */
+  clock_gettime(CLOCK_REALTIME, &now);
+  next_seq = (uint64_t)now.tv_sec * NANOSECS_IN_SEC + now.tv_nsec;
+
+  gcry_create_nonce(&next_salt, sizeof(next_salt));
+
+  init_client_map(&clients);
+  init_rooms();
+  init_name_map(&client_names);
+
+  return;
+}
+
+/* Unique for the server's run - accept thread, or before it starts */
+uint32_t take_salt(void) {
+  uint32_t salt = SALT_TO_SERVER(next_salt);
+
+  next_salt = salt + 2;
+
+  return salt;
+}
+
+/* 1 when the slab is full - nothing is left open then. The key comes from
+   client->key_nonce, set before */
+int init_session_ciphers(Client *client, Suite suite) {
+  client->suite = suite;
+
+  if (init_cipher(&client->recv_cipher, suite, client->key_nonce))
+    return 1;
+
+  if (init_cipher(&client->send_cipher, suite, client->key_nonce)) {
+    clean_cipher(&client->recv_cipher);
+    return 1;
+  }
+
+  return 0;
+}
+
+void clean_session_ciphers(Client *client) {
+  clean_cipher(&client->recv_cipher);
+  clean_cipher(&client->send_cipher);
+
+  return;
+}
+
+/* -a as given, or every suite fastest first - what's fastest depends on the
+   host's AES instructions, so it's measured rather than assumed */
+void rank_suites(void) {
+  char ranked[MAX_SUITES_STR];
+  double cost[SUITE_COUNT];
+
+  if (*connection.suites != '\0') {
+    host_suite_count = parse_suites(connection.suites, host_suites);
+
+  } else {
+    for (int suite = 0; suite < SUITE_COUNT; suite++) {
+      cost[suite] = probe_suite(suite);
+      host_suites[host_suite_count++] = suite;
+
+      printf("Cipher suite %s: %.0f ns/packet\n", suite_name(suite), cost[suite]);
+    }
+
+    /* Insertion sort, there are two of them */
+    for (int i = 1; i < host_suite_count; i++) {
+      for (int j = i; j > 0 && cost[host_suites[j]] < cost[host_suites[j - 1]]; j--) {
+        Suite tmp = host_suites[j];
+        host_suites[j] = host_suites[j - 1];
+        host_suites[j - 1] = tmp;
+      }
+    }
+  }
+
+  suites_to_str(host_suites, host_suite_count, ranked, MAX_SUITES_STR);
+  printf("Preferring cipher suites %s\n", ranked);
+
+  return;
+}
+
+/* Ours first, among what the client offers - no offer is a client from
+   before suites, which only speaks AES-GCM. -1 when nothing matches */
+int choose_suite(char *offer) {
+  Suite offered[SUITE_COUNT];
+  int count = 1;
+
+  if (offer == NULL)
+    offered[0] = SUITE_AES256_GCM;
+  else
+    count = parse_suites(offer, offered);
+
+  for (int i = 0; i < host_suite_count; i++) {
+    for (int j = 0; j < count; j++) {
+      if (host_suites[i] == offered[j])
+        return host_suites[i];
+    }
+  }
+
+  return -1;
+}
+
+/* Runs on the timer wheel */
+void handshake_expired(void *_) {
+  pthread_mutex_lock(&handshake_lock);
+
+  /* Wakes up the accept thread's read, unless the handshake just finished */
+  if (handshake_socket != -1) {
+    shutdown(handshake_socket, SHUT_RDWR);
+    stats_add(STAT_TIMEOUTS, 1);
+  }
+
+  pthread_mutex_unlock(&handshake_lock);
+
+  return;
+}
+
+/* Registers a connected client and puts it into the lobby - NO_CLIENT when full */
+Client_handle add_client(Client new_client) {
+  return insert_client(new_client, false);
+}
+
+/* A link we opened never sits in the lobby, not even for a moment - it's a
+   peer from the start, sealed for with the salt it sends on */
+Client_handle insert_client(Client new_client, bool outbound) {
+  Client_handle handle;
+
+  new_client.ctr = 0;
+  new_client.send_ctr = 0;
+  new_client.ring = false;
+  new_client.peer = false;
+  new_client.outbound = outbound;
+  new_client.out.count = 0;
+  new_client.out.first_sent = 0;
+  new_client.dirty = false;
+  new_client.corked = false;
+  new_client.send_failed = false;
+  new_client.io_context = NULL;
+  new_client.reading = false;
+  new_client.room = LOBBY_ROOM;
+  *new_client.name = '\0';
+
+  if (new_client.socket < 0 || new_client.socket >= FD_SETSIZE)
+    return NO_CLIENT;
+
+  pthread_mutex_lock(&client_lock);
+
+  new_client.joined_seq = next_seq;
+
+  /* History is sent on the client's /resume, with only what it missed */
+  if ((handle = client_map_insert(&clients, &new_client)) != NO_CLIENT) {
+    Client *client = client_map_get(&clients, handle);
+
+    client->room_pos = (outbound) ? -1 : add_subscriber(LOBBY_ROOM, handle);
+    socket_handles[new_client.socket] = handle;
+
+    client->last_heard = get_monotonic_nanosecs();
+    client->pinged = false;
+    timer_init(&client->idle_timer, check_idle, (void *)(intptr_t)handle);
+    timer_init(&client->flush_timer, retry_flush, (void *)(intptr_t)handle);
+    timer_init(&client->throttle_timer, release_throttle, (void *)(intptr_t)handle);
+
+    if (outbound)
+      register_peer(handle);  // one too many is dropped with the failed sends
+    else if (connection.idle_timeout > 0)
+      timer_arm(&client->idle_timer, connection.idle_timeout * 1000 / 3);
+  }
+
+  pthread_mutex_unlock(&client_lock);
+
+  return handle;
+}
+
+/* Queues a system message for everyone in the room, behind any chat that is
+   waiting - joins and leaves go through presence_event first */
+void announce(char *text, int room) {
+  Msg msg = compose_message(text, "0", "/7:Server");
+  msg.room = room;
+
+  queue_broadcast(msg, LANE_NOTICE);
+
+  return;
+}
+
+/* For the broadcaster - producers that keep an order of their own use lane_push */
+void queue_broadcast(Msg msg, Lane lane) {
+  pthread_mutex_lock(&r_lock);
+
+  lane_push(&out_queue, msg, lane);
+  pthread_cond_signal(&message_ready);
+
+  pthread_mutex_unlock(&r_lock);
+
+  return;
+}
+
+/* Which class a client's message is broadcast in */
+Lane lane_for(Msg *msg) {
+  char command[MAX_MSG_LEN] = "";
+
+  if (*msg->msg != '/')
+    return LANE_CHAT;
+
+  sscanf(msg->msg + 1, "%s", command);
+
+  if (!strcmp(command, C_PING) || !strcmp(command, C_PONG) || !strcmp(command, C_RING))
+    return LANE_CONTROL;
+
+  if (!strcmp(command, C_JOIN) || !strcmp(command, C_LEAVE) || !strcmp(command, C_RESUME))
+    return LANE_BULK;
+
+  return LANE_CHAT;  // renames and direct messages are as urgent as chat
+}
+
+/* One per -P host - links to it, and again with a backoff whenever the link is lost.
+   The link is a session like a client's, we're just the side that opened it */
+void *link_to_peer(void *p_address) {
+  char *address = (char *)p_address, ipv4[MAX_IPV4_STR] = "", port[MAX_PORT_STR] = "";
+  char hello[MAX_MSG_LEN], proof[PEER_PROOF_HEX], *ascii_packet;
+  int backoff = RECONNECT_MIN_MS, failed_total, size;
+  Client *peer;
+  uint64_t linked_at = 0;
+  Client_handle handle, failed[CLIENT_SLOTS];
+  Client new_client;
+  Suite suite;
+  bool linked;
+
+  sscanf(address, "%15[^:]:%5s", ipv4, port);
+
+  while (true) {
+    /* Never cancelled halfway through a handshake or holding client_lock */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    memset(&new_client, 0, sizeof(new_client));
+    handle = NO_CLIENT;
+
+    if ((new_client.socket = connect_to_host(ipv4, port, "", &new_client.salt, &suite, new_client.key_nonce)) != -1) {
+      new_client.addr.sin_family = AF_INET;  // corked like any TCP client
+
+      if (init_session_ciphers(&new_client, suite)) {
+        close(new_client.socket);
+
+      } else if ((handle = insert_client(new_client, true)) == NO_CLIENT) {
+        clean_session_ciphers(&new_client);
+        close(new_client.socket);
+      }
+    }
+
+    if (handle != NO_CLIENT) {
+      pthread_mutex_lock(&client_lock);
+
+      /* Gone already if there were too many links and the broadcaster dropped it */
+      peer = client_map_get(&clients, handle);
+
+      if (peer != NULL && peer->peer) {
+        peer_proof(peer, host_id, true, proof);
+        snprintf(hello, MAX_MSG_LEN, "/" C_PEER " %08" PRIx32 " %s", host_id, proof);
+
+        Msg msg = compose_message(hello, "0", NULL);
+        ascii_packet = message_to_ascii_packet(&msg, &size);
+
+        send_to_client(handle, ascii_packet, size);
+        flush_output();
+
+        free(ascii_packet);
+      }
+
+      failed_total = take_failed_sends(failed);
+
+      pthread_mutex_unlock(&client_lock);
+
+      for (int i = 0; i < failed_total; i++)
+        handle_disconnect(failed[i]);
+
+      start_reading(handle, NULL, 0);
+      linked_at = get_monotonic_nanosecs();
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+    /* Until the link is lost - one refused right away is retried like a failed connect */
+    while (handle != NO_CLIENT) {
+      usleep(RECONNECT_MIN_MS * 1000);
+
+      pthread_mutex_lock(&client_lock);
+      linked = client_map_get(&clients, handle) != NULL;
+      pthread_mutex_unlock(&client_lock);
+
+      if (!linked) {
+        printf("Lost the link to %s\n", address);
+        break;
+      }
+    }
+
+    /* A link that held for a while starts the backoff over */
+    if (handle != NO_CLIENT && get_monotonic_nanosecs() - linked_at >= (uint64_t)RECONNECT_MAX_MS * NANOSECS_IN_MILLI)
+      backoff = RECONNECT_MIN_MS;
+
+    usleep(backoff * 1000);
+    backoff = (backoff * 2 < RECONNECT_MAX_MS) ? backoff * 2 : RECONNECT_MAX_MS;
+  }
+
+  return NULL;
+}
+
+/* Takes the link out of its room and the name map, it's relayed to from now on.
+   Callers hold client_lock - 1 if there are too many links */
+int register_peer(Client_handle handle) {
+  Client *client = client_map_get(&clients, handle);
+  int moved, keepalive = 1;
+
+  if (peer_link_count == MAX_PEER_LINKS) {
+    printf("Too many peer links, dropping %d\n", client->socket);
+    client->send_failed = true;
+    failed_clients[failed_count++] = handle;
+    return 1;
+  }
+
+  if (client->room_pos != -1 && (moved = remove_subscriber(client->room, client->room_pos)) != -1)
+    client_map_get(&clients, moved)->room_pos = client->room_pos;
+
+  client->room_pos = -1;
+
+  name_map_remove(&client_names, client->name, handle);
+  *client->name = '\0';
+
+  /* A quiet chat is a quiet link - the kernel probes it instead of our pings */
+  timer_cancel(&client->idle_timer);
+  setsockopt(client->socket, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+
+  client->peer = true;
+  peer_links[peer_link_count].handle = handle;
+  peer_links[peer_link_count++].filled = 0;
+
+  return 0;
+}
+
+/* Callers hold client_lock - the last link takes the freed place, its batch too */
+void unregister_peer(Client_handle handle) {
+  for (int i = 0; i < peer_link_count; i++) {
+    if (peer_links[i].handle != handle)
+      continue;
+
+    if (i != --peer_link_count)
+      memcpy(&peer_links[i], &peer_links[peer_link_count], sizeof(Peer_link));
+
+    break;
+  }
+
+  return;
+}
+
+/* "/peer <host id> <proof>" - a host that linked to us is answered the same
+   way, our own link's answer only says who is at the other end. The listener
+   has checked the proof already, anything that gets here without one is dropped */
+void handle_peer(char *args, Client_handle handle) {
+  Client *client = client_map_get(&clients, handle);
+  char answer[MAX_MSG_LEN], proof[PEER_PROOF_HEX], *ascii_packet;
+  uint32_t id;
+  int size;
+
+  if (!peer_proven(client, args, !client->outbound, &id)) {
+    printf("Refusing an unproven peer link from %d\n", client->socket);
+    client->send_failed = true;
+    failed_clients[failed_count++] = handle;
+    return;
+  }
+
+  if (client->outbound) {
+    printf("Linked to host %08" PRIx32 "\n", id);
+    return;
+  }
+
+  /* -P pointing back at us, or at a host that answers for us */
+  if (id == host_id) {
+    printf("Refusing a link from this host to itself\n");
+    client->send_failed = true;
+    failed_clients[failed_count++] = handle;
+    return;
+  }
+
+  if (register_peer(handle))
+    return;
+
+  peer_proof(client, host_id, false, proof);
+  snprintf(answer, MAX_MSG_LEN, "/" C_PEER " %08" PRIx32 " %s", host_id, proof);
+
+  Msg msg = compose_message(answer, "0", NULL);
+  ascii_packet = message_to_ascii_packet(&msg, &size);
+
+  send_to_client(handle, ascii_packet, size);
+  printf("Linked from host %08" PRIx32 "\n", id);
+
+  free(ascii_packet);
+
+  return;
+}
+
+/* The -F key's HMAC of the session and the way the message goes - it can't
+   be replayed on another link, nor sent back to the host it came from */
+void peer_proof(Client *client, uint32_t id, bool from_linker, char *proof) {
+  char nonce_hex[KEY_NONCE_HEX], data[MAX_BUFFER];
+  uint8_t mac[BYTES_IN_256];
+  int size;
+
+  bytes_to_hex(client->key_nonce, KEY_NONCE_BYTES, nonce_hex);
+  size = snprintf(
+      data, MAX_BUFFER, "%08" PRIx32 " %s %08" PRIx32 " %s",
+      client->salt, nonce_hex, id, (from_linker) ? "link" : "answer");
+
+  hmac_sha256(connection.peer_key, strlen(connection.peer_key), data, size, mac);
+  bytes_to_hex(mac, BYTES_IN_256, proof);
+
+  return;
+}
+
+/* True if "<host id> <proof>" holds up - never without a -F key. id may be NULL */
+bool peer_proven(Client *client, char *args, bool from_linker, uint32_t *id) {
+  char proof[PEER_PROOF_HEX], expected[PEER_PROOF_HEX];
+  uint32_t claimed;
+  int diff = 0;
+
+  if (*connection.peer_key == '\0' ||
+      sscanf(args, "%" SCNx32 " %64s", &claimed, proof) != 2 ||
+      strlen(proof) != PEER_PROOF_HEX - 1)
+    return false;
+
+  peer_proof(client, claimed, from_linker, expected);
+
+  /* Every byte, however early it's off */
+  for (int i = 0; i < PEER_PROOF_HEX - 1; i++)
+    diff |= proof[i] ^ expected[i];
+
+  if (id != NULL)
+    *id = claimed;
+
+  return diff == 0;
+}
+
+/* Batched for every link but the one it came over - a full batch goes out
+   as one frame right away. Broadcaster only, with client_lock held */
+void relay_to_peers(Msg *msg, char *ascii_packet, int size) {
+  Peer_link *link;
+
+  for (int i = 0; i < peer_link_count; i++) {
+    link = &peer_links[i];
+
+    if (link->handle == msg->via)
+      continue;
+
+    if (relay_append(link->batch, &link->filled, msg, ascii_packet, size)) {
+      send_to_client(link->handle, link->batch, link->filled);
+      link->filled = 0;
+
+      relay_append(link->batch, &link->filled, msg, ascii_packet, size);
+    }
+
+    stats_add(STAT_RELAYED, 1);
+  }
+
+  return;
+}
+
+/* End of a burst, before flush_output - a frame per link with what it got */
+void flush_peer_batches(void) {
+  for (int i = 0; i < peer_link_count; i++) {
+    if (peer_links[i].filled == 0)
+      continue;
+
+    send_to_client(peer_links[i].handle, peer_links[i].batch, peer_links[i].filled);
+    peer_links[i].filled = 0;
+  }
+
+  return;
+}
+
+/* Callers hold client_lock */
+void move_to_room(Client_handle handle, int room) {
+  Client *client = client_map_get(&clients, handle);
+  int moved = remove_subscriber(client->room, client->room_pos);
+
+  if (moved != -1)
+    client_map_get(&clients, moved)->room_pos = client->room_pos;
+
+  client->room = room;
+  client->room_pos = add_subscriber(room, handle);
+  client->joined_seq = next_seq;
+
+  if (client->ring)
+    tell_ring_room(handle, -1);
+
+  return;
+}
+
+/* O(1) - nothing else moves, stale handles are ignored */
+void handle_disconnect(Client_handle handle) {
+  char buffer[MAX_BUFFER];
+  Client client;
+  int moved;
+  bool room_open;
+
+  /* The engine's callbacks take client_lock, so it's held off first */
+  io_engine_pause();
+
+  /* Remove the client from the client map and its room */
+  pthread_mutex_lock(&client_lock);
+
+  if (client_map_get(&clients, handle) == NULL) {
+    pthread_mutex_unlock(&client_lock);
+    io_engine_resume();
+    return;  // already gone
+  }
+
+  /* Must be off the wheel before the slot can be reused */
+  timer_cancel(&client_map_get(&clients, handle)->idle_timer);
+  timer_cancel(&client_map_get(&clients, handle)->flush_timer);
+  timer_cancel(&client_map_get(&clients, handle)->throttle_timer);
+  client_map_remove(&clients, handle, &client);
+
+  /* Peer links are in no room, nor is a link of ours there were too many of */
+  if (client.peer)
+    unregister_peer(handle);
+  else if (client.room_pos != -1 && (moved = remove_subscriber(client.room, client.room_pos)) != -1)
+    client_map_get(&clients, moved)->room_pos = client.room_pos;
+
+  socket_handles[client.socket] = NO_CLIENT;
+  name_map_remove(&client_names, client.name, handle);
+
+  if (client.ring)
+    ring_readers--;
+
+  clear_frames(&client.out);  // a stale handle in dirty_clients is skipped
+  room_open = !client.peer && *rooms[client.room].name != '\0';
+
+  if (client.io_context != NULL)
+    io_engine_forget(client.socket, client.io_context);
+
+  pthread_mutex_unlock(&client_lock);
+  io_engine_resume();
+
+  /* Nobody can reach the client anymore */
+  snprintf(
+      buffer, MAX_BUFFER,
+      "Client(%d) has left the chat.",
+      client.socket);
+
+  /* Don't cancel yourself - an engine's listener is just freed */
+  if (client.io_context != NULL) {
+    free(((Listener *)client.io_context)->backlog);
+    free(client.io_context);
+  } else if (client.reading && pthread_self() != client.read_thread)
+    pthread_cancel(client.read_thread);
+
+  close(client.socket);
+  clean_session_ciphers(&client);
+
+  stats_add(STAT_DISCONNECTS, 1);
+  if (client.addr.sin_family == AF_INET)
+    recent_peers[client.addr.sin_addr.s_addr % RECENT_PEERS] = client.addr.sin_addr.s_addr;
+
+  /* Broadcast the lost boi - unless the room closed with them */
+  if (room_open)
+    presence_event(client.room, PRESENCE_LEFT, buffer);
+
+  return;
+}
+
+Client_handle find_client(int socket) {
+  if (socket < 0 || socket >= FD_SETSIZE)
+    return NO_CLIENT;
+
+  return socket_handles[socket];
+}
+
+/* Puts messages sent by client into a queue for broadcasts */
+void *message_listener(void *p_handle) {
+  Client_handle handle = *((Client_handle *)p_handle);
+  free(p_handle);
+
+  sigset_t handoff_signal, waiting_mask;
+
+  /* Only let in while waiting, so a handoff finds the listener between frames */
+  sigemptyset(&handoff_signal);
+  sigaddset(&handoff_signal, HANDOFF_SIGNAL);
+  pthread_sigmask(SIG_BLOCK, &handoff_signal, &waiting_mask);
+  sigdelset(&waiting_mask, HANDOFF_SIGNAL);
+
+  /* Slots never move, the pointer stays valid until the client is removed -
+     which cancels this thread. The listener start_reading left is taken over */
+  pthread_mutex_lock(&client_lock);
+
+  Client *client = client_map_get(&clients, handle);
+  Listener listener;
+
+  if (client != NULL) {
+    listener = *(Listener *)client->io_context;
+    free(client->io_context);
+    client->io_context = NULL;
+  }
+
+  pthread_mutex_unlock(&client_lock);
+
+  if (client == NULL)
+    return NULL;
+
+  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+  int socket = listener.socket;
+  fd_set connected_socks, ready_socks;
+
+  /* Initialize structs */
+  FD_ZERO(&connected_socks);
+  FD_SET(socket, &connected_socks);
+
+  ssize_t received_bytes;
+
+  while (true) {
+    if (__atomic_load_n(&handing_off, __ATOMIC_ACQUIRE)) {
+      park_listener(&listener);
+      return NULL;
+    }
+
+    ready_socks = connected_socks;
+
+    /* Silent peers are pinged and dropped by the timer wheel */
+    if (pselect(socket + 1, &ready_socks, NULL, NULL, NULL, &waiting_mask) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      HANDLE_ERROR("There was problem with read select", 1);
+    }
+
+    if (FD_ISSET(socket, &ready_socks)) {
+      STATS_TIME(
+          received_bytes = recv_frames(socket, &listener.reader);
+          , STAGE_RECV)
+
+      stats_add(STAT_RECV_CALLS, 2);  // the select and the recv
+
+      /* There was a connection error or it was orderly closed */
+      if (received_bytes <= 0) {
+        handle_disconnect(handle);
+
+        return NULL;
+      }
+
+      stats_add(STAT_BYTES_IN, received_bytes);
+      __atomic_store_n(&client->last_heard, get_monotonic_nanosecs(), __ATOMIC_RELAXED);
+
+      if (process_frames(&listener))
+        return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+/* Handing off - the listener goes back to the client, where the export finds
+   it like an engine's, and the thread ends */
+void park_listener(Listener *listener) {
+  Listener *parked;
+
+  if ((parked = (Listener *)malloc(sizeof(Listener))) == NULL) {
+    HANDLE_ERROR("Failed to allocate memory for a listener", 1);
+  }
+
+  *parked = *listener;
+
+  pthread_mutex_lock(&client_lock);
+
+  Client *client = client_map_get(&clients, listener->handle);
+
+  if (client != NULL) {
+    client->io_context = parked;
+    client->reading = false;
+  } else {
+    free(parked);
+  }
+
+  pthread_mutex_unlock(&client_lock);
+
+  return;
+}
+
+/* Only there to cut a listener's pselect short */
+void wake_listener(int _) {
+  return;
+}
+
+/* Called with client_lock held */
+void init_listener(Listener *listener, Client_handle handle, Client *client) {
+  listener->handle = handle;
+  listener->client = client;
+  listener->socket = client->socket;
+  listener->peer = false;
+  listener->held = false;
+  listener->backlog = NULL;
+  listener->backlog_size = 0;
+
+  /* A link we opened is answered like a client until the other host takes it */
+  listener->reader = (Frame_reader){
+      .filled = 0, .offset = 0,
+      .max_payload = (client->outbound) ? MAX_BATCH_SIZE : MAX_MSG_SIZE};
+  listener->rate_limited = !client->outbound && (connection.rate_msgs > 0 || connection.rate_bytes > 0);
+  memset(listener->tickets, 0, sizeof(listener->tickets));
+
+  rate_limit_init(&listener->limit, connection.rate_msgs, connection.rate_bytes);
+
+  return;
+}
+
+/* Queues every whole frame in the reader - 1 if the client was dropped,
+   the listener is gone then when the engine owns it */
+int process_frames(Listener *listener) {
+  Client *client = listener->client;
+  int socket = listener->socket, frame_size, status;
+  size_t start;
+  uint64_t wait;
+  char *frame, *packet;
+  Msg msg;
+  Lane lane;
+
+  for (start = listener->reader.offset;
+       (status = next_frame(&listener->reader, &frame, &frame_size)) == 1;
+       start = listener->reader.offset) {
+    if (frame_size < MIN_PACKET_SIZE) {
+      stats_add(STAT_DROPS, 1);
+      continue;  //rejected, malformed size
+    }
+
+    /* An event loop can't wait - the frame is put back and the socket is held
+       until the buckets refill, the wheel takes it up again */
+    if (listener->rate_limited && connection.rate_kick == 0 && connection.io_engine != IO_THREADS) {
+      if ((wait = rate_limit_wait(&listener->limit, frame_size)) > 0) {
+        listener->reader.offset = start;
+        listener->held = true;
+        io_engine_hold(socket, listener);
+        timer_arm(&client->throttle_timer, (wait + NANOSECS_IN_MILLI - 1) / NANOSECS_IN_MILLI);
+
+        return 0;
+      }
+
+    /* Checked before paying for the decryption - a listener thread may sleep on it */
+    } else if (listener->rate_limited &&
+               rate_limit_admit(&listener->limit, frame_size, connection.rate_kick == 0)) {
+      /* Dropped without decrypting, so nothing checks that the sender really used
+         this counter - it's assumed, for the next frame to line up. Bytes spliced
+         into the stream would cost the session its sync, not let anything in */
+      client->ctr++;
+      stats_add(STAT_DROPS, 1);
+
+      if (listener->limit.drops >= connection.rate_kick) {
+        printf("Kicking %d for flooding\n", socket);
+        stats_add(STAT_FLOOD_KICKS, 1);
+        handle_disconnect(listener->handle);
+
+        return 1;
+      }
+
+      continue;
+    }
+
+    STATS_TIME(
+        packet = decrypt_packet(
+            frame,
+            &client->recv_cipher, RECV_SALT(client), client->ctr++);
+        , STAGE_DECRYPT)
+
+    if (packet == NULL) {
+      stats_add(STAT_DROPS, 1);
+      printf("Malformed message from %d\n", socket);
+      continue;
+    }
+
+    /* Another host's batch, not for the capture - replays are of clients */
+    if (listener->peer) {
+      queue_relayed(listener, packet, packet_payload_size(frame));
+      free(packet);
+      continue;
+    }
+
+    stats_add(STAT_MSGS_IN, 1);
+    capture_frame(socket, packet, packet_payload_size(frame));
+
+    msg = ascii_packet_to_message(packet, packet_payload_size(frame));
+    snprintf(msg.id, ID_SIZE, "%d", socket);
+    msg.sender = listener->handle;
+    free(packet);
+
+    /* "/peer <host id> <proof>" - a host linking to us, or taking our link.
+       Relay batches follow, the broadcaster hears of it in line with them.
+       Limited like any client until the proof holds, and dropped if it doesn't */
+    if (!strncmp(msg.msg, "/" C_PEER, strlen(C_PEER) + 1) &&
+        (msg.msg[strlen(C_PEER) + 1] == ' ' || msg.msg[strlen(C_PEER) + 1] == '\0')) {
+      if (!peer_proven(client, msg.msg + strlen(C_PEER) + 1, !client->outbound, NULL)) {
+        printf("Refusing an unproven peer link from %d\n", socket);
+        stats_add(STAT_DROPS, 1);
+        handle_disconnect(listener->handle);
+
+        return 1;
+      }
+
+      listener->peer = true;
+      listener->reader.max_payload = MAX_BATCH_SIZE;
+      listener->rate_limited = false;
+
+    } else if (client->outbound) {
+      continue;  // sent to our link while it was still taken for a client
+    }
+
+    lane = lane_for(&msg);
+
+    pthread_mutex_lock(&r_lock);
+
+    /* Never ahead of the client's own messages still waiting in a slower lane -
+       a line typed after a /join goes to the new room */
+    for (int slower = LANE_COUNT - 1; slower > lane; slower--) {
+      if (lane_holds(&out_queue, slower, listener->tickets[slower])) {
+        lane = slower;
+        break;
+      }
+    }
+
+    listener->tickets[lane] = lane_push(&out_queue, msg, lane);
+    pthread_cond_signal(&message_ready);
 
     pthread_mutex_unlock(&r_lock);
+  }
+
+  /* Frame boundaries are lost, nothing after this can be trusted */
+  if (status == -1) {
+    stats_add(STAT_DROPS, 1);
+    handle_disconnect(listener->handle);
+
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Every record of a peer's batch goes to the broadcaster, which drops the copies */
+void queue_relayed(Listener *listener, char *batch, int size) {
+  int offset = 0, status;
+  Msg msg;
+
+  pthread_mutex_lock(&r_lock);
+
+  while ((status = relay_next(batch, size, &offset, &msg)) == 1) {
+    snprintf(msg.id, ID_SIZE, "%s", "00");  // a socket on the origin, nobody here
+    msg.via = listener->handle;
+
+    lane_push(&out_queue, msg, LANE_CHAT);
+    stats_add(STAT_MSGS_IN, 1);
+  }
+
+  pthread_cond_signal(&message_ready);
+
+  pthread_mutex_unlock(&r_lock);
+
+  if (status == -1)
+    stats_add(STAT_DROPS, 1);
+
+  return;
+}
+
+/* Runs on the io engine - the same as a listener thread, minus the reading */
+void on_client_data(void *context, char *data, ssize_t size) {
+  Listener *listener = (Listener *)context;
+
+  /* There was a connection error or it was orderly closed */
+  if (size <= 0) {
+    handle_disconnect(listener->handle);
+    return;
+  }
+
+  stats_add(STAT_BYTES_IN, size);
+  __atomic_store_n(&listener->client->last_heard, get_monotonic_nanosecs(), __ATOMIC_RELAXED);
+
+  feed_listener(listener, data, size);
+
+  return;
+}
+
+/* More than the reader takes at once is split, frames are taken out in between.
+   A held listener keeps the rest for later - 1 if the client was dropped */
+int feed_listener(Listener *listener, char *data, size_t size) {
+  size_t appended;
+  char *backlog;
+
+  while (size > 0) {
+    if (listener->held) {
+      /* Still flooding after the hold - nothing more is kept for it */
+      if (listener->backlog_size + size > HOLD_BACKLOG_BYTES) {
+        printf("Kicking %d for flooding\n", listener->socket);
+        stats_add(STAT_FLOOD_KICKS, 1);
+        handle_disconnect(listener->handle);
+        return 1;
+      }
+
+      if ((backlog = (char *)realloc(listener->backlog, listener->backlog_size + size)) == NULL) {
+        HANDLE_ERROR("Failed to allocate memory for a held listener", 1);
+      }
+
+      memcpy(backlog + listener->backlog_size, data, size);
+      listener->backlog = backlog;
+      listener->backlog_size += size;
+
+      return 0;
+    }
+
+    appended = frame_reader_append(&listener->reader, data, size);
+    data += appended;
+    size -= appended;
+
+    if (process_frames(listener))
+      return 1;
+
+    /* Full of a frame that never ends - the same as a broken boundary */
+    if (appended == 0 && !listener->held) {
+      stats_add(STAT_DROPS, 1);
+      handle_disconnect(listener->handle);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Frames put back by a hold, then the backlog - it may be held again on the way.
+   Callers have the engine paused, which keeps the listener from being freed */
+int unhold_listener(Listener *listener) {
+  char *backlog = listener->backlog;
+  size_t backlog_size = listener->backlog_size;
+  int dropped;
+
+  listener->held = false;
+  listener->backlog = NULL;
+  listener->backlog_size = 0;
+
+  dropped = process_frames(listener) || feed_listener(listener, backlog, backlog_size);
+  free(backlog);
+
+  return dropped;
+}
+
+/* The engine's listener of a client it holds, NULL if there's none. Paused callers only */
+Listener *held_listener(Client_handle handle) {
+  Listener *listener = NULL;
+  Client *client;
+
+  pthread_mutex_lock(&client_lock);
+
+  if ((client = client_map_get(&clients, handle)) != NULL && !client->reading &&
+      client->io_context != NULL && ((Listener *)client->io_context)->held)
+    listener = (Listener *)client->io_context;
+
+  pthread_mutex_unlock(&client_lock);
+
+  return listener;
+}
+
+/* Runs on the timer wheel - the buckets have refilled, the socket is read again
+   unless its frames ran dry of tokens once more. A handoff takes them up itself */
+void release_throttle(void *p_handle) {
+  Client_handle handle = (Client_handle)(intptr_t)p_handle;
+  Listener *listener;
+
+  io_engine_pause();
+
+  if ((listener = held_listener(handle)) != NULL && !__atomic_load_n(&handing_off, __ATOMIC_ACQUIRE) &&
+      !unhold_listener(listener) && !listener->held)
+    io_engine_release(listener->socket, listener);
+
+  io_engine_resume();
+
+  return;
+}
+
+/* Runs on the broadcaster with client_lock held, so commands apply in message order */
+void handle_client_command(Msg *msg, Client_handle handle) {
+  char command[MAX_MSG_LEN], args[MAX_MSG_LEN] = "";
+
+  sscanf(msg->msg + 1, "%s %s", command, args);
+
+  if (!strcmp(command, C_JOIN) || !strcmp(command, C_LEAVE)) {
+    handle_room_command(command, args, handle);
+
+  } else if (!strcmp(command, C_DIRECT_MSG)) {
+    route_direct_message(msg, handle);
 
-    ascii_packet = message_to_ascii_packet(outgoing_msg, &size);
+  } else if (!strcmp(command, C_RESUME)) {
+    handle_resume(msg->msg + 1 + strlen(C_RESUME), handle);
 
-    for (int i = 0; i < client_index; i++) {
+  } else if (!strcmp(command, C_PING)) {
+    reply_to_client(handle, "/" C_PONG);
+
+  } else if (!strcmp(command, C_PONG)) {
+    return;  // hearing from the client was the point
+
+  } else if (!strcmp(command, C_RING)) {
+    grant_ring(handle);
+
+  } else if (!strcmp(command, C_PEER)) {
+    handle_peer(msg->msg + 1 + strlen(C_PEER), handle);
+
+  } else if (!strcmp(command, C_CHANGE_USERNAME)) {
+    return;  // the name was already taken from the message
+
+  } else {
+    reply_to_client(handle, "Invalid command.");
+  }
+
+  return;
+}
+
+void handle_room_command(char *command, char *args, Client_handle handle) {
+  int room;
+
+  if (!strcmp(command, C_JOIN) && *args != '\0') {
+    args[MAX_ROOM_NAME - 1] = '\0';
+    room = open_room(args);
+
+  } else if (!strcmp(command, C_LEAVE)) {
+    room = LOBBY_ROOM;
+
+  } else {
+    return;
+  }
+
+  if (room == -1) {
+    reply_to_client(handle, "Too many rooms open.");
+    return;
+  }
+
+  if (room != client_map_get(&clients, handle)->room)
+    switch_room(handle, room, 0);
+
+  return;
+}
+
+/* "/resume <last seen seq> [room]" - first thing a client sends, reconnected or not.
+   Puts it back into its room and sends what it missed from the room's history */
+void handle_resume(char *args, Client_handle handle) {
+  char name[MAX_ROOM_NAME] = "";
+  uint64_t after = 0;
+  int room = LOBBY_ROOM;
+
+  sscanf(args, "%" SCNu64 " %19s", &after, name);
+
+  if (*name != '\0' && (room = open_room(name)) == -1) {
+    reply_to_client(handle, "Too many rooms open.");
+    room = LOBBY_ROOM;
+  }
+
+  if (room != client_map_get(&clients, handle)->room)
+    switch_room(handle, room, after);
+  else
+    send_history(handle, room, after);
+
+  return;
+}
+
+/* Moves the client and catches it up on the new room */
+void switch_room(Client_handle handle, int room, uint64_t after) {
+  char buffer[MAX_BUFFER];
+  Client *client = client_map_get(&clients, handle);
+  int old_room = client->room;
+
+  move_to_room(handle, room);
+  send_history(handle, room, after);
+
+  if (*rooms[old_room].name != '\0') {
+    snprintf(
+        buffer, MAX_BUFFER, "Client(%d) left for %s.",
+        client->socket, rooms[room].name);
+    presence_event(old_room, PRESENCE_LEFT, buffer);
+  }
+
+  snprintf(
+      buffer, MAX_BUFFER, "Client(%d) joined %s.",
+      client->socket, rooms[room].name);
+  presence_event(room, PRESENCE_JOINED, buffer);
+
+  return;
+}
+
+/* "/msg <name|id> text" - encrypted and sent once, for the recipient only */
+void route_direct_message(Msg *msg, Client_handle handle) {
+  char target[MAX_USERNAME_LEN], buffer[MAX_BUFFER], *ascii_packet;
+  int text_offset = 0, size;
+  Client_handle target_handle;
+
+  if (sscanf(msg->msg + 1, "%*s %19s %n", target, &text_offset) < 1 || text_offset == 0) {
+    reply_to_client(handle, "Usage: /msg <name|id> message");
+    return;
+  }
+
+  /* Ids are sockets, anything else is looked up by name */
+  if (strspn(target, "0123456789") == strlen(target))
+    target_handle = find_client(atoi(target));
+  else
+    target_handle = name_map_get(&client_names, target);
+
+  /* Users on peered hosts can't be told apart by name or id here */
+  if (client_map_get(&clients, target_handle) == NULL || client_map_get(&clients, target_handle)->peer) {
+    snprintf(buffer, MAX_BUFFER, "No such user: %s", target);
+    reply_to_client(handle, buffer);
+    return;
+  }
+
+  Msg direct_msg = compose_message(NULL, msg->id, msg->username);
+  snprintf(direct_msg.msg, MAX_MSG_LEN, DIRECT_MSG_FORMAT, msg->msg + 1 + text_offset);
+
+  STATS_TIME(
+      ascii_packet = message_to_ascii_packet(&direct_msg, &size);
+      , STAGE_ENCODE)
+
+  send_to_client(target_handle, ascii_packet, size);
+
+  free(ascii_packet);
+
+  return;
+}
+
+/* System message for one client only */
+void reply_to_client(Client_handle handle, char *text) {
+  Msg reply = compose_message(text, "0", "/7:Server");
+  int size;
+  char *ascii_packet = message_to_ascii_packet(&reply, &size);
+
+  send_to_client(handle, ascii_packet, size);
+
+  free(ascii_packet);
+
+  return;
+}
+
+/* "/ring" from a unix client - the memfd goes along with the reply */
+void grant_ring(Client_handle handle) {
+  Client *client = client_map_get(&clients, handle);
+
+  if (ring_memfd() == -1 || client->addr.sin_family == AF_INET) {
+    reply_to_client(handle, "Shared ring unavailable.");
+    return;
+  }
+
+  if (!client->ring) {
+    client->ring = true;
+    ring_readers++;
+  }
+
+  tell_ring_room(handle, ring_memfd());
+
+  return;
+}
+
+/* "/ring <position> <room>" - the room's broadcasts from position on are in the ring.
+   Callers hold client_lock, nothing is published in between */
+void tell_ring_room(Client_handle handle, int passed_fd) {
+  char text[MAX_MSG_LEN], *ascii_packet;
+  int size;
+
+  snprintf(
+      text, MAX_MSG_LEN, "/" C_RING " %" PRIu64 " %d",
+      ring_head(), client_map_get(&clients, handle)->room);
+
+  Msg reply = compose_message(text, "0", "/7:Server");
+  ascii_packet = message_to_ascii_packet(&reply, &size);
+
+  send_to_client_with_fd(handle, ascii_packet, size, passed_fd);
+
+  free(ascii_packet);
+
+  return;
+}
+
+/* Sealed once for every local reader - the AAD counter is the slot's position */
+void publish_to_ring(int room, char *ascii_packet, int size) {
+  int new_size;
+  char *enc_packet;
+
+  STATS_TIME(
+      enc_packet = encrypt_packet(
+          ascii_packet,
+          size, &new_size,
+          &ring_cipher, ring_salt(), ring_head() + 1);
+      , STAGE_ENCRYPT)
+
+  ring_publish(room, enc_packet, new_size);
+  stats_add(STAT_RING_FRAMES, 1);
+
+  free(enc_packet);
+
+  return;
+}
+
+/* Names come with every message - remember the latest for direct messages.
+   A name belongs to whoever took it first, until they drop it. 1 when a new
+   name is someone else's, -1 when there is no room for it - only on the
+   message that changed it, later ones just try again quietly */
+int update_client_name(Client_handle handle, char *username) {
+  char name[MAX_USERNAME_LEN];
+  Client *client = client_map_get(&clients, handle);
+  int holder;
+  bool renamed;
+
+  strip_username_colors(name, username);
+
+  if ((renamed = strcmp(name, client->name))) {
+    name_map_remove(&client_names, client->name, handle);
+    snprintf(client->name, MAX_USERNAME_LEN, "%s", name);
+  }
+
+  if (*name == '\0' || (holder = name_map_get(&client_names, name)) == handle)
+    return 0;
+
+  if (holder != -1)
+    return (renamed) ? 1 : 0;
+
+  if (name_map_put(&client_names, name, handle))
+    return (renamed) ? -1 : 0;
+
+  return 0;
+}
+
+/* Broadcaster only, with client_lock held - failures are queued for disconnect */
+int send_to_client(Client_handle handle, char *ascii_packet, int size) {
+  return send_to_client_with_fd(handle, ascii_packet, size, -1);
+}
+
+/* Queued for the end of the burst - passed_fd -1 is the usual case, a frame
+   carrying an fd goes out right away after whatever was queued before it */
+int send_to_client_with_fd(Client_handle handle, char *ascii_packet, int size, int passed_fd) {
+  Client *client = client_map_get(&clients, handle);
+  int new_size;
+  ssize_t sent;
+  char *enc_packet;
+
+  if (client->send_failed)
+    return -1;
+
+  STATS_TIME(
       enc_packet = encrypt_packet(
           ascii_packet,
           size, &new_size,
-          &clients[i].aes_gcm_handle, ++msg_count);
+          &client->send_cipher, SEND_SALT(client), ++client->send_ctr);
+      , STAGE_ENCRYPT)
+
+  if (passed_fd == -1)
+    return queue_sealed(handle, enc_packet, new_size);
+
+  flush_client(handle, false);
+
+  /* The fd can't pass frames the socket is still holding back */
+  if (client->out.count > 0 && !client->send_failed) {
+    stats_add(STAT_DROPS, client->out.count);
+    clear_frames(&client->out);
+    client->send_failed = true;
+    failed_clients[failed_count++] = handle;
+  }
+
+  if (client->send_failed) {
+    free(enc_packet);
+    return -1;
+  }
+
+  STATS_TIME(
+      sent = send_with_fd(client->socket, enc_packet, new_size, passed_fd);
+      , STAGE_SEND)
+
+  free(enc_packet);
+
+  if (sent == -1) {
+    stats_add(STAT_DROPS, 1);
+    client->send_failed = true;
+    failed_clients[failed_count++] = handle;
+    return -1;
+  }
+
+  stats_add(STAT_BYTES_OUT, sent);
+  stats_add(STAT_MSGS_OUT, 1);
+
+  return 0;
+}
+
+/* Queued for the end of the burst - the frame is taken, freed if the client is failing */
+int queue_sealed(Client_handle handle, char *enc_packet, int new_size) {
+  Client *client = client_map_get(&clients, handle);
+
+  if (client->send_failed) {
+    free(enc_packet);
+    return -1;
+  }
+
+  queue_frame(&client->out, enc_packet, new_size);
+
+  if (!client->dirty) {
+    if (dirty_count == CLIENT_SLOTS)
+      flush_output();  // only with stale handles piling up
+
+    client->dirty = true;
+    dirty_clients[dirty_count++] = handle;
+  }
+
+  if (client->out.count == OUT_MAX_FRAMES)
+    flush_client(handle, false);
+
+  return (client->send_failed) ? -1 : 0;
+}
+
+/* A burst that doesn't fit one sendmsg is corked until it ends, so the
+   kernel sends full segments instead of one per flush. Nothing blocks on a
+   full socket, the rest waits for its retry timer. Callers hold client_lock */
+void flush_client(Client_handle handle, bool burst_over) {
+  Client *client = client_map_get(&clients, handle);
+  int frames = client->out.count, cork = !burst_over;
+  ssize_t sent;
+
+  if (frames > 0 && !burst_over && !client->corked && client->addr.sin_family == AF_INET) {
+    setsockopt(client->socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    stats_add(STAT_SEND_CALLS, 1);
+    client->corked = true;
+  }
+
+  if (frames > 0) {
+    STATS_TIME(
+        sent = send_frames(client->socket, &client->out, MSG_DONTWAIT);
+        , STAGE_SEND)
+
+    if (note_flushed(handle, frames - client->out.count, sent) || note_backlog(handle))
+      return;
+  }
+
+  if (burst_over && client->corked) {
+    setsockopt(client->socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    stats_add(STAT_SEND_CALLS, 1);
+    client->corked = false;
+  }
 
-      if (send(clients[i].socket, enc_packet, new_size, MSG_NOSIGNAL) == -1) {
-        handle_disconnect(i);
+  return;
+}
+
+/* 1 if the send failed - the client is disconnected after the burst */
+int note_flushed(Client_handle handle, int frames, ssize_t sent) {
+  if (sent == -1) {
+    stats_add(STAT_DROPS, frames);
+    client_map_get(&clients, handle)->send_failed = true;
+    failed_clients[failed_count++] = handle;
+    return 1;
+  }
+
+  stats_add(STAT_BYTES_OUT, sent);
+  stats_add(STAT_MSGS_OUT, frames);
+
+  return 0;
+}
+
+/* What a full socket didn't take is tried again soon - a client that lets a whole
+   queue pile up is too slow to keep, it's disconnected after the burst */
+int note_backlog(Client_handle handle) {
+  Client *client = client_map_get(&clients, handle);
+
+  if (client->out.count == 0)
+    return 0;
+
+  if (client->out.count == OUT_MAX_FRAMES) {
+    printf("Client(%d) fell behind\n", client->socket);
+    stats_add(STAT_DROPS, client->out.count);
+    clear_frames(&client->out);
+    client->send_failed = true;
+    failed_clients[failed_count++] = handle;
+    return 1;
+  }
+
+  timer_arm(&client->flush_timer, FLUSH_RETRY_MS);
+
+  return 0;
+}
+
+/* Runs on the timer wheel - another go at a backlog */
+void retry_flush(void *p_handle) {
+  Client_handle handle = (Client_handle)(intptr_t)p_handle, failed[CLIENT_SLOTS];
+  int failed_total;
+
+  pthread_mutex_lock(&client_lock);
+
+  Client *client = client_map_get(&clients, handle);
+
+  /* Left while the timer fired */
+  if (client == NULL || client->send_failed || client->out.count == 0) {
+    pthread_mutex_unlock(&client_lock);
+    return;
+  }
+
+  flush_client(handle, true);
+  failed_total = take_failed_sends(failed);
+
+  pthread_mutex_unlock(&client_lock);
+
+  for (int i = 0; i < failed_total; i++)
+    handle_disconnect(failed[i]);
+
+  return;
+}
+
+/* End of a burst - every client's frames in one go. Callers hold client_lock */
+void flush_output(void) {
+  static Client_handle handles[CLIENT_SLOTS];
+  static Out_queue *queues[CLIENT_SLOTS];
+  static int sockets[CLIENT_SLOTS], frames[CLIENT_SLOTS];
+  static ssize_t results[CLIENT_SLOTS];
+  Client *client;
+  int count = 0;
+
+  for (int i = 0; i < dirty_count; i++) {
+    if ((client = client_map_get(&clients, dirty_clients[i])) == NULL)
+      continue;  // left with frames queued
+
+    client->dirty = false;
+
+    if (client->send_failed)
+      continue;
+
+    /* io_uring takes the whole burst in one submission */
+    if (connection.io_engine == IO_URING && client->out.count > 0) {
+      handles[count] = dirty_clients[i];
+      queues[count] = &client->out;
+      sockets[count] = client->socket;
+      frames[count++] = client->out.count;
+
+    } else {
+      flush_client(dirty_clients[i], true);
+    }
+  }
+
+  dirty_count = 0;
+
+  if (count == 0)
+    return;
+
+  STATS_TIME(
+      io_engine_send(sockets, queues, results, count);
+      , STAGE_SEND)
+
+  /* Another try at what didn't fit, then the cork */
+  for (int i = 0; i < count; i++) {
+    if (!note_flushed(handles[i], frames[i] - queues[i]->count, results[i]))
+      flush_client(handles[i], true);
+  }
+
+  return;
+}
+
+bool queue_is_empty(void) {
+  bool empty;
+
+  pthread_mutex_lock(&r_lock);
+  empty = lane_queue_is_empty(&out_queue);
+  pthread_mutex_unlock(&r_lock);
+
+  return empty;
+}
+
+/* Catches a joiner up on the room - the stored packets after the given sequence, up to
+   the ones it got live, go out a batch per frame.
+   Callers hold client_lock, which keeps the frames in line with broadcasts */
+void send_history(Client_handle handle, int room, uint64_t after) {
+  static char batch[MAX_BATCH_SIZE];
+  uint64_t before = client_map_get(&clients, handle)->joined_seq;
+  int size, next = 0;
+
+  while ((size = history_batch(&rooms[room].history, &next, after, before, batch, MAX_BATCH_SIZE)) > 0)
+    send_to_client(handle, batch, size);
+
+  return;
+}
+
+/* Callers hold client_lock - the clients are disconnected once it is released */
+int take_failed_sends(Client_handle *failed) {
+  int failed_total = failed_count;
+
+  memcpy(failed, failed_clients, failed_count * sizeof(Client_handle));
+  failed_count = 0;
+
+  return failed_total;
+}
+
+/* Runs on the timer wheel - pings a quiet client, drops a silent one */
+void check_idle(void *p_handle) {
+  Client_handle handle = (Client_handle)(intptr_t)p_handle, failed[CLIENT_SLOTS];
+  uint64_t ping_after = (uint64_t)connection.idle_timeout * NANOSECS_IN_SEC / 3;
+  uint64_t drop_after = (uint64_t)connection.idle_timeout * NANOSECS_IN_SEC, silent;
+  bool timed_out = false;
+  int failed_total, socket;
+
+  pthread_mutex_lock(&client_lock);
+
+  Client *client = client_map_get(&clients, handle);
+
+  /* Left while the timer fired, or became a peer link - TCP keeps those alive */
+  if (client == NULL || client->peer) {
+    pthread_mutex_unlock(&client_lock);
+    return;
+  }
+
+  socket = client->socket;
+  silent = get_monotonic_nanosecs() - __atomic_load_n(&client->last_heard, __ATOMIC_RELAXED);
+
+  if (silent < ping_after) {
+    client->pinged = false;
+    timer_arm(&client->idle_timer, (ping_after - silent) / NANOSECS_IN_MILLI);
+
+  } else if (silent < drop_after) {
+    if (!client->pinged) {
+      reply_to_client(handle, "/" C_PING);
+      client->pinged = true;
+    }
+
+    timer_arm(&client->idle_timer, (drop_after - silent) / NANOSECS_IN_MILLI);
+
+  } else {
+    timed_out = true;
+  }
+
+  flush_output();
+  failed_total = take_failed_sends(failed);
+
+  pthread_mutex_unlock(&client_lock);
+
+  if (timed_out) {
+    printf("Client(%d) timed out\n", socket);
+    stats_add(STAT_TIMEOUTS, 1);
+    handle_disconnect(handle);
+  }
+
+  for (int i = 0; i < failed_total; i++)
+    handle_disconnect(failed[i]);
+
+  return;
+}
+
+/* Broadcasts every message to the subscribers of its room */
+/* Sealed for everyone at once, possibly on several threads, then queued in
+   subscriber order - each client's counter was taken for its frame before
+   the run, so frames still line up. Callers hold client_lock */
+void fan_out(Room *room, char *ascii_packet, int size) {
+  static Seal_job jobs[CLIENT_SLOTS];
+  static Client_handle recipients[CLIENT_SLOTS];
+  Client *client;
+  int count = 0;
+
+  for (int i = 0; i < room->subscriber_count; i++) {
+    client = client_map_get(&clients, room->subscribers[i]);
+
+    if ((ring_readers > 0 && client->ring) || client->send_failed)
+      continue;
+
+    recipients[count] = room->subscribers[i];
+    jobs[count++] = (Seal_job){
+        .handle = &client->send_cipher,
+        .salt = SEND_SALT(client),
+        .ctr = ++client->send_ctr};
+  }
+
+  seal_all(jobs, count, ascii_packet, size);
+
+  for (int i = 0; i < count; i++)
+    queue_sealed(recipients[i], jobs[i].frame, jobs[i].frame_size);
+
+  return;
+}
+
+void *broadcast_message(void *_) {
+  Msg *outgoing_msg;
+  Room *room;
+  int size, failed_total;
+  Client_handle failed[CLIENT_SLOTS];
+  Client *sender;
+  char *ascii_packet = NULL;
+  int burst = 0;
+
+  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+  while (true) {
+    pthread_mutex_lock(&r_lock);
+
+    while ((outgoing_msg = lane_pop(&out_queue)) == NULL) {
+      /* Handing off - whatever was queued has gone out */
+      if (stop_when_drained) {
+        pthread_mutex_unlock(&r_lock);
+        return NULL;
       }
 
-      free(enc_packet);
+      pthread_cond_wait(&message_ready, &r_lock);
+    }
+
+    pthread_mutex_unlock(&r_lock);
+
+    stats_record(STAGE_QUEUE_WAIT, get_monotonic_nanosecs() - outgoing_msg->queued_at);
+
+    pthread_mutex_lock(&client_lock);
+
+    /* Client messages go to the sender's current room, commands are run here */
+    if (outgoing_msg->sender != -1) {
+      if ((sender = client_map_get(&clients, outgoing_msg->sender)) == NULL)
+        goto done;  // the sender has left
+
+      switch (update_client_name(outgoing_msg->sender, outgoing_msg->username)) {
+        case 1:
+          reply_to_client(outgoing_msg->sender, "That name is taken - direct messages won't reach you by it.");
+          break;
+
+        case -1:
+          reply_to_client(outgoing_msg->sender, "Too many names - direct messages won't reach you by yours.");
+          break;
+      }
+
+      if (*outgoing_msg->msg == '/') {
+        handle_client_command(outgoing_msg, outgoing_msg->sender);
+        goto done;
+      }
+
+      outgoing_msg->room = sender->room;
+
+      /* Chat is relayed under an id of ours */
+      outgoing_msg->origin = host_id;
+      outgoing_msg->origin_seq = ++relay_seq;
+      snprintf(outgoing_msg->room_name, MAX_ROOM_NAME, "%s", rooms[sender->room].name);
+    }
+
+    /* From a peer - the first copy only, and into the room if it's open here */
+    if (outgoing_msg->via != NO_CLIENT) {
+      if (outgoing_msg->origin == host_id || !relay_is_new(outgoing_msg->origin, outgoing_msg->origin_seq)) {
+        stats_add(STAT_RELAY_DUPS, 1);
+        goto done;
+      }
+
+      outgoing_msg->room = find_room(outgoing_msg->room_name);
+    }
+
+    outgoing_msg->seq = next_seq++;
+
+    STATS_TIME(
+        ascii_packet = message_to_ascii_packet(outgoing_msg, &size);
+        , STAGE_ENCODE)
+
+    /* Once per peer, whoever is there - announcements stay on their host */
+    if (outgoing_msg->origin != 0 && peer_link_count > 0)
+      relay_to_peers(outgoing_msg, ascii_packet, size);
+
+    if (outgoing_msg->room == -1)
+      goto done;  // nobody here is in the room
+
+    room = &rooms[outgoing_msg->room];
+
+    /* Chat only - joiners don't need the join/leave noise */
+    if (outgoing_msg->origin != 0)
+      history_append(&room->history, ascii_packet, size, outgoing_msg->seq);
+
+    msg_log_append(room->name, ascii_packet, size);
+
+    /* Once for all local readers, whatever room they are in */
+    if (ring_readers > 0)
+      publish_to_ring(outgoing_msg->room, ascii_packet, size);
+
+    fan_out(room, ascii_packet, size);
+
+  done:
+    /* The burst is over when the queue runs dry - client_lock -> r_lock is fine */
+    if (++burst == OUT_BURST_MSGS || queue_is_empty()) {
+      flush_peer_batches();
+      flush_output();
+      burst = 0;
     }
 
+    failed_total = take_failed_sends(failed);
+
+    pthread_mutex_unlock(&client_lock);
+
+    /* Disconnecting takes client_lock itself */
+    for (int i = 0; i < failed_total; i++)
+      handle_disconnect(failed[i]);
+
     free(outgoing_msg);
     free(ascii_packet);
+    ascii_packet = NULL;
   }
 }
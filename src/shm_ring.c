@@ -0,0 +1,171 @@
+#define _GNU_SOURCE  // memfd_create, file seals
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <inc/crypt.h>
+#include <inc/general.h>
+#include <inc/setting.h>
+#include <inc/shm_ring.h>
+
+/* Written by the broadcaster only - no locking */
+Ring *ring = NULL;
+int ring_fd = -1;
+
+int ring_open(uint32_t salt, int suite, const uint8_t *key_nonce) {
+  if ((ring_fd = memfd_create("clm-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+    fprintf(stderr, "Failed to create the shared ring - %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (ftruncate(ring_fd, sizeof(Ring))) {
+    fprintf(stderr, "Failed to size the shared ring - %s\n", strerror(errno));
+    close(ring_fd);
+    ring_fd = -1;
+    return 1;
+  }
+
+  ring = mmap(NULL, sizeof(Ring), PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "Failed to map the shared ring - %s\n", strerror(errno));
+    close(ring_fd);
+    ring_fd = -1;
+    ring = NULL;
+    return 1;
+  }
+
+  memcpy(ring->magic, RING_MAGIC, RING_MAGIC_BYTES);
+  ring->salt = salt;
+  ring->suite = suite;
+  memcpy(ring->key_nonce, key_nonce, KEY_NONCE_BYTES);
+
+  /* Only this mapping stays writable, readers can't map it any other way */
+  int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+  seals |= F_SEAL_FUTURE_WRITE;
+#endif
+
+  if (fcntl(ring_fd, F_ADD_SEALS, seals)) {
+    fprintf(stderr, "Failed to seal the shared ring - %s\n", strerror(errno));
+  }
+
+  return 0;
+}
+
+int ring_memfd(void) {
+  return ring_fd;
+}
+
+uint64_t ring_head(void) {
+  return (ring != NULL) ? ring->head : 0;
+}
+
+uint32_t ring_salt(void) {
+  return ring->salt;
+}
+
+/* Seqlock style - the stamp is cleared before the slot changes and set after.
+   Readers can't tell anyone they're asleep, so every publish wakes - one
+   syscall however many readers there are */
+void ring_publish(int room, char *frame, uint16_t size) {
+  uint64_t position = ring->head;
+  Ring_slot *slot = &ring->slots[position % RING_SLOTS];
+
+  __atomic_store_n(&slot->stamp, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  slot->room = room;
+  slot->size = size;
+  memcpy(slot->frame, frame, size);
+
+  __atomic_store_n(&slot->stamp, position + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->head, position + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->futex, (uint32_t)(position + 1), __ATOMIC_RELEASE);
+
+  ring_wake(ring);
+
+  return;
+}
+
+void ring_close(void) {
+  if (ring != NULL) {
+    munmap(ring, sizeof(Ring));
+    close(ring_fd);
+  }
+
+  ring = NULL;
+  ring_fd = -1;
+
+  return;
+}
+
+/* Takes over the fd - NULL if it isn't a ring */
+Ring *ring_map(int fd) {
+  Ring *mapped = mmap(NULL, sizeof(Ring), PROT_READ, MAP_SHARED, fd, 0);
+
+  close(fd);
+
+  if (mapped == MAP_FAILED)
+    return NULL;
+
+  if (memcmp(mapped->magic, RING_MAGIC, RING_MAGIC_BYTES) || mapped->suite >= SUITE_COUNT) {
+    munmap(mapped, sizeof(Ring));
+    return NULL;
+  }
+
+  return mapped;
+}
+
+void ring_unmap(Ring *mapped) {
+  munmap(mapped, sizeof(Ring));
+
+  return;
+}
+
+/* 1 - the slot at position was copied and position moved on, 0 - not written yet,
+   -1 - it was overwritten, position is moved to the oldest slot still there */
+int ring_read(Ring *mapped, uint64_t *position, Ring_slot *slot) {
+  Ring_slot *source = &mapped->slots[*position % RING_SLOTS];
+  uint64_t stamp = __atomic_load_n(&source->stamp, __ATOMIC_ACQUIRE), head;
+
+  if (stamp == *position + 1) {
+    memcpy(slot, source, sizeof(Ring_slot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    /* Unchanged during the copy - a torn one would fail the tag anyway */
+    if (__atomic_load_n(&source->stamp, __ATOMIC_RELAXED) == stamp) {
+      (*position)++;
+      return 1;
+    }
+  }
+
+  head = __atomic_load_n(&mapped->head, __ATOMIC_ACQUIRE);
+
+  if (head <= *position)
+    return 0;
+
+  /* The oldest slot may be the one being overwritten */
+  *position = head - RING_SLOTS + 1;
+
+  return -1;
+}
+
+/* Returns when something past position is written, on a wake or after the timeout */
+void ring_wait(Ring *mapped, uint64_t position, int timeout_ms) {
+  struct timespec timeout = nanosec_to_timespec((long)timeout_ms * NANOSECS_IN_MILLI);
+
+  if (__atomic_load_n(&mapped->head, __ATOMIC_ACQUIRE) != position)
+    return;
+
+  syscall(SYS_futex, &mapped->futex, FUTEX_WAIT, (uint32_t)position, &timeout, NULL, 0);
+
+  return;
+}
+
+void ring_wake(Ring *mapped) {
+  syscall(SYS_futex, &mapped->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+  return;
+}
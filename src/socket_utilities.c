@@ -1,7 +1,10 @@
+#include <endian.h>
+
 #include <inc/general.h>
 #include <inc/message.h>
 #include <inc/setting.h>
 #include <inc/socket_utilities.h>
+#include <inc/stats.h>
 
 in_addr_t str_to_bin_IP(char *string) {
   in_addr_t address;
@@ -21,10 +24,21 @@ void bin_IP_to_str(in_addr_t ip, char *buffer) {
   return;
 }
 
+/* -s argument - an IPv4 address or unix:/path */
+void set_connection_address(char *address) {
+  if (!strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX)))
+    snprintf(connection.unix_path, MAX_PATH_STR, "%s", address + strlen(UNIX_PREFIX));
+  else
+    snprintf(connection.ipv4, MAX_IPV4_STR, "%s", address);
+
+  return;
+}
+
 char *message_to_ascii_packet(Msg *message, int *size) {
   char *packet;
 
-  int packet_size = MAX_USERNAME_LEN + ID_SIZE + strlen(message->msg) + 1;
+  int packet_size = ASCII_HEADER_BYTES + strlen(message->msg) + 1;
+  uint64_t n_seq = htobe64(message->seq);
 
   if ((packet = malloc(packet_size)) == NULL) {
     HANDLE_ERROR("Failed to allocate memory for a packet", 1);
@@ -38,6 +52,9 @@ char *message_to_ascii_packet(Msg *message, int *size) {
   memcpy(packet + offset, message->id, ID_SIZE);  // saves the null byte
   offset += ID_SIZE;
 
+  memcpy(packet + offset, &n_seq, SEQ_BYTES);
+  offset += SEQ_BYTES;
+
   memcpy(packet + offset, message->msg, strlen(message->msg) + 1);  // saves the null byte
 
   *size = packet_size;
@@ -45,37 +62,362 @@ char *message_to_ascii_packet(Msg *message, int *size) {
   return packet;
 }
 
-Msg ascii_packet_to_message(char *data_buffer) {
-  Msg message;
+/* At most the field's bytes, and no further than the packet goes - always terminated */
+void copy_packet_field(char *dest, size_t dest_size, char *field, size_t field_bytes, int available) {
+  size_t length;
+
+  if (available <= 0) {
+    *dest = '\0';
+    return;
+  }
+
+  if (field_bytes > (size_t)available)
+    field_bytes = available;
+
+  length = strnlen(field, field_bytes);
+
+  if (length > dest_size - 1)
+    length = dest_size - 1;
+
+  memcpy(dest, field, length);
+  dest[length] = '\0';
+
+  return;
+}
+
+/* Size is the packet's as it came - nothing past it is read, fields it cuts short are empty */
+Msg ascii_packet_to_message(char *data_buffer, int size) {
+  Msg message = {.rows = NULL, .sender = -1, .room = LOBBY_ROOM, .via = -1};
+  uint64_t n_seq = 0;
 
   int offset = 0;
-  snprintf(message.username, MAX_USERNAME_LEN, "%s", data_buffer);
+  copy_packet_field(message.username, MAX_USERNAME_LEN, data_buffer, MAX_USERNAME_LEN, size);
   offset += MAX_USERNAME_LEN;
 
-  snprintf(message.id, ID_SIZE, "%s", data_buffer + offset);
+  copy_packet_field(message.id, ID_SIZE, data_buffer + offset, ID_SIZE, size - offset);
   offset += ID_SIZE;
 
-  snprintf(message.msg, MAX_MSG_LEN, "%s", data_buffer + offset);
+  if (size - offset >= SEQ_BYTES)
+    memcpy(&n_seq, data_buffer + offset, SEQ_BYTES);
+
+  message.seq = be64toh(n_seq);
+  offset += SEQ_BYTES;
+
+  copy_packet_field(message.msg, MAX_MSG_LEN, data_buffer + offset, MAX_MSG_LEN, size - offset);
 
   return message;
 }
 
-int read_one_packet(int socket, char *buffer, size_t buffer_size) {
+/* timeout_ms -1 waits for as long as it takes */
+int read_one_packet(int socket, char *buffer, size_t buffer_size, int timeout_ms) {
   fd_set ready_sockets;
+  struct timeval timeout = {
+      .tv_sec = timeout_ms / 1000,
+      .tv_usec = (timeout_ms % 1000) * 1000};
 
   /* Initialize structs */
   FD_ZERO(&ready_sockets);
   FD_SET(socket, &ready_sockets);
 
-  /* TODO 3 sec timeout */
-  if (select(socket + 1, &ready_sockets, NULL, NULL, &(struct timeval){.tv_sec = 3}) < 0) {
+  if (select(socket + 1, &ready_sockets, NULL, NULL, (timeout_ms < 0) ? NULL : &timeout) < 0) {
     HANDLE_ERROR("There was problem with read select", 1);
   }
 
   if (FD_ISSET(socket, &ready_sockets)) {
-    if (recv(socket, buffer, buffer_size, 0) > 0)
+    ssize_t peeked = recv(socket, buffer, buffer_size, MSG_PEEK);
+
+    if (peeked <= 0)
+      return 1;
+
+    /* Only up to the terminator - frames may follow in the same segment */
+    char *end = memchr(buffer, '\0', peeked);
+    size_t length = (end != NULL) ? (size_t)(end - buffer) + 1 : (size_t)peeked;
+
+    if (recv(socket, buffer, length, 0) > 0)
       return 0;
   }
 
   return 1;
 }
+
+/* Takes over the frame - the caller flushes when the queue is full */
+void queue_frame(Out_queue *out, char *frame, int size) {
+  out->frames[out->count].iov_base = frame;
+  out->frames[out->count].iov_len = size;
+  out->count++;
+
+  return;
+}
+
+/* One sendmsg for all the frames - more only if the kernel takes them in parts.
+   Sent frames are freed, all of them on an error, returns the bytes sent or -1.
+   With MSG_DONTWAIT it stops once the socket is full, the rest stays queued */
+ssize_t send_frames(int socket, Out_queue *out, int flags) {
+  struct iovec pending[OUT_MAX_FRAMES];
+  struct msghdr header = {.msg_iov = pending};
+  ssize_t sent, total = 0;
+
+  while (out->count > 0) {
+    header.msg_iovlen = pending_frames(out, pending);
+
+    sent = sendmsg(socket, &header, MSG_NOSIGNAL | flags);
+    stats_add(STAT_SEND_CALLS, 1);
+
+    if (sent == -1 && errno == EINTR)
+      continue;
+
+    if (sent == -1 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+
+    if (sent == -1) {
+      clear_frames(out);
+      return -1;
+    }
+
+    total += sent;
+    frames_sent(out, sent);
+  }
+
+  return total;
+}
+
+/* The queue as sendmsg takes it - the first frame without what already went out */
+int pending_frames(Out_queue *out, struct iovec *iov) {
+  memcpy(iov, out->frames, out->count * sizeof(struct iovec));
+
+  if (out->count > 0) {
+    iov[0].iov_base = (char *)iov[0].iov_base + out->first_sent;
+    iov[0].iov_len -= out->first_sent;
+  }
+
+  return out->count;
+}
+
+/* Takes what was sent off the front, finished frames are freed - true once nothing is left */
+bool frames_sent(Out_queue *out, size_t sent) {
+  int done = 0;
+
+  sent += out->first_sent;
+
+  while (done < out->count && sent >= out->frames[done].iov_len) {
+    sent -= out->frames[done].iov_len;
+    free(out->frames[done++].iov_base);
+  }
+
+  memmove(out->frames, out->frames + done, (out->count - done) * sizeof(struct iovec));
+  out->count -= done;
+  out->first_sent = (out->count > 0) ? sent : 0;
+
+  return out->count == 0;
+}
+
+void clear_frames(Out_queue *out) {
+  for (int i = 0; i < out->count; i++)
+    free(out->frames[i].iov_base);
+
+  out->count = 0;
+  out->first_sent = 0;
+
+  return;
+}
+
+/* Passes the fd along with the data - unix sockets only */
+ssize_t send_with_fd(int socket, char *data, size_t size, int fd) {
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct iovec iov = {.iov_base = data, .iov_len = size};
+  struct msghdr header = {
+      .msg_iov = &iov, .msg_iovlen = 1,
+      .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  stats_add(STAT_SEND_CALLS, 1);
+
+  return sendmsg(socket, &header, MSG_NOSIGNAL);
+}
+
+/* Size of the ascii packet at the start of a (batched) payload, -1 if it's cut short */
+int ascii_packet_size(char *packet, int available) {
+  char *end;
+
+  if (available <= ASCII_HEADER_BYTES)
+    return -1;
+
+  if ((end = memchr(packet + ASCII_HEADER_BYTES, '\0', available - ASCII_HEADER_BYTES)) == NULL)
+    return -1;
+
+  return end - packet + 1;
+}
+
+/* recv that keeps a passed fd - an older one not picked up yet is closed */
+ssize_t recv_with_fd(int socket, char *buffer, size_t size, int *fd) {
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct iovec iov = {.iov_base = buffer, .iov_len = size};
+  struct msghdr header = {
+      .msg_iov = &iov, .msg_iovlen = 1,
+      .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)};
+  struct cmsghdr *cmsg;
+  ssize_t received_bytes = recvmsg(socket, &header, 0);
+
+  if (received_bytes <= 0)
+    return received_bytes;
+
+  for (cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      if (*fd != -1)
+        close(*fd);
+
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+
+  return received_bytes;
+}
+
+/* Several fds in one message - the data of a SOCK_SEQPACKET socket keeps them together */
+ssize_t send_with_fds(int socket, void *data, size_t size, int *fds, int count) {
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+  } control;
+
+  struct iovec iov = {.iov_base = data, .iov_len = size};
+  struct msghdr header = {
+      .msg_iov = &iov, .msg_iovlen = 1,
+      .msg_control = control.buffer, .msg_controllen = CMSG_SPACE(count * sizeof(int))};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+
+  if (count == 0) {
+    header.msg_control = NULL;
+    header.msg_controllen = 0;
+  } else {
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+  }
+
+  return sendmsg(socket, &header, MSG_NOSIGNAL);
+}
+
+/* Up to *count fds, *count is set to how many came */
+ssize_t recv_with_fds(int socket, void *data, size_t size, int *fds, int *count) {
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+  } control;
+
+  struct iovec iov = {.iov_base = data, .iov_len = size};
+  struct msghdr header = {
+      .msg_iov = &iov, .msg_iovlen = 1,
+      .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)};
+  struct cmsghdr *cmsg;
+  ssize_t received_bytes = recvmsg(socket, &header, MSG_CMSG_CLOEXEC);
+  int wanted = *count;
+
+  *count = 0;
+
+  if (received_bytes <= 0)
+    return received_bytes;
+
+  for (cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int passed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+      for (int i = 0; i < passed; i++) {
+        int fd;
+
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+        if (*count < wanted)
+          fds[(*count)++] = fd;
+        else
+          close(fd);
+      }
+    }
+  }
+
+  return received_bytes;
+}
+
+/* Moves the unfinished frame to the front */
+void compact_reader(Frame_reader *reader) {
+  if (reader->offset > 0) {
+    memmove(
+        reader->buffer, reader->buffer + reader->offset,
+        reader->filled - reader->offset);
+    reader->filled -= reader->offset;
+    reader->offset = 0;
+  }
+
+  return;
+}
+
+/* For bytes read elsewhere - returns how many fit, the frames are taken out before the rest */
+size_t frame_reader_append(Frame_reader *reader, char *data, size_t size) {
+  compact_reader(reader);
+
+  if (size > FRAME_BUFFER_BYTES - reader->filled)
+    size = FRAME_BUFFER_BYTES - reader->filled;
+
+  memcpy(reader->buffer + reader->filled, data, size);
+  reader->filled += size;
+
+  return size;
+}
+
+/* Appends whatever the socket has into the reader - returns recv's result */
+ssize_t recv_frames(int socket, Frame_reader *reader) {
+  ssize_t received_bytes;
+
+  compact_reader(reader);
+
+  if (reader->take_fds) {
+    received_bytes = recv_with_fd(
+        socket, reader->buffer + reader->filled,
+        FRAME_BUFFER_BYTES - reader->filled, &reader->passed_fd);
+  } else {
+    received_bytes = recv(
+        socket, reader->buffer + reader->filled,
+        FRAME_BUFFER_BYTES - reader->filled, 0);
+  }
+
+  if (received_bytes > 0)
+    reader->filled += received_bytes;
+
+  return received_bytes;
+}
+
+/* 1 - a frame is ready, 0 - more bytes needed, -1 - the stream is corrupt */
+int next_frame(Frame_reader *reader, char **frame, int *size) {
+  size_t available = reader->filled - reader->offset;
+
+  if (available < HEADER_BYTES)
+    return 0;
+
+  uint16_t payload_size = packet_payload_size(reader->buffer + reader->offset);
+
+  if (payload_size > reader->max_payload)
+    return -1;  // frame boundaries are lost
+
+  if (available < HEADER_BYTES + payload_size)
+    return 0;
+
+  *frame = reader->buffer + reader->offset;
+  *size = HEADER_BYTES + payload_size;
+  reader->offset += *size;
+
+  return 1;
+}
@@ -0,0 +1,307 @@
+#include <inc/cipher_slab.h>
+#include <inc/general.h>
+#include <inc/setting.h>
+#include <inc/stats.h>
+
+void *write_stats_periodically(void *_);
+Stats_block *acquire_stats_block(void);
+void release_stats_block(void *block);
+
+static const char *stage_names[STAGE_COUNT] = {
+    "recv", "decrypt", "queue_wait", "encode", "encrypt", "send"};
+
+static const char *counter_names[STAT_COUNT] = {
+    "bytes_in", "bytes_out", "msgs_in", "msgs_out", "drops",
+    "auth_failures", "connects", "disconnects", "reconnects",
+    "throttled", "flood_kicks", "timeouts", "ring_frames", "send_calls",
+    "recv_calls", "coalesced", "relayed", "relay_dups"};
+
+/* Blocks are never freed, a thread exiting gives its block to the next one */
+Stats_block *stats_blocks = NULL;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stats_key;
+pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local Stats_block *local_block = NULL;
+
+char stats_path[MAX_PATH_STR];
+int stats_interval;
+bool stats_writer_running = false;
+pthread_t stats_writer;
+
+void stats_init(char *path, int interval_secs) {
+  if (path == NULL || *path == '\0')
+    return;
+
+  snprintf(stats_path, MAX_PATH_STR, "%s", path);
+  stats_interval = (interval_secs > 0) ? interval_secs : STATS_INTERVAL_SEC;
+
+  pthread_create(&stats_writer, NULL, write_stats_periodically, NULL);
+  stats_writer_running = true;
+
+  return;
+}
+
+void stats_stop(void) {
+  if (stats_writer_running) {
+    pthread_cancel(stats_writer);
+    pthread_join(stats_writer, NULL);
+    stats_writer_running = false;
+  }
+
+  return;
+}
+
+void create_stats_key(void) {
+  pthread_key_create(&stats_key, release_stats_block);
+
+  return;
+}
+
+Stats_block *acquire_stats_block(void) {
+  Stats_block *block;
+
+  pthread_once(&stats_key_once, create_stats_key);
+
+  pthread_mutex_lock(&stats_lock);
+
+  for (block = stats_blocks; block != NULL; block = block->next) {
+    if (!block->in_use)
+      break;
+  }
+
+  if (block == NULL) {
+    if ((block = (Stats_block *)calloc(1, sizeof(Stats_block))) == NULL) {
+      HANDLE_ERROR("Failed to allocate memory for stats", 1);
+    }
+    block->next = stats_blocks;
+    stats_blocks = block;
+  }
+
+  block->in_use = true;
+
+  pthread_mutex_unlock(&stats_lock);
+
+  pthread_setspecific(stats_key, block);
+
+  return block;
+}
+
+/* Run by pthread when the owning thread exits or is cancelled */
+void release_stats_block(void *block) {
+  pthread_mutex_lock(&stats_lock);
+  ((Stats_block *)block)->in_use = false;
+  pthread_mutex_unlock(&stats_lock);
+
+  return;
+}
+
+int hist_bucket(uint64_t value) {
+  if (value < HIST_SUB_BUCKETS)
+    return (int)value;
+
+  int exp = 63 - __builtin_clzll(value);
+
+  if (exp >= HIST_MAX_EXP)
+    return HIST_BUCKETS - 1;
+
+  int shift = exp - HIST_SUB_BITS;
+
+  return (shift + 1) * HIST_SUB_BUCKETS + (int)((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Highest value that falls into the bucket */
+uint64_t hist_bucket_limit(int bucket) {
+  if (bucket < HIST_SUB_BUCKETS)
+    return bucket;
+
+  int shift = bucket / HIST_SUB_BUCKETS - 1;
+  uint64_t sub = HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS;
+
+  return ((sub + 1) << shift) - 1;
+}
+
+/* Single writer per block - a relaxed load+store is enough, no locked ops */
+static inline void local_increment(_Atomic uint64_t *value, uint64_t amount) {
+  atomic_store_explicit(
+      value,
+      atomic_load_explicit(value, memory_order_relaxed) + amount,
+      memory_order_relaxed);
+}
+
+void stats_record(Stage stage, uint64_t nanosecs) {
+  if (local_block == NULL)
+    local_block = acquire_stats_block();
+
+  local_increment(&local_block->hist[stage][hist_bucket(nanosecs)], 1);
+  local_increment(&local_block->sum[stage], nanosecs);
+
+  return;
+}
+
+void stats_add(Stat_counter counter, uint64_t amount) {
+  if (local_block == NULL)
+    local_block = acquire_stats_block();
+
+  local_increment(&local_block->counters[counter], amount);
+
+  return;
+}
+
+/* Sums every thread's block into one - readers never stop the writers */
+void collect_stats(uint64_t hist[STAGE_COUNT][HIST_BUCKETS], uint64_t *sum, uint64_t *counters) {
+  memset(hist, 0, sizeof(uint64_t) * STAGE_COUNT * HIST_BUCKETS);
+  memset(sum, 0, sizeof(uint64_t) * STAGE_COUNT);
+  memset(counters, 0, sizeof(uint64_t) * STAT_COUNT);
+
+  pthread_mutex_lock(&stats_lock);
+
+  for (Stats_block *block = stats_blocks; block != NULL; block = block->next) {
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+      for (int b = 0; b < HIST_BUCKETS; b++)
+        hist[stage][b] += atomic_load_explicit(&block->hist[stage][b], memory_order_relaxed);
+
+      sum[stage] += atomic_load_explicit(&block->sum[stage], memory_order_relaxed);
+    }
+
+    for (int c = 0; c < STAT_COUNT; c++)
+      counters[c] += atomic_load_explicit(&block->counters[c], memory_order_relaxed);
+  }
+
+  pthread_mutex_unlock(&stats_lock);
+
+  return;
+}
+
+/* Sum of one counter over every thread */
+uint64_t stats_counter(Stat_counter counter) {
+  uint64_t total = 0;
+
+  pthread_mutex_lock(&stats_lock);
+
+  for (Stats_block *block = stats_blocks; block != NULL; block = block->next)
+    total += atomic_load_explicit(&block->counters[counter], memory_order_relaxed);
+
+  pthread_mutex_unlock(&stats_lock);
+
+  return total;
+}
+
+uint64_t hist_percentile(uint64_t *hist, uint64_t count, double percentile) {
+  uint64_t seen = 0, target = (uint64_t)ceil(count * percentile);
+
+  if (target == 0)
+    target = 1;
+
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += hist[b];
+
+    if (seen >= target)
+      return hist_bucket_limit(b);
+  }
+
+  return 0;
+}
+
+void stats_dump(FILE *out) {
+  static uint64_t hist[STAGE_COUNT][HIST_BUCKETS];
+  static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+  uint64_t sum[STAGE_COUNT], counters[STAT_COUNT], count;
+  Slab_usage slab;
+
+  pthread_mutex_lock(&dump_lock);
+
+  collect_stats(hist, sum, counters);
+
+  fprintf(
+      out, "%-12s %10s %10s %10s %10s %10s %10s\n",
+      "stage(us)", "count", "mean", "p50", "p90", "p99", "max");
+
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    count = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+      count += hist[stage][b];
+
+    if (count == 0) {
+      fprintf(out, "%-12s %10d\n", stage_names[stage], 0);
+      continue;
+    }
+
+    fprintf(
+        out, "%-12s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+        stage_names[stage], count,
+        (double)sum[stage] / count / NANOSECS_IN_MICRO,
+        (double)hist_percentile(hist[stage], count, 0.50) / NANOSECS_IN_MICRO,
+        (double)hist_percentile(hist[stage], count, 0.90) / NANOSECS_IN_MICRO,
+        (double)hist_percentile(hist[stage], count, 0.99) / NANOSECS_IN_MICRO,
+        (double)hist_percentile(hist[stage], count, 1.0) / NANOSECS_IN_MICRO);
+  }
+
+  for (int c = 0; c < STAT_COUNT; c++)
+    fprintf(out, "%-14s %" PRIu64 "\n", counter_names[c], counters[c]);
+
+  /* Kernel crossings per delivered message - drops below 1 when bursts are batched */
+  if (counters[STAT_MSGS_OUT] > 0)
+    fprintf(
+        out, "%-14s %.3f\n", "calls_per_msg",
+        (double)counters[STAT_SEND_CALLS] / counters[STAT_MSGS_OUT]);
+
+  if (counters[STAT_MSGS_IN] > 0)
+    fprintf(
+        out, "%-14s %.3f\n", "recv_calls_per_msg",
+        (double)counters[STAT_RECV_CALLS] / counters[STAT_MSGS_IN]);
+
+  /* Cipher state - a session costs a slot, the handle itself a bit less */
+  slab_usage(&slab);
+  fprintf(out, "%-14s %zu\n", "slab_slots", slab.slots);
+  fprintf(out, "%-14s %zu\n", "slab_used", slab.used);
+  fprintf(out, "%-14s %zu\n", "slot_bytes", slab.slot_bytes);
+  fprintf(out, "%-14s %zu\n", "session_bytes", slab.session_bytes);
+  fprintf(out, "%-14s %s\n", "slab_locked", slab.locked ? "yes" : "no");
+
+  pthread_mutex_unlock(&dump_lock);
+
+  return;
+}
+
+/* Rewrites the stats file - skipped when nothing has happened since last time */
+void *write_stats_periodically(void *_) {
+  uint64_t last_total = UINT64_MAX, total;
+  uint64_t sum[STAGE_COUNT], counters[STAT_COUNT];
+  static uint64_t hist[STAGE_COUNT][HIST_BUCKETS];
+  char tmp_path[MAX_PATH_STR + 4];
+  FILE *out;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_path);
+
+  while (true) {
+    sleep(stats_interval);
+
+    collect_stats(hist, sum, counters);
+
+    total = 0;
+    for (int c = 0; c < STAT_COUNT; c++)
+      total += counters[c];
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+      total += sum[stage];
+
+    if (total == last_total)
+      continue;
+
+    last_total = total;
+
+    if ((out = fopen(tmp_path, "w")) == NULL) {
+      fprintf(stderr, "Failed to write stats to %s - %s\n", tmp_path, strerror(errno));
+      continue;
+    }
+
+    fprintf(out, "time %ld\n", (long)time(NULL));
+    stats_dump(out);
+    fclose(out);
+
+    /* Readers never see a half-written file */
+    rename(tmp_path, stats_path);
+  }
+
+  return NULL;
+}
@@ -0,0 +1,195 @@
+#include <inc/general.h>
+#include <inc/setting.h>
+#include <inc/timer_wheel.h>
+
+void *run_timer_wheel(void *_);
+
+Timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+uint64_t current_tick = 0;
+pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool wheel_running = false;
+pthread_t wheel_thread;
+
+void timer_wheel_start(void) {
+  pthread_create(&wheel_thread, NULL, run_timer_wheel, NULL);
+  wheel_running = true;
+
+  return;
+}
+
+void timer_wheel_stop(void) {
+  if (wheel_running) {
+    pthread_cancel(wheel_thread);
+    pthread_join(wheel_thread, NULL);
+    wheel_running = false;
+  }
+
+  return;
+}
+
+void timer_init(Timer *timer, Timer_callback callback, void *arg) {
+  timer->callback = callback;
+  timer->arg = arg;
+  timer->armed = false;
+  timer->next = timer->prev = NULL;
+
+  return;
+}
+
+/* The level is picked by how far away the timer is - wheel_lock held */
+void link_timer(Timer *timer) {
+  uint64_t delta = timer->expires - current_tick;
+  int level = 0;
+
+  while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+    level++;
+
+  Timer **slot = &wheel[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+  timer->prev = NULL;
+  timer->next = *slot;
+
+  if (*slot != NULL)
+    (*slot)->prev = timer;
+
+  *slot = timer;
+  timer->armed = true;
+
+  return;
+}
+
+/* Needs the slot's head to unlink the first timer - found again from expires */
+void unlink_timer(Timer *timer) {
+  if (timer->prev != NULL) {
+    timer->prev->next = timer->next;
+
+  } else {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+      Timer **slot = &wheel[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+      if (*slot == timer) {
+        *slot = timer->next;
+        break;
+      }
+    }
+  }
+
+  if (timer->next != NULL)
+    timer->next->prev = timer->prev;
+
+  timer->next = timer->prev = NULL;
+  timer->armed = false;
+
+  return;
+}
+
+/* Re-arming an armed timer moves it */
+void timer_arm(Timer *timer, uint64_t delay_ms) {
+  uint64_t ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+  if (ticks == 0)
+    ticks = 1;
+  if (ticks > WHEEL_MAX_TICKS)
+    ticks = WHEEL_MAX_TICKS;
+
+  pthread_mutex_lock(&wheel_lock);
+
+  if (timer->armed)
+    unlink_timer(timer);
+
+  timer->expires = current_tick + ticks;
+  link_timer(timer);
+
+  pthread_mutex_unlock(&wheel_lock);
+
+  return;
+}
+
+/* The callback may still run once if the wheel has already picked the timer up */
+void timer_cancel(Timer *timer) {
+  pthread_mutex_lock(&wheel_lock);
+
+  if (timer->armed)
+    unlink_timer(timer);
+
+  pthread_mutex_unlock(&wheel_lock);
+
+  return;
+}
+
+/* Moves a coarse slot's timers down now that they are closer - wheel_lock held */
+void cascade(int level, int index) {
+  Timer *timer = wheel[level][index], *next;
+
+  wheel[level][index] = NULL;
+
+  for (; timer != NULL; timer = next) {
+    next = timer->next;
+    link_timer(timer);
+  }
+
+  return;
+}
+
+void tick(void) {
+  Timer_callback callbacks[WHEEL_FIRE_BATCH];
+  void *args[WHEEL_FIRE_BATCH];
+  Timer **slot, *timer;
+  int count;
+
+  pthread_mutex_lock(&wheel_lock);
+
+  current_tick++;
+
+  for (int level = 1; level < WHEEL_LEVELS; level++) {
+    if (current_tick & ((1ULL << (WHEEL_BITS * level)) - 1))
+      break;
+
+    cascade(level, (current_tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+  }
+
+  slot = &wheel[0][current_tick & WHEEL_MASK];
+
+  /* Fired in batches with the wheel unlocked, so callbacks can arm timers */
+  while (*slot != NULL) {
+    for (count = 0; *slot != NULL && count < WHEEL_FIRE_BATCH; count++) {
+      timer = *slot;
+      unlink_timer(timer);
+
+      callbacks[count] = timer->callback;
+      args[count] = timer->arg;
+    }
+
+    pthread_mutex_unlock(&wheel_lock);
+
+    for (int i = 0; i < count; i++)
+      callbacks[i](args[i]);
+
+    pthread_mutex_lock(&wheel_lock);
+  }
+
+  pthread_mutex_unlock(&wheel_lock);
+
+  return;
+}
+
+/* Ticks on absolute deadlines, a late wakeup catches up instead of drifting */
+void *run_timer_wheel(void *_) {
+  uint64_t next_tick = get_monotonic_nanosecs();
+  struct timespec deadline;
+
+  while (true) {
+    next_tick += (uint64_t)TIMER_TICK_MS * NANOSECS_IN_MILLI;
+    deadline = nanosec_to_timespec(next_tick);
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+
+    /* Callbacks take locks, stopping is only allowed between ticks */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    tick();
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  }
+
+  return NULL;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // wcwidth
 #include <inc/general.h>
 #include <inc/message.h>
 #include <inc/setting.h>
@@ -7,6 +8,7 @@ void refresh_windows(int count, ...);
 WINDOW *create_window(int height, int width, int loc_x, int loc_y, int border);
 void init_windows(WINDOW **main, WINDOW **in, WINDOW **border_main, WINDOW **border_in);
 int init_colors(void);
+void set_paste_mode(bool on);
 int handle_command(char *command);
 
 int get_char_size(char lead_byte);
@@ -14,6 +16,7 @@ int get_char_width(char *c, int size);
 int get_char_from_string(char *string, char *c);
 void fix_multibyte_chars(char *start, char *end);
 int parse_message_to_rows(Msg *message);
+void layout_message(Msg *msg);
 void patch_msg_expressions(char *message);
 
 int insert_into_message_history(Msg *messages, int *count, Msg msg);
@@ -30,8 +33,6 @@ int main_maxx, max_text_win, colors_supported;  //max-window size and maximum li
 void *run_ncurses_window(void *_) {
   WINDOW *main = NULL, *in, *border_in, *border_main;
 
-  setlocale(LC_ALL, "");  //for utf-8
-
   if (initscr() == NULL) {
     HANDLE_ERROR("Failed to initialize ncurses window.", 0);
   }
@@ -43,11 +44,12 @@ void *run_ncurses_window(void *_) {
 
   init_windows(&main, &in, &border_main, &border_in);
   refresh_windows(4, main, in, border_main, border_in);
+  set_paste_mode(true);
 
   Msg messages[MAX_MESSAGE_LIST], *msg;
 
   int msg_count = 0, c_byte, row_count = 0, rows_in_msg, offset = 0;
-  char msg_buffer[MAX_MSG_LEN], *msg_ptr = msg_buffer;
+  char msg_buffer[MAX_MSG_LEN], *msg_ptr = msg_buffer, *paste_start = NULL;
 
   struct timeval start_time, end_time, test_time;
   struct timespec sleep_time;
@@ -57,8 +59,22 @@ void *run_ncurses_window(void *_) {
     /* Start timer */
     gettimeofday(&start_time, NULL);  //Only works on Unix
 
-    /* Only if input is ready */
-    if ((c_byte = wgetch(in)) != ERR) {
+    /* Everything that's ready - a frame is not a key */
+    while ((c_byte = wgetch(in)) != ERR) {
+      /* A paste is taken as is, newlines and all, and drawn once it ends */
+      if (paste_start != NULL && c_byte <= UCHAR_MAX) {
+        if (c_byte == '\n' || c_byte == '\r' || c_byte == '\t')
+          c_byte = ' ';  // one line input box
+
+        if (c_byte < ' ')
+          continue;
+
+        if (msg_ptr < &msg_buffer[MAX_MSG_LEN - 1])
+          *msg_ptr++ = c_byte;
+
+        continue;
+      }
+
       switch (c_byte) {
         case '\n':
         case '\r':
@@ -77,15 +93,7 @@ void *run_ncurses_window(void *_) {
             /* Put the message into the send queue */
           } else {
             patch_msg_expressions(msg_buffer);
-
-            pthread_mutex_lock(&w_lock);
-
-            add_message_to_queue(
-                compose_message(msg_buffer, NULL, user.username),
-                &write_head, &write_tail, NULL);
-            pthread_cond_signal(&message_ready);
-
-            pthread_mutex_unlock(&w_lock);
+            queue_outgoing(msg_buffer);
           }
 
           msg_ptr = msg_buffer;
@@ -93,6 +101,19 @@ void *run_ncurses_window(void *_) {
           werase(in);
           break;
 
+        case KEY_PASTE_BEGIN:
+          noecho();
+          paste_start = msg_ptr;
+          break;
+
+        case KEY_PASTE_END:
+          if (paste_start != NULL)
+            waddnstr(in, paste_start, msg_ptr - paste_start);
+
+          echo();
+          paste_start = NULL;
+          break;
+
         case KEY_RESIZE:
           init_windows(&main, &in, &border_main, &border_in);
           row_count = fix_row_lengths(messages, msg_count);
@@ -122,7 +143,8 @@ void *run_ncurses_window(void *_) {
       }
     }
 
-    if ((msg = pop_msg_from_queue(&read_head, &r_lock)) != NULL) {
+    /* Laid out already by whoever queued them - only drawn here */
+    while ((msg = pop_msg_from_queue(&read_head, &r_lock)) != NULL) {
       rows_in_msg = insert_into_message_history(messages, &msg_count, *msg);
       row_count += rows_in_msg;
 
@@ -166,6 +188,7 @@ close_UI:
     free_msg_username_colors(&messages[i]);
   }
 
+  set_paste_mode(false);
   endwin();
 
   delwin(main);
@@ -194,8 +217,9 @@ int handle_offset(int old_offset, int increment, int times, int row_count) {
   return new_offset;
 }
 
+/* Runs on any thread - the window may be resized meanwhile, the width used is kept */
 int parse_message_to_rows(Msg *message) {
-  int row_idx = 0;
+  int row_idx = 0, width = __atomic_load_n(&main_maxx, __ATOMIC_RELAXED);
   int char_size = 0, char_bytes = 0, cur_row_len = 0;
 
   char row_buff[MAX_ROW_SIZE + 1];
@@ -218,8 +242,8 @@ int parse_message_to_rows(Msg *message) {
     sub_row_ptr += char_size;
     cur_row_len += get_char_width(wide_char, char_size);  // length in characters
 
-    if (cur_row_len >= main_maxx) {  //row is full
-      (cur_row_len > main_maxx) ? char_bytes -= char_size : 0;
+    if (cur_row_len >= width) {  //row is full
+      (cur_row_len > width) ? char_bytes -= char_size : 0;
 
       insert_into_msg_rows(&message->rows, row_idx++, row_buff, char_bytes);
 
@@ -235,10 +259,19 @@ int parse_message_to_rows(Msg *message) {
   }
 
   message->row_count = row_idx;
+  message->layout_width = width;
 
   return row_idx;
 }
 
+/* Rows and username colors - everything the UI needs to only draw it */
+void layout_message(Msg *msg) {
+  parse_message_to_rows(msg);
+  parse_username_for_msg(msg, msg->username);
+
+  return;
+}
+
 void free_msg_rows(Msg *msg) {
   for (int row_idx = 0; row_idx < msg->row_count; row_idx++)
     free(msg->rows[row_idx]);
@@ -341,6 +374,19 @@ void refresh_windows(int count, ...) {
   return;
 }
 
+/* Terminals that don't know it ignore the mode, pastes then come in as typed keys */
+void set_paste_mode(bool on) {
+  if (on) {
+    define_key(PASTE_BEGIN_SEQ, KEY_PASTE_BEGIN);
+    define_key(PASTE_END_SEQ, KEY_PASTE_END);
+  }
+
+  fputs(on ? PASTE_MODE_ON : PASTE_MODE_OFF, stdout);
+  fflush(stdout);
+
+  return;
+}
+
 int init_colors(void) {
   if (has_colors() && can_change_color()) {
     start_color();
@@ -405,7 +451,7 @@ void init_windows(
       1);
 
   max_text_win = ((*border_in)->_begy) - (*main)->_begy;
-  main_maxx = getmaxx(*main);
+  __atomic_store_n(&main_maxx, getmaxx(*main), __ATOMIC_RELAXED);
 
   nodelay(*in, TRUE);  //input does not block output
   keypad(*in, TRUE);   //ncurses interpret keys
@@ -422,10 +468,17 @@ void insert_into_msg_rows(char ***rows, int count, char *row, int len) {
   return;
 }
 
-/* Copy the message into the point x*/
+/* Copy the message into the point x - queued laid out, redone only after a resize */
 int insert_into_message_history(Msg *messages, int *count, Msg msg) {
   int rows_in_msg;
 
+  if (msg.layout_width != main_maxx) {
+    free_msg_rows(&msg);
+    parse_message_to_rows(&msg);
+  }
+
+  rows_in_msg = msg.row_count;
+
   /* Messages are shifted - oldest message is discarded */
   if (*count == MAX_MESSAGE_LIST) {
     int msg_idx, old_row_count;
@@ -440,35 +493,31 @@ int insert_into_message_history(Msg *messages, int *count, Msg msg) {
     }
 
     messages[msg_idx] = msg;
-    rows_in_msg = parse_message_to_rows(&messages[msg_idx]);
-    parse_username_for_msg(&messages[msg_idx], msg.username);
 
     return rows_in_msg - old_row_count;
   }
 
   messages[*count] = msg;
-  rows_in_msg = parse_message_to_rows(&messages[*count]);
-  parse_username_for_msg(&messages[*count], msg.username);
   (*count)++;
 
   return rows_in_msg;
 }
 
-/* Print the character into a window to determine its width */
+/* Columns the character takes - ncurses shows control characters as ^X */
 int get_char_width(char *wide_char, int size) {
-  static WINDOW *test_win = NULL;
+  mbstate_t state;
+  wchar_t wc;
+  int width;
 
-  char *char_ptr = strndup(wide_char, size);
+  memset(&state, 0, sizeof(state));
 
-  if (test_win == NULL)
-    test_win = newwin(1, main_maxx, 0, 0);
-  else
-    wmove(test_win, 0, 0);
+  if (mbrtowc(&wc, wide_char, size, &state) > (size_t)size)
+    return 1;  // broken sequence, shown as one
 
-  wprintw(test_win, "%s", char_ptr);
-  free(char_ptr);
+  if ((width = wcwidth(wc)) >= 0)
+    return width;
 
-  return getcurx(test_win);
+  return (wc < ' ' || wc == 0x7f) ? 2 : 1;
 }
 
 int get_char_size(char lead_byte) {
@@ -552,8 +601,32 @@ void display_message_history(Msg *messages, int msg_count, WINDOW *win, int offs
   return;
 }
 
+/* Laid out before it's queued, so the UI thread only draws it */
+void queue_incoming(Msg msg) {
+  Msg *new = new_message_node(msg);
+
+  layout_message(new);
+  push_message(new, &read_head, &read_tail, &r_lock);
+
+  return;
+}
+
+/* Put the message into the send queue */
+void queue_outgoing(char *text) {
+  pthread_mutex_lock(&w_lock);
+
+  add_message_to_queue(
+      compose_message(text, NULL, user.username),
+      &write_head, &write_tail, NULL);
+  pthread_cond_signal(&message_ready);
+
+  pthread_mutex_unlock(&w_lock);
+
+  return;
+}
+
 int handle_command(char *raw_command) {
-  char command[MAX_MSG_LEN], args[MAX_MSG_LEN], *response;
+  char command[MAX_MSG_LEN], args[MAX_MSG_LEN] = "", text[MAX_MSG_LEN] = "", echo[MAX_MSG_LEN], *response;
 
   sscanf(raw_command, "%s %s", command, args);
 
@@ -561,6 +634,7 @@ int handle_command(char *raw_command) {
     snprintf(
         user.username, MAX_USERNAME_LEN,
         "%s", args);
+    queue_outgoing("/" C_CHANGE_USERNAME);  // the server picks the new name from the message
     response = "Username changed.";
 
   } else if (!strcmp(command, C_CHANGE_FPS)) {
@@ -570,13 +644,35 @@ int handle_command(char *raw_command) {
   } else if (!strcmp(command, C_QUIT)) {
     return 1;
 
+  } else if (!strcmp(command, C_JOIN) || !strcmp(command, C_LEAVE)) {
+    /* Rooms live on the server - the command is passed on with its '/' */
+    queue_outgoing(raw_command - 1);
+
+    /* Remembered for rejoining after a reconnect */
+    snprintf(user.room, MAX_ROOM_NAME, "%.*s", MAX_ROOM_NAME - 1, (!strcmp(command, C_JOIN)) ? args : "");
+    return 0;
+
+  } else if (!strcmp(command, C_DIRECT_MSG)) {
+    sscanf(raw_command, "%*s %*s %[^\n]", text);
+
+    if (*args == '\0' || *text == '\0') {
+      response = "Usage: /" C_DIRECT_MSG " <name|id> message";
+
+    } else {
+      /* Only the recipient gets it from the server, so it is echoed here */
+      queue_outgoing(raw_command - 1);
+
+      snprintf(
+          echo, MAX_MSG_LEN, "-> %.*s %.*s",
+          MAX_USERNAME_LEN - 1, args, MAX_MSG_LEN - MAX_USERNAME_LEN - 4, text);
+      response = echo;
+    }
+
   } else {
     response = "Invalid command.";
   }
 
-  add_message_to_queue(
-      compose_message(response, "0", "/7:System"),
-      &read_head, &read_tail, &r_lock);
+  queue_incoming(compose_message(response, "0", "/7:System"));
 
   return 0;
 }
@@ -0,0 +1,206 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include <inc/client.h>
+#include <inc/setting.h>
+#include <tests/harness.h>
+
+#define TEST_CIPHER_SESSIONS 32
+#define TEST_HOST "./clm"
+
+void test_init(void) {
+  init_libgcrypt(TEST_CIPHER_SESSIONS);
+  signal(SIGPIPE, SIG_IGN);
+
+  return;
+}
+
+uint64_t elapsed_ms(uint64_t since) {
+  return (get_monotonic_nanosecs() - since) / NANOSECS_IN_MILLI;
+}
+
+/* Headless on a port of its own, so runs don't wait out each other's TIME_WAIT.
+   args end with NULL, the host's output goes to obj/ */
+void server_start(Test_server *server, char **args) {
+  char *argv[64] = {TEST_HOST, "-h", "-p", server->port, "-m", "64"};
+  int pipe_fds[2], argc = 6, log, probe;
+  uint64_t start = get_monotonic_nanosecs();
+  struct sockaddr_in address = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+
+  snprintf(
+      server->port, MAX_PORT_STR, "%d",
+      TEST_PORT_BASE + (getpid() + (int)(start / NANOSECS_IN_MILLI)) % TEST_PORT_SPREAD);
+
+  for (int i = 0; args[i] != NULL && argc < 63; i++)
+    argv[argc++] = args[i];
+  argv[argc] = NULL;
+
+  CHECK(pipe(pipe_fds) == 0, "no pipe for the host");
+  CHECK((server->pid = fork()) != -1, "can't fork the host");
+
+  if (server->pid == 0) {
+    log = open("obj/test_host.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
+    dup2(pipe_fds[0], STDIN_FILENO);
+    dup2(log, STDOUT_FILENO);
+    dup2(log, STDERR_FILENO);
+    close(pipe_fds[1]);
+    execv(TEST_HOST, argv);
+    _exit(127);
+  }
+
+  close(pipe_fds[0]);
+  server->input = pipe_fds[1];
+
+  /* Listening once a bare connect goes through - it's dropped without a handshake */
+  address.sin_port = htons(atoi(server->port));
+
+  while (true) {
+    CHECK(elapsed_ms(start) < TEST_START_MS, "the host didn't come up on %s", server->port);
+
+    probe = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0) {
+      close(probe);
+      break;
+    }
+
+    close(probe);
+    usleep(20000);
+  }
+
+  return;
+}
+
+void server_stop(Test_server *server) {
+  uint64_t start = get_monotonic_nanosecs();
+  int status;
+
+  if (write(server->input, "quit\n", 5) != 5)
+    kill(server->pid, SIGTERM);
+
+  close(server->input);
+
+  while (waitpid(server->pid, &status, WNOHANG) == 0) {
+    if (elapsed_ms(start) > TEST_STOP_MS) {
+      kill(server->pid, SIGKILL);
+      waitpid(server->pid, &status, 0);
+      break;
+    }
+
+    usleep(20000);
+  }
+
+  return;
+}
+
+/* Handshake and name, like clm's client - 0 once it's in the lobby */
+int client_connect(Test_client *client, Test_server *server, char *name) {
+  memset(client, 0, sizeof(Test_client));
+  snprintf(client->name, MAX_USERNAME_LEN, "%s", name);
+
+  if ((client->socket = connect_to_host(LOCAL_HOST, server->port, "", &client->salt, &client->suite, client->key_nonce)) == -1)
+    return -1;
+
+  if (init_cipher(&client->send_cipher, client->suite, client->key_nonce) ||
+      init_cipher(&client->recv_cipher, client->suite, client->key_nonce))
+    return -1;
+
+  client->reader.max_payload = MAX_BATCH_SIZE;
+
+  /* The name goes with every message, the command just makes it known */
+  return client_send(client, "/" C_CHANGE_USERNAME);
+}
+
+int client_send(Test_client *client, char *text) {
+  Msg msg = compose_message(text, NULL, client->name);
+  char *ascii_packet;
+  int packet_size, status;
+
+  ascii_packet = message_to_ascii_packet(&msg, &packet_size);
+  status = client_send_packet(client, ascii_packet, packet_size);
+
+  free(ascii_packet);
+
+  return status;
+}
+
+/* Sealed as one frame, whatever the payload is */
+int client_send_packet(Test_client *client, char *packet, int size) {
+  char *enc_packet;
+  int new_size;
+  ssize_t sent;
+
+  enc_packet = encrypt_packet(
+      packet,
+      size, &new_size,
+      &client->send_cipher, SALT_TO_SERVER(client->salt), ++client->send_ctr);
+
+  sent = send(client->socket, enc_packet, new_size, MSG_NOSIGNAL);
+
+  free(enc_packet);
+
+  return (sent == new_size) ? 0 : -1;
+}
+
+/* 1 - a message, 0 - none in time, -1 - the host closed the link */
+int client_receive(Test_client *client, Msg *msg, int timeout_ms) {
+  struct pollfd ready = {.fd = client->socket, .events = POLLIN};
+  uint64_t start = get_monotonic_nanosecs();
+  char *frame, *packet;
+  int frame_size, payload_size, offset, size, left;
+
+  while (client->pending_next == client->pending_count) {
+    switch (next_frame(&client->reader, &frame, &frame_size)) {
+      case 1:
+        packet = decrypt_packet(frame, &client->recv_cipher, SALT_TO_CLIENT(client->salt), client->recv_ctr++);
+        CHECK(packet != NULL, "%s got a frame that doesn't decrypt", client->name);
+
+        /* A frame may carry a batch of packets */
+        payload_size = packet_payload_size(frame);
+        client->pending_count = client->pending_next = 0;
+
+        for (offset = 0;
+             client->pending_count < TEST_PENDING &&
+             (size = ascii_packet_size(packet + offset, payload_size - offset)) != -1;
+             offset += size)
+          client->pending[client->pending_count++] = ascii_packet_to_message(packet + offset, size);
+
+        free(packet);
+        continue;
+
+      case -1:
+        return -1;
+    }
+
+    if ((left = timeout_ms - (int)elapsed_ms(start)) <= 0 || poll(&ready, 1, left) <= 0)
+      return 0;
+
+    if (recv_frames(client->socket, &client->reader) <= 0)
+      return -1;
+  }
+
+  *msg = client->pending[client->pending_next++];
+
+  return 1;
+}
+
+/* Reads on until the host drops the link, true if it did in time */
+bool client_closed(Test_client *client, int timeout_ms) {
+  uint64_t start = get_monotonic_nanosecs();
+  Msg msg;
+  int status;
+
+  while ((status = client_receive(client, &msg, timeout_ms - (int)elapsed_ms(start))) == 1)
+    ;
+
+  return status == -1;
+}
+
+void client_close(Test_client *client) {
+  close(client->socket);
+  gcry_cipher_close(client->send_cipher);
+  gcry_cipher_close(client->recv_cipher);
+
+  return;
+}
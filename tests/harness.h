@@ -0,0 +1,58 @@
+#ifndef HARNESS_H
+    #define HARNESS_H
+
+    #include <inc/crypt.h>
+    #include <inc/general.h>
+    #include <inc/message.h>
+    #include <inc/socket_utilities.h>
+
+    /* A real host on a loopback port, and clients talking to it like clm does -
+       see `make check`. Each test is a program, exiting non-zero on the first failure */
+    #define TEST_PORT_BASE 20000
+    #define TEST_PORT_SPREAD 10000
+    #define TEST_START_MS 3000 // the host's startup probe runs before it listens
+    #define TEST_STOP_MS 3000
+    #define TEST_PENDING 128 // packets of a batch not yet handed out
+
+    #define CHECK(condition, ...) \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            exit(EXIT_FAILURE); \
+        }
+
+    typedef struct _test_server{
+        pid_t pid;
+        int input; // the host's stdin - "quit" stops it
+        char port[MAX_PORT_STR];
+    }Test_server;
+
+    typedef struct _test_client{
+        int socket;
+        uint32_t salt;
+        Suite suite;
+        uint8_t key_nonce[KEY_NONCE_BYTES];
+        uint64_t send_ctr;
+        uint64_t recv_ctr;
+        gcry_cipher_hd_t send_cipher;
+        gcry_cipher_hd_t recv_cipher;
+        Frame_reader reader;
+        Msg pending[TEST_PENDING];
+        int pending_count;
+        int pending_next;
+        char name[MAX_USERNAME_LEN];
+    }Test_client;
+
+    void test_init(void);
+    void server_start(Test_server *server, char **args);
+    void server_stop(Test_server *server);
+    int client_connect(Test_client *client, Test_server *server, char *name);
+    int client_send(Test_client *client, char *text);
+    int client_send_packet(Test_client *client, char *packet, int size);
+    int client_receive(Test_client *client, Msg *msg, int timeout_ms);
+    bool client_closed(Test_client *client, int timeout_ms);
+    void client_close(Test_client *client);
+    uint64_t elapsed_ms(uint64_t since);
+
+#endif
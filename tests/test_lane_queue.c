@@ -0,0 +1,124 @@
+/* lane_pop - weighted round robin over the lanes, and no lane starves
+   however busy the faster ones are */
+#include <inc/lane_queue.h>
+#include <tests/harness.h>
+
+#define INIT  //Initialize settings
+#include <inc/setting.h>
+
+#define PER_LANE 64
+#define ROUND (LANE_WEIGHT_CONTROL + LANE_WEIGHT_CHAT + LANE_WEIGHT_BULK + LANE_WEIGHT_NOTICE)
+
+const int weights[LANE_COUNT] = {
+    LANE_WEIGHT_CONTROL, LANE_WEIGHT_CHAT, LANE_WEIGHT_BULK, LANE_WEIGHT_NOTICE};
+
+void push(Lane_queue *queue, Lane lane, int n) {
+  char text[MAX_MSG_LEN];
+
+  snprintf(text, MAX_MSG_LEN, "%d %d", lane, n);
+  lane_push(queue, compose_message(text, "0", "test"), lane);
+
+  return;
+}
+
+/* The lane it was pushed on, and checks it came in order */
+int pop(Lane_queue *queue, int *next) {
+  Msg *msg = lane_pop(queue);
+  int lane, n;
+
+  CHECK(msg != NULL, "the queue ran dry early");
+  CHECK(sscanf(msg->msg, "%d %d", &lane, &n) == 2, "a message came back garbled");
+  CHECK(n == next[lane]++, "lane %d out of order", lane);
+
+  free(msg);
+
+  return lane;
+}
+
+/* 8/4/2/1 of every round while all lanes are busy */
+void weighted(void) {
+  Lane_queue queue;
+  int next[LANE_COUNT] = {0}, counts[LANE_COUNT];
+
+  lane_queue_init(&queue);
+
+  for (int i = 0; i < PER_LANE; i++)
+    for (int lane = 0; lane < LANE_COUNT; lane++)
+      push(&queue, lane, i);
+
+  for (int round = 0; round < PER_LANE / LANE_WEIGHT_CONTROL; round++) {
+    memset(counts, 0, sizeof(counts));
+
+    for (int i = 0; i < ROUND; i++)
+      counts[pop(&queue, next)]++;
+
+    for (int lane = 0; lane < LANE_COUNT; lane++)
+      CHECK(
+          counts[lane] == weights[lane],
+          "round %d: lane %d got %d of %d", round, lane, counts[lane], weights[lane]);
+  }
+
+  lane_queue_free(&queue);
+
+  return;
+}
+
+/* Control refilled after every pop still leaves notices a turn each round */
+void no_starvation(void) {
+  Lane_queue queue;
+  int next[LANE_COUNT] = {0}, pushed = 0, since_notice = 0, notices = 0, lane;
+
+  lane_queue_init(&queue);
+
+  for (int i = 0; i < 4; i++)
+    push(&queue, LANE_NOTICE, i);
+
+  for (int i = 0; i < LANE_WEIGHT_CONTROL; i++)
+    push(&queue, LANE_CONTROL, pushed++);
+
+  while (notices < 4) {
+    if ((lane = pop(&queue, next)) == LANE_NOTICE) {
+      notices++;
+      since_notice = 0;
+    } else {
+      push(&queue, LANE_CONTROL, pushed++);
+      CHECK(++since_notice <= LANE_WEIGHT_CONTROL, "notices starved behind %d pings", since_notice);
+    }
+  }
+
+  lane_queue_free(&queue);
+
+  return;
+}
+
+/* Tickets are held until their message is popped */
+void tickets(void) {
+  Lane_queue queue;
+  int next[LANE_COUNT] = {0};
+  uint64_t first, second;
+
+  lane_queue_init(&queue);
+
+  first = lane_push(&queue, compose_message("1 0", "0", "test"), LANE_CHAT);
+  second = lane_push(&queue, compose_message("1 1", "0", "test"), LANE_CHAT);
+
+  CHECK(lane_holds(&queue, LANE_CHAT, first) && lane_holds(&queue, LANE_CHAT, second), "waiting tickets not held");
+  pop(&queue, next);
+  CHECK(!lane_holds(&queue, LANE_CHAT, first), "a popped ticket is still held");
+  CHECK(lane_holds(&queue, LANE_CHAT, second), "a waiting ticket isn't held");
+  CHECK(!lane_holds(&queue, LANE_BULK, 0), "ticket 0 is held");
+
+  lane_queue_free(&queue);
+
+  return;
+}
+
+int main(void) {
+  weighted();
+  no_starvation();
+  tickets();
+
+  printf("lanes served by weight\n");
+
+  return 0;
+}
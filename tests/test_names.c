@@ -0,0 +1,58 @@
+/* A name belongs to whoever took it first - a client claiming it too is told,
+   and direct messages keep going to the holder, before and after */
+#include <tests/harness.h>
+
+#define INIT  //Initialize settings
+#include <inc/setting.h>
+
+#define TAKEN_REPLY "That name is taken - direct messages won't reach you by it."
+
+/* Whether the client gets text within the time */
+bool gets(Test_client *client, char *text, int timeout_ms) {
+  uint64_t start = get_monotonic_nanosecs();
+  Msg msg;
+
+  while (client_receive(client, &msg, timeout_ms - (int)elapsed_ms(start)) == 1) {
+    if (!strcmp(msg.msg, text))
+      return true;
+  }
+
+  return false;
+}
+
+int main(void) {
+  char *args[] = {NULL};
+  Test_server server;
+  Test_client alice, impostor, bob;
+
+  test_init();
+  server_start(&server, args);
+
+  CHECK(client_connect(&alice, &server, "alice") == 0, "alice can't connect");
+  CHECK(client_connect(&bob, &server, "bob") == 0, "bob can't connect");
+  usleep(200000);
+
+  CHECK(client_connect(&impostor, &server, "alice") == 0, "the impostor can't connect");
+  CHECK(gets(&impostor, TAKEN_REPLY, 2000), "the impostor wasn't told the name is taken");
+
+  CHECK(client_send(&bob, "/" C_DIRECT_MSG " alice first") == 0, "bob can't send");
+  CHECK(gets(&alice, "(dm) first", 2000), "alice lost her direct messages");
+  CHECK(!gets(&impostor, "(dm) first", 500), "the impostor got alice's direct message");
+
+  /* Dropping a name it never held leaves the holder's alone */
+  snprintf(impostor.name, MAX_USERNAME_LEN, "%s", "mallory");
+  CHECK(client_send(&impostor, "/" C_CHANGE_USERNAME) == 0, "the impostor can't rename");
+  client_close(&impostor);
+  usleep(200000);
+
+  CHECK(client_send(&bob, "/" C_DIRECT_MSG " alice second") == 0, "bob can't send");
+  CHECK(gets(&alice, "(dm) second", 2000), "alice can't be reached by name anymore");
+
+  client_close(&alice);
+  client_close(&bob);
+  server_stop(&server);
+
+  printf("names stay with their first holder\n");
+
+  return 0;
+}
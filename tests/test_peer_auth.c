@@ -0,0 +1,134 @@
+/* Only a host with the federation's key (-F) is taken for a peer - any other
+   client saying "/peer" is dropped before a relay batch of its gets through */
+#include <inc/relay.h>
+#include <tests/harness.h>
+
+#define INIT  //Initialize settings
+#include <inc/setting.h>
+
+#define TEST_PEER_KEY "test federation"
+#define FORGED_ID 0x1234abcd
+#define ROOM "den"
+
+/* The proof a linking host sends, as the host computes it */
+void prove(Test_client *client, char *key, char *proof) {
+  char nonce_hex[KEY_NONCE_HEX], data[MAX_BUFFER];
+  uint8_t mac[BYTES_IN_256];
+  int size;
+
+  bytes_to_hex(client->key_nonce, KEY_NONCE_BYTES, nonce_hex);
+  size = snprintf(
+      data, MAX_BUFFER, "%08" PRIx32 " %s %08x link",
+      client->salt, nonce_hex, FORGED_ID);
+
+  hmac_sha256(key, strlen(key), data, size, mac);
+  bytes_to_hex(mac, BYTES_IN_256, proof);
+
+  return;
+}
+
+/* A relay batch with one chat message for ROOM, as if another host broadcast it */
+void inject(Test_client *client, char *text, uint64_t seq) {
+  char batch[MAX_BATCH_SIZE], *ascii_packet;
+  int filled = 0, size;
+  Msg msg = compose_message(text, NULL, client->name);
+
+  msg.origin = FORGED_ID;
+  msg.origin_seq = seq;
+  snprintf(msg.room_name, MAX_ROOM_NAME, "%s", ROOM);
+
+  ascii_packet = message_to_ascii_packet(&msg, &size);
+  relay_append(batch, &filled, &msg, ascii_packet, size);
+  client_send_packet(client, batch, filled);
+
+  free(ascii_packet);
+
+  return;
+}
+
+/* Whether the watcher gets text within the time */
+bool sees(Test_client *watcher, char *text, int timeout_ms) {
+  uint64_t start = get_monotonic_nanosecs();
+  Msg msg;
+
+  while (client_receive(watcher, &msg, timeout_ms - (int)elapsed_ms(start)) == 1) {
+    if (!strcmp(msg.msg, text))
+      return true;
+  }
+
+  return false;
+}
+
+/* Says "/peer args" and follows it up with a relay batch right away */
+void try_peer(Test_server *server, Test_client *watcher, char *name, char *proof_key, bool bare) {
+  char line[MAX_MSG_LEN], proof[PEER_PROOF_HEX] = "", text[MAX_MSG_LEN];
+  Test_client forger;
+
+  CHECK(client_connect(&forger, server, name) == 0, "%s can't connect", name);
+
+  if (proof_key != NULL)
+    prove(&forger, proof_key, proof);
+  else if (!bare)
+    memset(proof, '0', PEER_PROOF_HEX - 1);
+
+  if (bare)
+    snprintf(line, MAX_MSG_LEN, "/" C_PEER);
+  else
+    snprintf(line, MAX_MSG_LEN, "/" C_PEER " %08x %s", FORGED_ID, proof);
+
+  snprintf(text, MAX_MSG_LEN, "injected by %s", name);
+
+  CHECK(client_send(&forger, line) == 0, "%s can't send", name);
+  inject(&forger, text, 1);
+
+  CHECK(client_closed(&forger, 2000), "%s was taken for a peer", name);
+  CHECK(!sees(watcher, text, 500), "%s's relay got through", name);
+
+  client_close(&forger);
+
+  return;
+}
+
+void run(char *engine) {
+  char *args[] = {"-e", engine, "-F", TEST_PEER_KEY, NULL};
+  char proof[PEER_PROOF_HEX], line[MAX_MSG_LEN];
+  Test_server server;
+  Test_client watcher, peer;
+
+  server_start(&server, args);
+
+  CHECK(client_connect(&watcher, &server, "watcher") == 0, "watcher can't connect");
+  CHECK(client_send(&watcher, "/" C_JOIN " " ROOM) == 0, "watcher can't join");
+  usleep(200000);
+
+  try_peer(&server, &watcher, "bare", NULL, true);
+  try_peer(&server, &watcher, "zeros", NULL, false);
+  try_peer(&server, &watcher, "guesser", "not the key", false);
+
+  /* The key does it - so it's the proof that kept the others out */
+  CHECK(client_connect(&peer, &server, "peer") == 0, "peer can't connect");
+  prove(&peer, TEST_PEER_KEY, proof);
+  snprintf(line, MAX_MSG_LEN, "/" C_PEER " %08x %s", FORGED_ID, proof);
+  CHECK(client_send(&peer, line) == 0, "peer can't send");
+  inject(&peer, "relayed by a peer", 1);
+
+  CHECK(sees(&watcher, "relayed by a peer", 2000), "%s: the keyed peer's relay didn't come through", engine);
+
+  client_close(&peer);
+  client_close(&watcher);
+  server_stop(&server);
+
+  printf("%s: unproven peers dropped\n", engine);
+
+  return;
+}
+
+int main(void) {
+  test_init();
+
+  run("threads");
+  run("epoll");
+  run("uring");  // epoll again where the kernel has no io_uring
+
+  return 0;
+}
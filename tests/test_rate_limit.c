@@ -0,0 +1,92 @@
+/* A throttled client must not slow anyone else down - on an io engine the
+   limit holds the flooder's socket instead of stalling the loop */
+#include <tests/harness.h>
+
+#define INIT  //Initialize settings
+#include <inc/setting.h>
+
+#define FLOOD_MSGS 20 // 5 pass with the burst, the rest take 3s at 5/s
+#define QUIET_MSGS 10
+#define QUIET_GAP_MS 200
+#define MAX_LATENCY_MS 150
+#define FLOOD_MIN_SPREAD_MS 2000
+
+/* Waits for the client's own message, counting the flood on the way */
+int await_own(Test_client *client, char *text, int *flood_seen) {
+  uint64_t start = get_monotonic_nanosecs();
+  Msg msg;
+
+  while (client_receive(client, &msg, 2000) == 1) {
+    if (!strcmp(msg.username, "flood"))
+      (*flood_seen)++;
+
+    if (!strcmp(msg.username, client->name) && !strcmp(msg.msg, text))
+      return elapsed_ms(start);
+  }
+
+  return -1;
+}
+
+void run(char *engine) {
+  char *args[] = {"-e", engine, "-L", "5:0:0", NULL}, text[MAX_MSG_LEN];
+  int latency, worst = 0, flood_seen = 0;
+  uint64_t flood_start;
+  Test_server server;
+  Test_client flood, quiet;
+  Msg msg;
+
+  server_start(&server, args);
+
+  CHECK(client_connect(&quiet, &server, "quiet") == 0, "quiet can't connect");
+  CHECK(client_connect(&flood, &server, "flood") == 0, "flood can't connect");
+  usleep(300000);
+
+  /* All at once - the host takes what the limit lets through */
+  flood_start = get_monotonic_nanosecs();
+
+  for (int i = 0; i < FLOOD_MSGS; i++) {
+    snprintf(text, MAX_MSG_LEN, "flood %d", i);
+    CHECK(client_send(&flood, text) == 0, "flood can't send");
+  }
+
+  for (int i = 0; i < QUIET_MSGS; i++) {
+    snprintf(text, MAX_MSG_LEN, "quiet %d", i);
+    CHECK(client_send(&quiet, text) == 0, "quiet can't send");
+    CHECK((latency = await_own(&quiet, text, &flood_seen)) != -1, "%s: quiet %d never came back", engine, i);
+
+    if (latency > worst)
+      worst = latency;
+
+    usleep(QUIET_GAP_MS * 1000);
+  }
+
+  CHECK(
+      worst <= MAX_LATENCY_MS,
+      "%s: quiet waited %d ms behind the throttled flood", engine, worst);
+
+  /* Held, not dropped - all of it arrives, at the limit's pace */
+  while (flood_seen < FLOOD_MSGS && client_receive(&quiet, &msg, 2000) == 1)
+    flood_seen += !strcmp(msg.username, "flood");
+
+  CHECK(flood_seen == FLOOD_MSGS, "%s: %d of the flood came through", engine, flood_seen);
+  CHECK(
+      elapsed_ms(flood_start) >= FLOOD_MIN_SPREAD_MS,
+      "%s: the flood wasn't throttled", engine);
+
+  client_close(&flood);
+  client_close(&quiet);
+  server_stop(&server);
+
+  printf("%s: quiet at most %d ms behind\n", engine, worst);
+
+  return;
+}
+
+int main(void) {
+  test_init();
+
+  run("epoll");
+  run("uring");  // epoll again where the kernel has no io_uring
+
+  return 0;
+}
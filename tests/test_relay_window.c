@@ -0,0 +1,63 @@
+/* relay_is_new - every id of an origin is broadcast once, however the copies
+   arrive, and a host that stops relaying makes room for another */
+#include <inc/relay.h>
+#include <tests/harness.h>
+
+#define INIT  //Initialize settings
+#include <inc/setting.h>
+
+#define ORIGIN 0xa1
+
+void window(void) {
+  CHECK(relay_is_new(ORIGIN, 100), "the first id wasn't new");
+  CHECK(!relay_is_new(ORIGIN, 100), "a duplicate was new");
+
+  /* Out of order, inside the window */
+  CHECK(relay_is_new(ORIGIN, 103), "an id ahead wasn't new");
+  CHECK(relay_is_new(ORIGIN, 101), "a late id wasn't new");
+  CHECK(relay_is_new(ORIGIN, 102), "a late id wasn't new");
+  CHECK(!relay_is_new(ORIGIN, 101), "a late duplicate was new");
+  CHECK(!relay_is_new(ORIGIN, 103), "a duplicate of the highest was new");
+
+  /* The window's far edge - just inside is told apart, just outside is a copy */
+  CHECK(relay_is_new(ORIGIN, 103 - RELAY_WINDOW + 1), "the window's oldest id wasn't new");
+  CHECK(!relay_is_new(ORIGIN, 103 - RELAY_WINDOW + 1), "the window's oldest id came twice");
+  CHECK(!relay_is_new(ORIGIN, 103 - RELAY_WINDOW), "an id older than the window was new");
+
+  /* A jump past the whole window starts it over */
+  CHECK(relay_is_new(ORIGIN, 103 + 2 * RELAY_WINDOW), "a far jump wasn't new");
+  CHECK(relay_is_new(ORIGIN, 103 + 2 * RELAY_WINDOW - 1), "the id before a jump wasn't new");
+  CHECK(!relay_is_new(ORIGIN, 103 + 2 * RELAY_WINDOW - 1), "the id before a jump came twice");
+
+  return;
+}
+
+/* The least recently heard origin is forgotten for a new one */
+void eviction(void) {
+  uint32_t first = 0x1000;
+
+  for (uint32_t i = 0; i < MAX_ORIGINS; i++)
+    CHECK(relay_is_new(first + i, 1), "origin %u wasn't new", i);
+
+  /* Heard again, so the next oldest goes instead */
+  CHECK(!relay_is_new(first, 1), "origin 0 forgot its id");
+
+  CHECK(relay_is_new(first + MAX_ORIGINS, 1), "one origin too many wasn't new");
+  CHECK(!relay_is_new(first, 1), "the recently heard origin was evicted");
+  CHECK(relay_is_new(first + 1, 1), "the least recently heard origin was kept");
+
+  /* Everyone else is still remembered */
+  for (uint32_t i = 3; i < MAX_ORIGINS; i++)
+    CHECK(!relay_is_new(first + i, 1), "origin %u was evicted", i);
+
+  return;
+}
+
+int main(void) {
+  window();
+  eviction();
+
+  printf("relay ids told apart\n");
+
+  return 0;
+}
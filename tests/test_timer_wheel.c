@@ -0,0 +1,75 @@
+/* Timers beyond the first level fire on their tick after being cascaded
+   down - the wheel is stepped by hand, its thread never runs */
+#include <inc/timer_wheel.h>
+#include <tests/harness.h>
+
+#define INIT  //Initialize settings
+#include <inc/setting.h>
+
+void tick(void);
+extern uint64_t current_tick;
+
+uint64_t fired_at;
+int fired;
+
+void note_fire(void *_) {
+  fired_at = current_tick;
+  fired++;
+
+  return;
+}
+
+/* Arms at the first tick from at on, ticks ahead - steps until it fires */
+void check_fires(uint64_t at, uint64_t ticks) {
+  uint64_t start;
+  Timer timer;
+
+  while (current_tick < at)
+    tick();
+
+  start = current_tick;
+
+  fired = 0;
+  timer_init(&timer, note_fire, NULL);
+  timer_arm(&timer, ticks * TIMER_TICK_MS);
+
+  while (fired == 0 && current_tick < start + ticks + WHEEL_SLOTS)
+    tick();
+
+  CHECK(
+      fired == 1 && fired_at == start + ticks,
+      "armed at %lu for %lu ticks, fired %d times, last at %lu",
+      start, ticks, fired, fired_at);
+
+  return;
+}
+
+int main(void) {
+  check_fires(0, 1);
+  check_fires(0, WHEEL_SLOTS - 1);  // the last of level 0
+
+  /* Level 1, cascaded down at the next multiple of WHEEL_SLOTS */
+  check_fires(2 * WHEEL_SLOTS, WHEEL_SLOTS);  // expires right on a cascade boundary
+  check_fires(0, WHEEL_SLOTS + 36);
+  check_fires(7 * WHEEL_SLOTS - 14, WHEEL_SLOTS + 6);  // crosses a boundary right after arming
+
+  /* Level 2, cascaded twice */
+  check_fires(5000, WHEEL_SLOTS * WHEEL_SLOTS + 904);
+
+  /* A cancelled timer never fires */
+  Timer timer;
+
+  fired = 0;
+  timer_init(&timer, note_fire, NULL);
+  timer_arm(&timer, 3 * WHEEL_SLOTS * TIMER_TICK_MS);
+  timer_cancel(&timer);
+
+  for (int i = 0; i < 4 * WHEEL_SLOTS; i++)
+    tick();
+
+  CHECK(fired == 0, "a cancelled timer fired");
+
+  printf("timers fire on their tick\n");
+
+  return 0;
+}
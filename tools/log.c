@@ -0,0 +1,140 @@
+/* Reads the message log written with `clm -h -l dir` - see `make tools` */
+#include <inc/general.h>
+#include <inc/msg_log.h>
+#include <inc/name_map.h>
+#include <inc/socket_utilities.h>
+
+#define INIT  //Initialize settings
+#include <inc/setting.h>
+
+#define MAX_TALLIES 1024
+
+typedef struct _tally{
+    char name[MAX_USERNAME_LEN];
+    uint64_t messages;
+    uint64_t bytes;
+}Tally;
+
+/* Per room and per user counts for the summary */
+Tally rooms_seen[MAX_TALLIES], users_seen[MAX_TALLIES];
+int room_count = 0, user_count = 0;
+Name_map room_index, user_index;
+
+void count(Tally *tallies, int *tally_count, Name_map *index, char *name, uint32_t size) {
+  int i;
+
+  if ((i = name_map_get(index, name)) == -1) {
+    if (*tally_count == MAX_TALLIES || name_map_put(index, name, *tally_count))
+      return;
+
+    i = (*tally_count)++;
+    snprintf(tallies[i].name, MAX_USERNAME_LEN, "%s", name);
+  }
+
+  tallies[i].messages++;
+  tallies[i].bytes += size;
+
+  return;
+}
+
+void print_tallies(char *what, Tally *tallies, int tally_count) {
+  printf("\n%-20s %10s %12s\n", what, "messages", "bytes");
+
+  for (int i = 0; i < tally_count; i++)
+    printf("%-20s %10" PRIu64 " %12" PRIu64 "\n", tallies[i].name, tallies[i].messages, tallies[i].bytes);
+
+  return;
+}
+
+void print_record(Msg_log_record *record, Msg *msg) {
+  char date[32];
+  time_t secs = record->timestamp / NANOSECS_IN_SEC;
+
+  strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+  printf("%s [%s] %s: %s\n", date, record->room, msg->username, msg->msg);
+
+  return;
+}
+
+int main(int argc, char *argv[]) {
+  char *dir = NULL, *room = NULL, path[MAX_PATH_STR + 32], name[MAX_USERNAME_LEN];
+  bool summary = false;
+  uint64_t records = 0, bytes = 0;
+  uint32_t *ids;
+  int opt, segments;
+  Msg_log_reader reader;
+  Msg_log_record record;
+  Msg msg;
+
+  while ((opt = getopt(argc, argv, "d:r:s")) != -1) {
+    switch (opt) {
+      case 'd':
+        dir = optarg;
+        break;
+
+      /* Only one room's messages */
+      case 'r':
+        room = optarg;
+        break;
+
+      /* Counts per room and user instead of the messages */
+      case 's':
+        summary = true;
+        break;
+
+      case '?':
+        dir = NULL;
+        break;
+    }
+  }
+
+  if (dir == NULL) {
+    fprintf(stderr, "Usage: %s -d log_dir [-r room] [-s]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((segments = msg_log_segments(dir, &ids)) == -1)
+    exit(EXIT_FAILURE);
+
+  init_name_map(&room_index);
+  init_name_map(&user_index);
+
+  for (int i = 0; i < segments; i++) {
+    snprintf(path, sizeof(path), "%s/" MSG_LOG_SEGMENT_NAME, dir, ids[i]);
+
+    if (msg_log_open_segment(path, &reader)) {
+      fprintf(stderr, "Skipping %s - %s\n", path, strerror(errno));
+      continue;
+    }
+
+    while (!msg_log_read_record(&reader, &record)) {
+      if (room != NULL && strcmp(room, record.room))
+        continue;
+
+      msg = ascii_packet_to_message(record.packet, record.size);
+      records++;
+      bytes += record.size;
+
+      if (!summary) {
+        print_record(&record, &msg);
+        continue;
+      }
+
+      strip_username_colors(name, msg.username);
+      count(rooms_seen, &room_count, &room_index, record.room, record.size);
+      count(users_seen, &user_count, &user_index, name, record.size);
+    }
+
+    msg_log_close_segment(&reader);
+  }
+
+  free(ids);
+
+  if (summary) {
+    printf("segments %d\nmessages %" PRIu64 "\nbytes    %" PRIu64 "\n", segments, records, bytes);
+    print_tallies("room", rooms_seen, room_count);
+    print_tallies("user", users_seen, user_count);
+  }
+
+  return 0;
+}
@@ -0,0 +1,295 @@
+/* Replays a capture recorded with `clm -h -C file` - see `make tools` */
+#include <inc/capture.h>
+#include <inc/client.h>
+#include <inc/crypt.h>
+#include <inc/general.h>
+#include <inc/message.h>
+#include <inc/seal_pool.h>
+#include <inc/server.h>
+#include <inc/socket_utilities.h>
+#include <inc/stats.h>
+
+#define INIT  //Initialize settings
+#include <inc/setting.h>
+
+#define DEFAULT_RECIPIENTS 4
+#define MAX_REPLAY_CONNS 1024
+#define DRAIN_IDLE_SEC 1
+
+typedef struct _replay_conn{
+    uint32_t conn_id;
+    int socket;
+    uint64_t ctr;
+    uint32_t salt;
+    Suite suite;
+    uint8_t key_nonce[KEY_NONCE_BYTES];
+    gcry_cipher_hd_t aes_gcm_handle;
+    pthread_t drain_thread;
+}Replay_conn;
+
+Replay_conn conns[MAX_REPLAY_CONNS];
+int conn_count = 0;
+_Atomic uint64_t drained_bytes = 0;
+bool fast = false;
+
+/* Sleeps until the record is due, relative to the replay start */
+void wait_for_record(uint64_t start, uint64_t timestamp) {
+  if (fast)
+    return;
+
+  uint64_t now = get_monotonic_nanosecs() - start;
+
+  if (timestamp > now) {
+    struct timespec sleep_time = nanosec_to_timespec(timestamp - now);
+    nanosleep(&sleep_time, NULL);
+  }
+
+  return;
+}
+
+void *drain_socket(void *p_socket) {
+  int socket = *(int *)p_socket;
+  char buffer[FRAME_BUFFER_BYTES];
+  ssize_t received;
+  fd_set ready_socks;
+
+  while (true) {
+    FD_ZERO(&ready_socks);
+    FD_SET(socket, &ready_socks);
+
+    if (select(socket + 1, &ready_socks, NULL, NULL, &(struct timeval){.tv_sec = DRAIN_IDLE_SEC}) <= 0)
+      continue;
+
+    if ((received = recv(socket, buffer, sizeof(buffer), 0)) <= 0)
+      return NULL;
+
+    drained_bytes += received;
+  }
+
+  return NULL;
+}
+
+void print_rate(char *what, uint64_t count, uint64_t nanosecs) {
+  printf(
+      "%-12s %10" PRIu64 " in %8.3f s = %12.1f /s\n",
+      what, count, (double)nanosecs / NANOSECS_IN_SEC,
+      count / ((double)nanosecs / NANOSECS_IN_SEC));
+
+  return;
+}
+
+/* Feeds the server's own broadcaster, recipients are socket pairs drained locally */
+int replay_pipeline(FILE *in, int recipients) {
+  pthread_t broadcaster;
+  Capture_record record;
+  uint64_t start, records = 0;
+  int pair[2];
+  Msg msg;
+
+  Client client;
+
+  if (recipients > MAX_REPLAY_CONNS)
+    recipients = MAX_REPLAY_CONNS;
+
+  init_clients();
+
+  for (int i = 0; i < recipients; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+      HANDLE_ERROR("Failed to create a socket pair", 1);
+    }
+
+    memset(&client, 0, sizeof(Client));
+    client.socket = pair[0];
+    init_cipher(&client.send_cipher, SUITE_AES256_GCM, NULL);  // only broadcast to
+    add_client(client);
+
+    conns[i].socket = pair[1];
+    pthread_create(&conns[i].drain_thread, NULL, drain_socket, &conns[i].socket);
+  }
+
+  seal_pool_start(connection.seal_workers);
+  pthread_create(&broadcaster, NULL, broadcast_message, NULL);
+
+  start = get_monotonic_nanosecs();
+
+  while (!capture_read_record(in, &record)) {
+    wait_for_record(start, record.timestamp);
+
+    msg = ascii_packet_to_message(record.payload, record.size);
+    snprintf(msg.id, ID_SIZE, "%" PRIu32, record.conn_id);
+    free(record.payload);
+
+    queue_broadcast(msg, LANE_CHAT);
+
+    records++;
+  }
+
+  /* Wait for the broadcaster to work through the queue */
+  while (stats_counter(STAT_MSGS_OUT) + stats_counter(STAT_DROPS) < records * recipients)
+    usleep(1000);
+
+  uint64_t elapsed = get_monotonic_nanosecs() - start;
+
+  pthread_cancel(broadcaster);
+  pthread_join(broadcaster, NULL);
+  seal_pool_stop();
+
+  print_rate("messages", records, elapsed);
+  print_rate("deliveries", records * recipients, elapsed);
+  printf("\n");
+  stats_dump(stdout);
+
+  return 0;
+}
+
+Replay_conn *find_conn(uint32_t conn_id) {
+  for (int i = 0; i < conn_count; i++) {
+    if (conns[i].conn_id == conn_id)
+      return &conns[i];
+  }
+
+  return NULL;
+}
+
+/* One client connection per recorded connection id, frames re-encrypted per connection */
+int replay_server(FILE *in) {
+  Capture_record record;
+  Replay_conn *conn;
+  uint64_t start, records = 0, bytes = 0;
+  long data_start = ftell(in);
+  int new_size;
+  char *enc_packet;
+
+  /* Connect everyone before the clock starts - Argon2 is slow on purpose */
+  while (!capture_read_record(in, &record)) {
+    free(record.payload);
+
+    if (find_conn(record.conn_id) != NULL || conn_count == MAX_REPLAY_CONNS)
+      continue;
+
+    conn = &conns[conn_count];
+    conn->conn_id = record.conn_id;
+
+    if ((conn->socket = connect_to_server(&conn->salt, &conn->suite, conn->key_nonce)) == -1) {
+      fprintf(stderr, "Connection %d was refused, is the server's -m high enough?\n", conn_count);
+      return 1;
+    }
+
+    conn->ctr = 0;
+    init_cipher(&conn->aes_gcm_handle, conn->suite, conn->key_nonce);
+    pthread_create(&conn->drain_thread, NULL, drain_socket, &conn->socket);
+
+    conn_count++;
+  }
+
+  printf("Connected %d clients\n", conn_count);
+
+  fseek(in, data_start, SEEK_SET);
+  start = get_monotonic_nanosecs();
+
+  while (!capture_read_record(in, &record)) {
+    wait_for_record(start, record.timestamp);
+
+    if ((conn = find_conn(record.conn_id)) != NULL) {
+      enc_packet = encrypt_packet(
+          record.payload, record.size, &new_size,
+          &conn->aes_gcm_handle, SALT_TO_SERVER(conn->salt), ++conn->ctr);
+
+      if (send(conn->socket, enc_packet, new_size, MSG_NOSIGNAL) > 0) {
+        bytes += new_size;
+        records++;
+      }
+
+      free(enc_packet);
+    }
+
+    free(record.payload);
+  }
+
+  uint64_t elapsed = get_monotonic_nanosecs() - start;
+
+  sleep(DRAIN_IDLE_SEC);
+
+  print_rate("messages", records, elapsed);
+  print_rate("bytes sent", bytes, elapsed);
+  printf("bytes received %" PRIu64 "\n", (uint64_t)drained_bytes);
+
+  for (int i = 0; i < conn_count; i++)
+    close(conns[i].socket);
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char *capture_path = NULL;
+  bool pipeline = true;
+  int opt, recipients = DEFAULT_RECIPIENTS;
+  FILE *in;
+
+  while ((opt = getopt(argc, argv, "i:m:n:fs:p:w:W:")) != -1) {
+    switch (opt) {
+      case 'i':
+        capture_path = optarg;
+        break;
+
+      /* pipeline (in-process broadcaster) or server (live clm -h) */
+      case 'm':
+        pipeline = strcmp(optarg, "server");
+        break;
+
+      /* Number of recipients in pipeline mode */
+      case 'n':
+        recipients = atoi(optarg);
+        break;
+
+      /* Threads sealing broadcasts next to the broadcaster in pipeline mode */
+      case 'W':
+        connection.seal_workers = atoi(optarg);
+        break;
+
+      /* As fast as possible instead of at the recorded speed */
+      case 'f':
+        fast = true;
+        break;
+
+      case 's':
+        set_connection_address(optarg);
+        break;
+
+      case 'p':
+        snprintf(connection.port, MAX_PORT_STR, "%s", optarg);
+        break;
+
+      case 'w':
+        snprintf(connection.password, MAX_PASSWORD_LEN, "%s", optarg);
+        break;
+
+      case '?':
+        capture_path = NULL;
+        break;
+    }
+  }
+
+  if (capture_path == NULL) {
+    fprintf(
+        stderr,
+        "Usage: %s -i capture [-f] [-m pipeline -n recipients -W workers]"
+        " [-m server -s ip -p port -w password]\n",
+        argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((in = capture_open_for_reading(capture_path)) == NULL) {
+    fprintf(stderr, "Failed to open capture %s - %s\n", capture_path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  srand(time(NULL));
+  init_libgcrypt(MAX_REPLAY_CONNS);
+
+  int status = (pipeline) ? replay_pipeline(in, recipients) : replay_server(in);
+
+  fclose(in);
+
+  return status;
+}